@@ -0,0 +1,364 @@
+/*
+ * Batched multi-file transfers (-d): many files travel over one connection, so a run over tens
+ * of thousands of small files pays for one TCP handshake and one process start instead of one
+ * each.
+ *
+ * The batch is a framed stream (see frame.c) announced by a header with NCP_F_BATCH. Every file
+ * starts with an NCP_CHUNK_FILE chunk carrying its size (8 bytes) and its relative name, followed
+ * by its data chunks; the NCP_CHUNK_END trailer closes the whole batch. The client writes all of
+ * it back to back without waiting for the server, and the socket is corked so that small files
+ * share segments. With -a every chunk, names included, is authenticated as usual.
+ *
+ * The server writes each file under its output directory. A name is only accepted if it stays
+ * inside that directory (no absolute paths, no "." or ".." components), and a file must carry
+ * exactly the number of bytes its FILE chunk announced.
+ *
+ * username: abdpatel@indiana.edu
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>			// for PATH_MAX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "nc_args_t.h"
+#include "proto.h"
+#include "frame.h"
+#include "batch.h"
+#include "stats.h"			// telemetry for -v
+#include "tune.h"			// socket options
+#include "compress.h"			// -z level
+#include "output.h"			// preallocation of received files
+
+int connectToServer(nc_args_t *);		// defined in client.c
+
+/**
+ * Sending side of one batch
+ **/
+typedef struct batch {
+    frame_ctx_t ctx;				// framed stream the files travel on
+    unsigned long files;			// files sent so far
+    off_t bytes;				// payload bytes sent so far
+} batch_t;
+
+/**
+ * Send the regular file 'path' under the name 'name'.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int sendFile(batch_t *b, const char *path, const char *name) {
+
+    unsigned char record[8 + PATH_MAX];		// FILE chunk payload: size, then name
+    size_t nameLen = strlen(name);
+    struct stat fileStat;
+    off_t sent;
+    int fd;
+
+    if (nameLen == 0 || nameLen > PATH_MAX) {
+	fprintf(stderr, "Client says: cannot name '%s' in a batch, skipped\n", path);
+	return 0;
+    }
+    if ( (fd = open(path, O_RDONLY)) < 0 || fstat(fd, &fileStat) < 0 ) {
+	fprintf(stderr, "Client says: could not open '%s'\n", path);
+	if (fd >= 0)
+	    close(fd);
+	return -1;
+    }
+
+    put64(record, fileStat.st_size);
+    memcpy(record + 8, name, nameLen);
+    if (frameSend(&b->ctx, NCP_CHUNK_FILE, record, 8 + nameLen) < 0
+	|| (sent = frameSendData(&b->ctx, fd, 0, fileStat.st_size)) < 0) {
+	close(fd);
+	return -1;
+    }
+    close(fd);
+
+    if (sent != fileStat.st_size) {		// the file shrank while it was sent; the server would reject the batch anyway
+	fprintf(stderr, "Client says: '%s' changed while it was being sent\n", path);
+	errno = EIO;
+	return -1;
+    }
+
+    b->files++;
+    b->bytes += sent;
+    return 0;
+}
+
+/**
+ * Send 'path' under the name 'name': a regular file as it is, a directory with everything
+ * below it. Symbolic links to directories are not followed, so a link cycle cannot loop.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int sendTree(batch_t *b, const char *path, const char *name) {
+
+    struct stat st;
+    struct dirent *entry;
+    char childPath[PATH_MAX], childName[PATH_MAX];
+    DIR *dir;
+    int status = 0;
+
+    if (lstat(path, &st) < 0) {
+	fprintf(stderr, "Client says: could not find '%s'\n", path);
+	return -1;
+    }
+    if (S_ISLNK(st.st_mode) && (stat(path, &st) < 0 || S_ISDIR(st.st_mode)))
+	return 0;				// dangling link, or link to a directory
+    if (S_ISREG(st.st_mode))
+	return sendFile(b, path, name);
+    if (!S_ISDIR(st.st_mode))
+	return 0;				// devices, sockets, fifos have no contents to send
+
+    if ( (dir = opendir(path)) == NULL ) {
+	fprintf(stderr, "Client says: could not read directory '%s'\n", path);
+	return -1;
+    }
+    while (status == 0 && (entry = readdir(dir)) != NULL) {
+	if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+	    continue;
+	if (snprintf(childPath, sizeof(childPath), "%s/%s", path, entry->d_name) >= (int) sizeof(childPath)
+	    || snprintf(childName, sizeof(childName), "%s%s%s", name, (name[0] != '\0') ? "/" : "", entry->d_name) >= (int) sizeof(childName)) {
+	    fprintf(stderr, "Client says: path below '%s' too long, skipped\n", path);
+	    continue;
+	}
+	status = sendTree(b, childPath, childName);
+    }
+    closedir(dir);
+
+    return status;
+}
+
+static int sendArg(batch_t *b, const char *arg);
+
+/**
+ * Send every path listed in the file 'list', one per line.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int sendList(batch_t *b, const char *list) {
+
+    FILE *fp;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int status = 0;
+
+    if ( (fp = fopen(list, "r")) == NULL ) {
+	fprintf(stderr, "Client says: could not open file list '%s'\n", list);
+	return -1;
+    }
+    while (status == 0 && (len = getline(&line, &cap, fp)) >= 0) {
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+	    line[--len] = '\0';
+	if (len > 0)
+	    status = sendArg(b, line);
+    }
+    free(line);
+    fclose(fp);
+
+    return status;
+}
+
+/**
+ * Send one command line argument: an "@list" file, or a file or directory which keeps its own
+ * base name on the server ("." and ".." put their contents directly into the output directory).
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int sendArg(batch_t *b, const char *arg) {
+
+    char path[PATH_MAX];
+    char *base;
+    size_t len;
+
+    if (arg[0] == BATCH_LIST_PREFIX)
+	return sendList(b, arg + 1);
+
+    if ( (len = strlen(arg)) >= sizeof(path) )
+	return -1;
+    memcpy(path, arg, len + 1);
+    while (len > 1 && path[len - 1] == '/')
+	path[--len] = '\0';
+
+    base = strrchr(path, '/');
+    base = (base != NULL) ? base + 1 : path;
+    if (strcmp(base, ".") == 0 || strcmp(base, "..") == 0 || base[0] == '\0')
+	base = "";
+
+    return sendTree(b, path, base);
+}
+
+off_t sendBatch(nc_args_t *nc_args) {
+
+    batch_t b;
+    ncp_hdr_t hdr;
+    int sockfd, i, status = 0;
+
+    memset(&b, 0, sizeof(b));
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.flags = NCP_F_FRAMED | NCP_F_BATCH
+	| (nc_args->encrypt ? NCP_F_GCM : (nc_args->authenticate ? NCP_F_HMAC : 0))
+	| ((compressLevel() != COMPRESS_OFF) ? NCP_F_COMPRESS : 0);
+    hdr.nstripes = 1;				// length and total stay 0, the batch is only sized by its trailer
+
+    sockfd = connectToServer(nc_args);
+    tuneLatency(sockfd, 1);			// nothing is awaited from the server, let small files share segments
+    if (sendHeader(sockfd, &hdr) < 0 || frameInit(&b.ctx, sockfd, &hdr) < 0) {
+	close(sockfd);
+	return -1;
+    }
+
+    for (i = 0; i < nc_args->nBatchPaths && status == 0; i++)
+	status = sendArg(&b, nc_args->batchPaths[i]);
+    if (status == 0)
+	status = frameFinish(&b.ctx);
+    frameFree(&b.ctx);
+
+    tuneFlush(sockfd);
+    statsTcpInfo(sockfd);
+    close(sockfd);
+
+    if (status < 0)
+	return -1;
+    printf("Client says: %lu files, %lld bytes sent\n", b.files, (long long) b.bytes);
+    return b.bytes;
+}
+
+/**
+ * Check that the relative file name 'name' stays inside the output directory.
+ *
+ * Return:
+ * 	1 if it is safe to use, 0 otherwise
+ **/
+static int safeName(const char *name) {
+
+    const char *p = name, *end;
+    size_t len;
+
+    if (name[0] == '\0' || name[0] == '/')
+	return 0;
+    while (*p != '\0') {
+	end = strchr(p, '/');
+	len = (end != NULL) ? (size_t) (end - p) : strlen(p);
+	if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+	    return 0;
+	p += len;
+	if (*p == '/')
+	    p++;
+    }
+    return 1;
+}
+
+/**
+ * Create the directories leading to 'path' below its first 'skip' bytes (the output directory).
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int makeParents(char *path, size_t skip) {
+
+    char *p;
+
+    for (p = path + skip + 1; (p = strchr(p, '/')) != NULL; p++) {
+	*p = '\0';
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+	    *p = '/';
+	    return -1;
+	}
+	*p = '/';
+    }
+    return 0;
+}
+
+off_t receiveBatch(int sockfd, const ncp_hdr_t *hdr, const char *outdir, unsigned long *files) {
+
+    frame_ctx_t ctx;
+    char path[PATH_MAX];
+    unsigned char *buf;
+    uint8_t type;
+    uint32_t len;
+    uint64_t size = 0, written = 0;		// announced and received bytes of the current file
+    uint64_t start;
+    off_t total = 0;
+    ssize_t n;
+    int outfd = -1, savedErrno;
+
+    *files = 0;
+    if (mkdir(outdir, 0755) < 0 && errno != EEXIST)
+	return -1;
+    if (frameInit(&ctx, sockfd, hdr) < 0)
+	return -1;
+    if ( (buf = malloc(NCP_MAX_CHUNK + 1)) == NULL ) {	// room for the terminating '\0' of a name
+	frameFree(&ctx);
+	return -1;
+    }
+
+    while (1) {
+	if (frameRecv(&ctx, &type, buf, &len) < 0)
+	    goto FAIL;
+
+	if (type == NCP_CHUNK_FILE || type == NCP_CHUNK_END) {
+	    // the previous file is complete only if it got every byte it announced
+	    if (outfd >= 0) {
+		close(outfd);
+		outfd = -1;
+		if (written != size)
+		    goto BAD;
+		(*files)++;
+	    }
+	    if (type == NCP_CHUNK_END)
+		break;
+
+	    buf[len] = '\0';
+	    if (len <= 8 || strlen((char *) buf + 8) != len - 8 || !safeName((char *) buf + 8)) {
+		fprintf(stderr, "Server says: batch names an unsafe file, rejected\n");
+		goto BAD;
+	    }
+	    size = get64(buf);
+	    written = 0;
+	    if (snprintf(path, sizeof(path), "%s/%s", outdir, (char *) buf + 8) >= (int) sizeof(path))
+		goto BAD;
+	    if (makeParents(path, strlen(outdir)) < 0 || (outfd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0
+		|| outputReserve(outfd, 0, size, 1) < 0)
+		goto FAIL;
+	} else if (type == NCP_CHUNK_DATA) {
+	    if (outfd < 0 || written + len > size)
+		goto BAD;
+	    start = statsStart();
+	    n = pwrite(outfd, buf, len, written);
+	    statsIo(STATS_DISK, start, len, n);
+	    if (n != (ssize_t) len)
+		goto FAIL;
+	    written += len;
+	    total += len;
+	} else
+	    goto BAD;
+    }
+
+    free(buf);
+    frameFree(&ctx);
+    return total;
+
+    BAD:
+    errno = EPROTO;
+    FAIL:
+    savedErrno = errno;
+    if (outfd >= 0)
+	close(outfd);
+    free(buf);
+    frameFree(&ctx);
+    errno = savedErrno;
+    return -1;
+}
@@ -0,0 +1,33 @@
+/*
+ * header file for batched multi-file transfers (-d)
+ */
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <sys/types.h>
+
+#include "nc_args_t.h"
+#include "proto.h"
+
+#define BATCH_LIST_PREFIX '@'			// "@file" names a file that lists one path per line
+
+/**
+ * Send every file named by nc_args->batchPaths (files, directories walked recursively, and
+ * "@list" files) over one connection, each introduced by an NCP_CHUNK_FILE chunk.
+ *
+ * Return:
+ * 	number of payload bytes sent, or -1 on error
+ **/
+off_t sendBatch(nc_args_t *nc_args);
+
+/**
+ * Receive the batch that follows header 'hdr' on 'sockfd' and write every file under the
+ * directory 'outdir', which is created if missing. Names that would leave 'outdir' are rejected.
+ *
+ * Return:
+ * 	number of payload bytes written, or -1 on error; '*files' is the number of files written
+ **/
+off_t receiveBatch(int sockfd, const ncp_hdr_t *hdr, const char *outdir, unsigned long *files);
+
+#endif
@@ -0,0 +1,283 @@
+#!/usr/bin/env python3
+#
+# Loopback benchmark harness for netcat_part (run through "make bench").
+#
+# For every combination of binary variant, transfer buffer size (-b), transfer mode, file size,
+# offset and concurrency the harness starts a real server and the client(s) on localhost and
+# reports:
+#
+#   * throughput in MB/s: payload bytes over the wall time from spawning the client(s) until
+#     the server holds all the data,
+#   * CPU seconds per GB: user + system time of server and client(s), from wait4(),
+#   * p50/p99 time to first byte: from spawning the client until its first byte reaches a
+#     receiver socket run by the harness itself, over --ttfb-runs runs.
+#
+# Results are printed as a table and optionally written as CSV and JSON, so regressions in
+# the transfer engine show up as numbers.
+#
+# username: abdpatel@indiana.edu
+
+import argparse
+import csv
+import json
+import os
+import selectors
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+# transfer modes: extra client options, extra server options, whether the persistent (-k)
+# server can take them (its event loop only drains plain streams)
+MODES = {
+    'plain':   ([], [], True),
+    'uring':   (['-u'], ['-u'], True),
+    'auth':    (['-a'], ['-a'], False),
+    'stripe4': (['-s', '4'], [], False),
+}
+
+UNITS = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+
+
+def parseSize(text):
+    """'16M' -> 16777216"""
+    text = text.strip().upper()
+    if text and text[-1] in UNITS:
+        return int(float(text[:-1]) * UNITS[text[-1]])
+    return int(text)
+
+
+def parseList(text, conv=str):
+    return [conv(item) for item in text.split(',') if item.strip()]
+
+
+def freePort():
+    """Ask the kernel for a currently unused TCP port."""
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+
+def isListening(port):
+    """Check /proc/net/tcp{,6} for a socket in LISTEN state on 'port' without connecting to it,
+    since connecting would use up the one-shot server's only accept()."""
+    for table in ('/proc/net/tcp', '/proc/net/tcp6'):
+        try:
+            with open(table) as f:
+                next(f)
+                for line in f:
+                    fields = line.split()
+                    if fields[3] == '0A' and int(fields[1].rsplit(':', 1)[1], 16) == port:
+                        return True
+        except OSError:
+            continue
+    return False
+
+
+def waitListening(port, proc, timeout=5.0):
+    deadline = time.monotonic() + timeout
+    while not isListening(port):
+        if proc.poll() is not None:
+            raise RuntimeError('server exited before listening (status %d)' % proc.returncode)
+        if time.monotonic() > deadline:
+            raise RuntimeError('server did not start listening on port %d' % port)
+        time.sleep(0.002)
+
+
+def reap(proc):
+    """Wait for 'proc' and return its CPU seconds (user + system)."""
+    _, status, usage = os.wait4(proc.pid, 0)
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    return usage.ru_utime + usage.ru_stime
+
+
+def makeInput(workdir, size):
+    path = os.path.join(workdir, 'input_%d.bin' % size)
+    if not os.path.exists(path):
+        with open(path, 'wb') as f:
+            left = size
+            while left > 0:
+                chunk = min(left, 1 << 20)
+                f.write(os.urandom(chunk))
+                left -= chunk
+    return path
+
+
+def runThroughput(binary, buffer, mode, path, size, offset, concurrency, workdir):
+    """One timed transfer of 'size - offset' bytes from each of 'concurrency' clients."""
+    clientOpts, serverOpts, _ = MODES[mode]
+    clientOpts = clientOpts + ['-b', buffer]
+    serverOpts = serverOpts + ['-b', buffer]
+    port = freePort()
+    payload = size - offset
+    outdir = tempfile.mkdtemp(dir=workdir)
+    devnull = subprocess.DEVNULL
+
+    if concurrency == 1:
+        server = subprocess.Popen([binary, '-l', '-p', str(port)] + serverOpts + ['localhost', os.path.join(outdir, 'out')],
+                                  stdout=devnull)
+    else:
+        server = subprocess.Popen([binary, '-l', '-k', '-p', str(port)] + serverOpts + ['localhost', os.path.join(outdir, 'out.%d')],
+                                  stdout=devnull)
+    waitListening(port, server)
+
+    start = time.monotonic()
+    clients = [subprocess.Popen([binary, '-p', str(port), '-o', str(offset)] + clientOpts + ['localhost', path], stdout=devnull)
+               for _ in range(concurrency)]
+    cpu = sum(reap(c) for c in clients)
+    failed = [c.returncode for c in clients if c.returncode != 0]
+
+    if concurrency == 1:
+        cpu += reap(server)
+    else:
+        # the persistent server never exits by itself; wait until it holds every byte
+        expected = payload * concurrency
+        deadline = time.monotonic() + 60
+        while sum(os.path.getsize(os.path.join(outdir, f)) for f in os.listdir(outdir)) < expected:
+            if time.monotonic() > deadline:
+                break
+            time.sleep(0.001)
+        server.send_signal(signal.SIGTERM)
+        cpu += reap(server)
+    elapsed = time.monotonic() - start
+
+    received = sum(os.path.getsize(os.path.join(outdir, f)) for f in os.listdir(outdir))
+    shutil.rmtree(outdir)
+    if failed or received != payload * concurrency:
+        raise RuntimeError('%s: transfer incomplete (%d of %d bytes, client status %s)'
+                           % (mode, received, payload * concurrency, failed))
+
+    total = payload * concurrency
+    return {
+        'seconds': elapsed,
+        'mb_per_s': total / (1 << 20) / elapsed if elapsed > 0 else 0.0,
+        'cpu_s_per_gb': cpu / (total / (1 << 30)) if total > 0 else 0.0,
+    }
+
+
+def runTtfb(binary, buffer, mode, path, offset):
+    """Time from spawning one client until its first byte arrives at a receiver run here. All
+    connections are drained to the end so that striped clients finish normally."""
+    clientOpts = MODES[mode][0] + ['-b', buffer]
+    sel = selectors.DefaultSelector()
+    listener = socket.socket()
+    listener.bind(('127.0.0.1', 0))
+    listener.listen(64)
+    listener.setblocking(False)
+    sel.register(listener, selectors.EVENT_READ)
+    port = listener.getsockname()[1]
+
+    start = time.monotonic()
+    client = subprocess.Popen([binary, '-p', str(port), '-o', str(offset)] + clientOpts + ['localhost', path],
+                              stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    first = None
+    open_conns = 0
+    while True:
+        for key, _ in sel.select(timeout=0.05):
+            if key.fileobj is listener:
+                conn, _ = listener.accept()
+                conn.setblocking(False)
+                sel.register(conn, selectors.EVENT_READ)
+                open_conns += 1
+                continue
+            data = key.fileobj.recv(1 << 20)
+            if data and first is None:
+                first = time.monotonic() - start
+            if not data:
+                sel.unregister(key.fileobj)
+                key.fileobj.close()
+                open_conns -= 1
+        if client.poll() is not None and open_conns == 0:
+            break
+    sel.close()
+    listener.close()
+    return first
+
+
+def percentile(values, pct):
+    values = sorted(values)
+    if not values:
+        return None
+    index = min(len(values) - 1, max(0, int(round(pct / 100.0 * len(values) + 0.5)) - 1))
+    return values[index]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Loopback benchmark for netcat_part')
+    parser.add_argument('--variant', action='append', default=[],
+                        help='name=path of a netcat_part binary to measure (repeatable; dflt: default=./netcat_part)')
+    parser.add_argument('--buffers', default='auto', help='comma list of -b transfer buffer sizes (e.g. 1K,128K,auto)')
+    parser.add_argument('--modes', default='plain,uring,auth,stripe4', help='comma list of: ' + ','.join(MODES))
+    parser.add_argument('--sizes', default='1M,16M,128M', help='comma list of file sizes (K/M/G suffixes)')
+    parser.add_argument('--offsets', default='0,1', help='comma list of -o offsets')
+    parser.add_argument('--concurrency', default='1,4', help='comma list of concurrent client counts')
+    parser.add_argument('--repeat', type=int, default=3, help='throughput runs per point, the best one is kept')
+    parser.add_argument('--ttfb-runs', type=int, default=20, help='runs per point for the time-to-first-byte percentiles')
+    parser.add_argument('--csv', help='write results as CSV to this file')
+    parser.add_argument('--json', help='write results as JSON to this file')
+    args = parser.parse_args()
+
+    variants = [v.split('=', 1) for v in args.variant] or [['default', './netcat_part']]
+    buffers = parseList(args.buffers)
+    modes = parseList(args.modes)
+    for mode in modes:
+        if mode not in MODES:
+            parser.error('unknown mode %r' % mode)
+    sizes = parseList(args.sizes, parseSize)
+    offsets = parseList(args.offsets, int)
+    concurrency = parseList(args.concurrency, int)
+
+    workdir = tempfile.mkdtemp(prefix='netcat_bench_')
+    results = []
+    header = '%-10s %-6s %-8s %10s %7s %5s %10s %10s %10s %10s' % ('variant', 'buffer', 'mode', 'size', 'offset', 'conc',
+                                                                    'MB/s', 'cpu s/GB', 'ttfb p50', 'ttfb p99')
+    print(header)
+    print('-' * len(header))
+    try:
+        for name, binary in variants:
+            for buffer in buffers:
+                for mode in modes:
+                    for size in sizes:
+                        path = makeInput(workdir, size)
+                        for offset in offsets:
+                            if offset >= size:
+                                continue
+                            ttfb = [t for t in (runTtfb(binary, buffer, mode, path, offset) for _ in range(args.ttfb_runs))
+                                    if t is not None]
+                            for conc in concurrency:
+                                if conc > 1 and not MODES[mode][2]:
+                                    continue
+                                best = max((runThroughput(binary, buffer, mode, path, size, offset, conc, workdir)
+                                            for _ in range(args.repeat)), key=lambda r: r['mb_per_s'])
+                                row = {
+                                    'variant': name, 'buffer': buffer, 'mode': mode, 'size': size, 'offset': offset,
+                                    'concurrency': conc,
+                                    'seconds': round(best['seconds'], 6),
+                                    'mb_per_s': round(best['mb_per_s'], 2),
+                                    'cpu_s_per_gb': round(best['cpu_s_per_gb'], 3),
+                                    'ttfb_p50_ms': round(percentile(ttfb, 50) * 1000, 3) if ttfb else None,
+                                    'ttfb_p99_ms': round(percentile(ttfb, 99) * 1000, 3) if ttfb else None,
+                                }
+                                results.append(row)
+                                print('%-10s %-6s %-8s %10d %7d %5d %10.1f %10.3f %10s %10s' % (
+                                    name, buffer, mode, size, offset, conc, row['mb_per_s'], row['cpu_s_per_gb'],
+                                    row['ttfb_p50_ms'], row['ttfb_p99_ms']))
+                                sys.stdout.flush()
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    if args.csv:
+        with open(args.csv, 'w', newline='') as f:
+            writer = csv.DictWriter(f, fieldnames=list(results[0].keys()) if results else [])
+            writer.writeheader()
+            writer.writerows(results)
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
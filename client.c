@@ -5,7 +5,11 @@
  * The TCP client needs to go through the following steps
  * 1. Create a TCP socket using socket()
  * 2. Establish a connection with server using connect()
- * 3. Send data to server using write()
+ * 3. Send data to server using write(), or sendfile() for files (see transfer.c); with -a the data
+ *    goes out as authenticated chunk frames instead (see frame.c), with -D as a delta against the
+ *    server's copy (see delta.c), with -c as the content-defined chunks the server lacks (see
+ *    dedup.c); with -R standard input is relayed instead, and whatever the server sends back
+ *    goes to standard output (see relay.c)
  * 4. Close communication with server using close()
  *
  * username: abdpatel@indiana.edu
@@ -23,12 +27,129 @@
 #include <arpa/inet.h>			// for sockaddr_in, inet_ntoa(), etc.
 #include <netdb.h>			// functions to access db that maps host names with host numbers
 #include <sys/types.h>			// for data types
+#include <sys/stat.h>			// for fstat()
+#include <errno.h>
 
 #include "nc_args_t.h"
 #include "prompt_error.h"
+#include "transfer.h"			// zero-copy and buffered send paths
+#include "stripe.h"			// parallel multi-stream file transfer
+#include "proto.h"			// transfer header and NCP_F_* bits
+#include "frame.h"			// chunk frames with streaming HMAC (key from shared_key.h)
+#include "uring.h"			// io_uring backend for -u
+#include "stats.h"			// telemetry for -v
+#include "tune.h"			// buffer sizes and socket options
+#include "batch.h"			// many files over one connection
+#include "delta.h"			// rsync-style delta against the server's copy
+#include "merkle.h"			// parallel Merkle-tree digest for -M
+#include "compress.h"			// -z level
+#include "udp.h"			// datagram mode for -U
+#include "local.h"			// unix: and shm: addresses
+#include "resolve.h"			// happy-eyeballs connect
+#include "relay.h"			// stdin/stdout relay for -R
+#include "dedup.h"			// content-defined chunks for -c
 
-#include <openssl/hmac.h>		// need to add -lssl to compile
-#include "shared_key.h"			// make client aware of the shared key
+/**
+ * Connect a TCP socket to the server described by nc_args, racing its addresses (see
+ * resolve.c), or a Unix domain socket for a unix: address.
+ *
+ * Return:
+ * 	connected socket descriptor; the program exits if the connection fails
+ **/
+int connectToServer(nc_args_t *nc_args) {
+
+    int sockfd;
+
+    if (nc_args->local == LOCAL_UNIX)
+	sockfd = localConnect(nc_args);
+    else
+	sockfd = resolveConnect(nc_args);
+    if (sockfd < 0)
+	promptError((char *) "Connection could not be established to server");
+
+    return sockfd;
+}
+
+/**
+ * Work out which protocol features (NCP_F_* bits) the user's options ask for. A transfer
+ * with no bits set is announced with a plain header and goes out as raw bytes after it.
+ *
+ * Return:
+ * 	the NCP_F_* bits
+ **/
+static uint32_t transferFlags(nc_args_t *nc_args) {
+
+    uint32_t flags = 0;
+
+    if (nc_args->encrypt)				// the GCM tag authenticates each chunk, no HMAC on top
+	flags |= NCP_F_FRAMED | NCP_F_GCM;
+    else if (nc_args->authenticate)
+	flags |= NCP_F_FRAMED | NCP_F_HMAC;
+    if (nc_args->resume && !nc_args->message_mode)	// a message is always sent whole
+	flags |= NCP_F_RESUME;
+    if (nc_args->delta)					// signatures and block references travel as chunk frames
+	flags |= NCP_F_FRAMED | NCP_F_DELTA;
+    if (compressLevel() != COMPRESS_OFF)		// compressed chunks are frames as well
+	flags |= NCP_F_FRAMED | NCP_F_COMPRESS;
+    if (nc_args->dedup)					// chunk hashes, the server's answer and the chunks are all frames
+	flags |= NCP_F_FRAMED | NCP_F_DEDUP;
+    if (nc_args->sparse && !nc_args->message_mode)	// holes are announced by chunk frames
+	flags |= NCP_F_FRAMED | NCP_F_SPARSE;
+    if (nc_args->merkle && !nc_args->message_mode)	// digest follows the payload, whichever way it travels
+	flags |= NCP_F_MERKLE;
+
+    return flags;
+}
+
+/**
+ * Announce a transfer of 'count' bytes described by 'flags' on 'sockfd'. For a resumable
+ * transfer the server answers with the number of bytes of the output it already holds.
+ *
+ * Return:
+ * 	0 on success with 'hdr' and '*committed' filled in, -1 on error
+ **/
+static int announceTransfer(int sockfd, uint32_t flags, off_t count, ncp_hdr_t *hdr, off_t *committed) {
+
+    uint64_t held = 0;
+
+    memset(hdr, 0, sizeof(ncp_hdr_t));
+    hdr->flags = flags;
+    hdr->nstripes = 1;
+    hdr->length = hdr->total = count;
+
+    if (sendHeader(sockfd, hdr) < 0)
+	return -1;
+    if ((flags & NCP_F_RESUME) && (recvOffset(sockfd, &held) < 0 || held > (uint64_t) count))
+	return -1;
+
+    *committed = held;
+    return 0;
+}
+
+/**
+ * Announce a framed transfer on 'sockfd' and send the 'len' bytes of 'message' as one chunk frame.
+ *
+ * Return:
+ * 	number of payload bytes sent, or -1 on error
+ **/
+static ssize_t sendFramedMessage(int sockfd, uint32_t flags, const char *message, size_t len) {
+
+    ncp_hdr_t hdr;
+    frame_ctx_t ctx;
+    int status;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.flags = flags;
+    hdr.nstripes = 1;
+    hdr.length = hdr.total = len;
+
+    if (sendHeader(sockfd, &hdr) < 0 || frameInit(&ctx, sockfd, &hdr) < 0)
+	return -1;
+    status = (frameSend(&ctx, NCP_CHUNK_DATA, message, len) < 0 || frameFinish(&ctx) < 0) ? -1 : 0;
+    frameFree(&ctx);
+
+    return (status < 0) ? -1 : (ssize_t) len;
+}
 
 /**
  * This function creates a client to communicate with a server. The client either 
@@ -40,140 +161,180 @@
 void createClient(nc_args_t *nc_args) {			// pass all relevant information earlier collected from user
 
     int clientSockfd;					// to create a client socket to handle communication with server
-    char input[BUF_LEN];				// read/write buffer
-    int smallRead;					// read only smallRead number of bytes specified by user
-    int userBytesFlag = 0;				// to indicate that n_bytes is other than default value of 0
-    ssize_t bytesRead = 0, bytesWritten = 0;		// track number of bytes read or written
-    FILE *fp;						// pointer to client's input file
+    size_t messageLen;					// bytes of the message to send
+    off_t sendCount;					// number of file bytes to send, after applying offset and n_bytes
+    ssize_t bytesWritten = 0;				// track number of bytes written
+    FILE *fp = NULL;					// pointer to client's input file
+    struct stat fileStat;				// to learn the size of client's input file
+    uint32_t flags = transferFlags(nc_args);		// protocol features this transfer needs
+    ncp_hdr_t hdr;					// header announcing the transfer
+    frame_ctx_t ctx;					// framing state of a framed transfer
+    off_t committed = 0;				// bytes the server already holds when resuming
+    off_t sendOffset;					// where in the file this session starts sending
+    merkle_job_t merkle;				// leaf hashes of the whole range for -M
     
-    //int i;						// loop iterator variable
-    //unsigned char clientDigest[20];			// buffer that will have the computed message digest at client-side (20 bytes with sha1)
-    //unsigned int clientDigestLen;			// integer that will receive number of bytes of client digest that were filled
+    // a batch opens its own connection and walks its own files
+    if (nc_args->batch) {
+	if (sendBatch(nc_args) < 0)
+	    promptError((char *) "ERROR: Batch transfer to server failed");
+	return;
+    }
     
-    // zero out buffer: input
-    memset(input, 0, BUF_LEN);
+    // shm: hands message or file to the server through its shared-memory ring
+    if (nc_args->local == LOCAL_SHM) {
+	if (localSend(nc_args) < 0)
+	    promptError((char *) "ERROR: Transfer through the server's shared-memory ring failed");
+	return;
+    }
     
-    // create the TCP stream socket
-    if ( ( clientSockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP) ) < 0 )	// non-negative socket() return value indicates failure in creating the socket
-	promptError((char *) "TCP socket creation failed");
+    // -U sends datagrams over a socket of its own, message or file alike
+    if (nc_args->udp) {
+	if (udpSend(nc_args) < 0)
+	    promptError((char *) "ERROR: UDP transfer to server failed");
+	return;
+    }
     
-    // establish connection with server by calling connect on the client's TCP socket, sockfd
-    if ( connect( clientSockfd, (struct sockaddr *) &nc_args->servAddr, sizeof(nc_args->servAddr) ) < 0 )
-	promptError((char *) "Connection could not be established to server");
+    // -R: standard input to the server and the server's answer to standard output, for as long as either goes on
+    if (nc_args->relay) {
+	clientSockfd = connectToServer(nc_args);
+	if (relayStdio(clientSockfd) < 0)
+	    promptError((char *) "ERROR: Relay between standard input/output and server failed");
+	statsTcpInfo(clientSockfd);
+	close(clientSockfd);
+	return;
+    }
     
-    /* now with a successful connection to server established, send data across through the socket using write */
-        
     // if user typed in a message at command line instead of sending a file
     if (nc_args->message_mode) {			// message flag is on
 	
-	/* first, pour as much message data into input buffer as is needed */
+	clientSockfd = connectToServer(nc_args);
+	tuneLatency(clientSockfd, 0);			// a message is small, do not let Nagle hold it back
+	
+	/* now with a successful connection to server established, send data across through the socket using write */
+	
+	/* first, work out how much of the message is to be sent; it goes out from where the
+	 * command line left it, whatever its length */
 	
 	// case where only number of bytes to read is specified by user but not offset
 	if ( nc_args->offset == 0 && nc_args->n_bytes > 0 && nc_args->n_bytes <= strlen(nc_args->message) ) {
-	    // pour message into the input buffer but only up to n_bytes
-	    strncpy(input, nc_args->message, nc_args->n_bytes);
-	    input[nc_args->n_bytes] = '\0';	// null terminate the string in input buffer
+	    messageLen = nc_args->n_bytes;		// send the message but only up to n_bytes
 	} else if (nc_args->n_bytes > strlen(nc_args->message)) {		// case where user specifies more bytes than there are in their message
 	    promptError("ERROR: Cannot write bytes more than the input message. Please try again");
-	} else {		// pour entire message into buffer if there's no requirement to read specified number of bytes 
-	    strncpy(input, nc_args->message, strlen(nc_args->message));
-	    input[strlen(nc_args->message)] = '\0';	// null terminate the string in input buffer	
+	} else {		// send entire message if there's no requirement to read specified number of bytes 
+	    messageLen = strlen(nc_args->message);
 	}
 	
-	/* once we have the right amount of message in the input buffer, we can create 
-	 * the message's digest before sending it to server */
-	//HMAC(EVP_sha1(), key, strlen(key), (unsigned char *) input, strlen(input), clientDigest, &clientDigestLen);
-	//printf("testing: clientDigest just after HMAC: '%s'\n", clientDigest);
-	
-	/* SHA1 is known to produce 20-byte mac (or hash) which is rendered as 40 characters. So, 
-	 * change the length of the hash value */
-	/*
-	char mdString[41];			// store final client digest
-	for (i = 0; i < 20; i++)
-	    sprintf(&mdString[i*2], "%02x", (unsigned int) clientDigest[i]);	// have 2 hex length values inserted to total digest to 40 characters
-	mdString[strlen(mdString)] = '\0';	// null termination of string
-	*/
-	
-	// add a marker add the end of the message in the input buffer to signal end of message in input buffer
-	//strcat(input, ":");
-		
-	/* now club the message and the client digest into one input buffer; separated by our marker ":" */
-	/*
-	char *finalBuffer = (char *) malloc( strlen(input) + strlen(mdString) + 1);
-	strcpy(finalBuffer, "");
-	strcpy(finalBuffer, input);
-	strcat(finalBuffer, mdString);
-	finalBuffer[strlen(finalBuffer)] = '\0';	// null terminate the string in final buffer
-	*/
-	//printf("testing: finalBuffer: '%s'\n", finalBuffer);
-	
-	bytesWritten = write( clientSockfd, input, strlen(input) );		// write message with digest to client socket
+	if (flags & NCP_F_FRAMED)			// message goes out as one chunk frame, followed by the trailer
+	    bytesWritten = sendFramedMessage(clientSockfd, flags, nc_args->message, messageLen);
+	else if (announceTransfer(clientSockfd, flags, messageLen, &hdr, &committed) < 0)
+	    bytesWritten = -1;
+	else
+	    bytesWritten = writeAll( clientSockfd, nc_args->message, messageLen );		// write message to client socket
 	if (bytesWritten < 0)
 	    promptError((char *) "ERROR: Client failed to write to socket");
 	
     } else {	// user is sending a file across to the server
 	
 	fp = fopen(nc_args->clientFilename, "r");		// open client file in read mode only
+	if (fp == NULL)
+	    promptError((char *) "ERROR: Could not open client input file");
+	
+	if (fstat(fileno(fp), &fileStat) < 0)
+	    promptError((char *) "ERROR: Could not stat client input file");
+	
+	// check if file offset lies within the file
+	if (nc_args->offset < 0 || nc_args->offset > fileStat.st_size)
+	    promptError((char *) "ERROR: Offset lies beyond the end of the client input file");
 	
-	// check if file offset is required
-	if (nc_args->offset != 0)
-	    fseek(fp, nc_args->offset, 0);			// offset file pointer by offset value specified by user
-	
-	// check if only a specified number of bytes are required to be read
-	if (nc_args->n_bytes != 0) {
-	    smallRead = nc_args->n_bytes;
-	    userBytesFlag = 1;					// set flag to signal a reduced file read
-	} else
-	    smallRead = BUF_LEN;
-	
-	if (fp != NULL) {
-	    
-	    if (userBytesFlag) {
-		// read only user specified number of bytes
-		if (smallRead <= BUF_LEN) {
-		    
-		    // CHECK (different file at server): converting each byte read into network byte and then storing it into input buffer
-		    bytesRead = fread(input, sizeof(char), smallRead, fp);
-		    bytesWritten = write( clientSockfd, input, strlen(input) );
-		    goto END;
-		} else {	// when data to be read is larger than buffer size
-		    while (1) {
-			bytesRead += fread(input, sizeof(char), BUF_LEN, fp);
-			bytesWritten += write( clientSockfd, input, strlen(input) );
-			if (bytesWritten >= smallRead)
-			    break;
-		    }
-		}
-	    } else {	// otherwise, read the entire file
-		while ( fread(input, sizeof(char), smallRead, fp) ) {
-		    bytesWritten += write( clientSockfd, input, strlen(input) );
-		}
+	// send the whole remainder of the file unless only a specified number of bytes is required
+	sendOffset = nc_args->offset;
+	sendCount = fileStat.st_size - nc_args->offset;
+	if (nc_args->n_bytes > 0 && nc_args->n_bytes < sendCount)
+	    sendCount = nc_args->n_bytes;
+	
+	// a range split over several parallel connections is handled entirely by the stripe sender
+	if (nc_args->stripes > 1) {
+	    if (sendStripes(nc_args, fileno(fp), nc_args->offset, sendCount, flags) < 0)
+		promptError((char *) "ERROR: Striped transfer to server failed");
+	    fclose(fp);
+	    return;
+	}
+	
+	clientSockfd = connectToServer(nc_args);
+	
+	// the leaves are hashed on the other cores while the file goes out
+	if ((flags & NCP_F_MERKLE) && merkleBegin(&merkle, fileno(fp), nc_args->offset, sendCount) < 0)
+	    promptError((char *) "ERROR: Could not start hashing the client input file");
+	
+	// even a plain file is announced, so the server never takes its first bytes for a header
+	if (announceTransfer(clientSockfd, flags, sendCount, &hdr, &committed) < 0)
+	    promptError((char *) "ERROR: Server did not accept the transfer");
+	
+	// skip what the server already holds, exactly like a larger -o would
+	if (committed > 0)
+	    printf("Client says: server already holds %lld bytes, resuming from there\n", (long long) committed);
+	sendOffset = nc_args->offset + committed;
+	sendCount -= committed;
+	
+	// cork a plain file so it leaves in full segments; frames are written whole, so send them right away
+	tuneLatency(clientSockfd, !(flags & NCP_F_FRAMED));
+	
+	if (flags & NCP_F_FRAMED) {
+	    // framed transfers need the payload in user space anyway, to frame and authenticate it
+	    bytesWritten = -1;
+	    if (flags & NCP_F_DELTA)
+		bytesWritten = sendDelta(clientSockfd, &hdr, fileno(fp), sendOffset, sendCount);
+	    else if (flags & NCP_F_DEDUP)
+		bytesWritten = sendDedup(clientSockfd, &hdr, fileno(fp), sendOffset, sendCount);
+	    else if (frameInit(&ctx, clientSockfd, &hdr) == 0) {
+		bytesWritten = frameSendFile(&ctx, fileno(fp), sendOffset, sendCount);
+		if (bytesWritten >= 0 && (flags & NCP_F_COMPRESS))
+		    printf("Client says: %llu of %llu bytes compressed to %llu\n", (unsigned long long) ctx.zIn,
+			   (unsigned long long) bytesWritten, (unsigned long long) ctx.zOut);
+		if (bytesWritten >= 0 && (flags & NCP_F_SPARSE))
+		    printf("Client says: %llu of %llu bytes were holes and not sent\n", (unsigned long long) ctx.holes,
+			   (unsigned long long) bytesWritten);
+		frameFree(&ctx);
 	    }
-	   
-	} else
-	    promptError((char *) "ERROR: Could not open client input file");
+	} else {
+	    // io_uring backend when asked for; kernels without io_uring fall through to zero-copy
+	    if (nc_args->uring)
+		bytesWritten = uringSend(clientSockfd, fileno(fp), sendOffset, sendCount);
 	
-	END:
+	    // try the zero-copy path first, it handles the offset and byte count by itself
+	    if (!nc_args->uring || (bytesWritten < 0 && (errno == ENOSYS || errno == EINVAL || errno == EPERM || errno == EOPNOTSUPP)))
+		bytesWritten = zeroCopySend(clientSockfd, fileno(fp), sendOffset, sendCount);
+	
+	    // kernel cannot do zero-copy for this file or socket, so fall back to the buffered path
+	    if (bytesWritten < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EXDEV))
+		bytesWritten = bufferedSend(clientSockfd, fp, sendOffset, sendCount);
+	}
 	
 	if (bytesWritten < 0)
 	    promptError((char *) "ERROR: Could not send any data from client input file");
-	else if (bytesWritten == 0)
+	else if (bytesWritten == 0 && committed == 0)
 	    promptError((char *) "The input client file seems empty because nothing was read from the file");
 	
+	if (flags & NCP_F_MERKLE) {
+	    tuneFlush(clientSockfd);			// the server only answers once the whole payload has arrived
+	    if (merkleVerifySend(clientSockfd, &merkle) < 0)
+		promptError((char *) "ERROR: Server's copy failed Merkle verification");
+	    merkleFree(&merkle);
+	}
+	
     }
     
     //printf("testing: reaches here\n");
     
     // if in file mode, close file that was read from
     if (nc_args->message_mode == 0) {
-	// set file pointer to beginning of file in any case
-	fseek(fp, SEEK_SET, 0);
-    
 	// close file being used to read
 	fclose(fp);
     }
     
     // close client's socket to end terminate communication with server
+    tuneFlush(clientSockfd);
+    statsTcpInfo(clientSockfd);
     close(clientSockfd);
     
     return;
@@ -0,0 +1,109 @@
+/*
+ * Per-chunk compression of framed data (-z level).
+ *
+ * Every data chunk is compressed on its own (a fresh zlib stream per chunk), so chunks can be
+ * compressed on several cores in any order and decompressed as they arrive, and one chunk that
+ * does not compress costs nothing for the next. A compressed chunk travels as NCP_CHUNK_ZDATA
+ * with its original length in front; a chunk that does not get at least 1/COMPRESS_MIN_SAVING
+ * smaller goes out as plain NCP_CHUNK_DATA. The deflate output buffer is sized to that limit,
+ * so a hopeless chunk is abandoned as soon as it overflows instead of being compressed whole.
+ *
+ * Already compressed data (archives, media) would still cost a failed attempt per chunk, so
+ * after a miss the compressor sends the following chunks raw without trying, twice as many
+ * after every further miss in a row (up to COMPRESS_MAX_SKIP), and tries again after that. One
+ * chunk that compresses resets the bypass.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. zlib manual, http://www.zlib.net/manual.html
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "proto.h"			// put32(), get32()
+
+static int level = COMPRESS_OFF;		// -z
+
+void compressInit(int compressLevel) {
+    level = compressLevel;
+}
+
+int compressLevel(void) {
+    return level;
+}
+
+int compressThreads(void) {
+
+    long cores;
+
+    if (level < COMPRESS_PARALLEL_LEVEL)
+	return 1;
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+	return 1;
+    return (cores < COMPRESS_MAX_THREADS) ? (int) cores : COMPRESS_MAX_THREADS;
+}
+
+int compressBegin(compress_state_t *c) {
+    memset(c, 0, sizeof(compress_state_t));
+    return (deflateInit(&c->zs, (level != COMPRESS_OFF) ? level : Z_DEFAULT_COMPRESSION) == Z_OK) ? 0 : -1;
+}
+
+void compressEnd(compress_state_t *c) {
+    deflateEnd(&c->zs);
+}
+
+uint32_t compressChunk(compress_state_t *c, const void *data, uint32_t len, unsigned char *out) {
+
+    uint32_t limit = len - len / COMPRESS_MIN_SAVING;	// payload must stay below this to be worth it
+
+    if (c->skip > 0) {
+	c->skip--;
+	return 0;
+    }
+    if (limit <= 4)
+	return 0;
+
+    deflateReset(&c->zs);
+    c->zs.next_in = (Bytef *) data;
+    c->zs.avail_in = len;
+    c->zs.next_out = out + 4;
+    c->zs.avail_out = limit - 4;
+    if (deflate(&c->zs, Z_FINISH) != Z_STREAM_END) {
+	// did not fit: back off, longer after every miss in a row
+	if ((1u << c->misses) <= COMPRESS_MAX_SKIP)
+	    c->misses++;
+	c->skip = (1u << c->misses) - 1;
+	if (c->skip > COMPRESS_MAX_SKIP)
+	    c->skip = COMPRESS_MAX_SKIP;
+	return 0;
+    }
+
+    c->misses = 0;
+    put32(out, len);
+    return 4 + c->zs.total_out;
+}
+
+int decompressChunk(z_stream *zs, const unsigned char *in, uint32_t inLen, unsigned char *out, uint32_t outMax, uint32_t *outLen) {
+
+    if (inLen < 4 || (*outLen = get32(in)) > outMax)
+	goto BAD;
+
+    inflateReset(zs);
+    zs->next_in = (Bytef *) in + 4;
+    zs->avail_in = inLen - 4;
+    zs->next_out = out;
+    zs->avail_out = *outLen;
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END || zs->avail_out != 0 || zs->avail_in != 0)
+	goto BAD;
+    return 0;
+
+    BAD:
+    errno = EPROTO;
+    return -1;
+}
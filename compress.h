@@ -0,0 +1,74 @@
+/*
+ * header file for per-chunk streaming compression of framed data (-z)
+ */
+
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stdint.h>
+#include <zlib.h>
+
+#define COMPRESS_OFF 0				// -z not given
+#define COMPRESS_MIN_SAVING 16			// a chunk is sent compressed only if that saves 1/16 of it
+#define COMPRESS_MAX_SKIP 64			// most chunks sent raw untried after a run of incompressible ones
+#define COMPRESS_PARALLEL_LEVEL 6		// from this level on, chunks are compressed on several cores
+#define COMPRESS_MAX_THREADS 8			// upper bound for the compressing threads of one transfer
+
+/**
+ * Compressor of one stream or one compressing thread, with its adaptive bypass
+ **/
+typedef struct compress_state {
+    z_stream zs;				// deflate state, reset for every chunk
+    unsigned misses;				// incompressible chunks in a row
+    unsigned skip;				// chunks still to be sent raw without trying
+} compress_state_t;
+
+/**
+ * Set the process-wide compression level (1-9, or COMPRESS_OFF).
+ *
+ * Return:
+ * 	void
+ **/
+void compressInit(int level);
+
+/**
+ * Return:
+ * 	the compression level set by compressInit()
+ **/
+int compressLevel(void);
+
+/**
+ * Return:
+ * 	how many threads a pipelined send should compress on at the current level
+ **/
+int compressThreads(void);
+
+/**
+ * Prepare / release the compressor 'c'.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int compressBegin(compress_state_t *c);
+void compressEnd(compress_state_t *c);
+
+/**
+ * Compress the 'len' bytes of 'data' into 'out' (room for 'len' bytes) as the payload of an
+ * NCP_CHUNK_ZDATA chunk: 4-byte original length, then the zlib stream. Nothing is written
+ * when it would not save enough, or while the bypass skips chunks after a run of misses.
+ *
+ * Return:
+ * 	payload length, or 0 if the chunk should go out raw
+ **/
+uint32_t compressChunk(compress_state_t *c, const void *data, uint32_t len, unsigned char *out);
+
+/**
+ * Decompress the NCP_CHUNK_ZDATA payload 'in' ('inLen' bytes) into 'out', which holds 'outMax'
+ * bytes, using the inflate state 'zs'.
+ *
+ * Return:
+ * 	0 on success with '*outLen' set, -1 if the payload is malformed (errno EPROTO)
+ **/
+int decompressChunk(z_stream *zs, const unsigned char *in, uint32_t inLen, unsigned char *out, uint32_t outMax, uint32_t *outLen);
+
+#endif
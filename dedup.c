@@ -0,0 +1,683 @@
+/*
+ * Content-addressed chunk store (-C on the server) and dedup transfers (-c on the client): files
+ * that overlap are kept once per distinct piece, and the pieces the server already has do not
+ * cross the network again.
+ *
+ * Files are cut into content-defined chunks the FastCDC way: a gear hash rolls over the bytes
+ * and a chunk ends where the top bits of the hash are all zero, so a cut point depends on the
+ * last 64 bytes alone and an insertion or deletion only disturbs the chunks around it, where
+ * fixed-size blocks would all shift. No cut is looked for in the first DEDUP_MIN_CHUNK bytes,
+ * a harder mask is used up to DEDUP_AVG_CHUNK and an easier one after it (normalized chunking),
+ * and DEDUP_MAX_CHUNK is cut regardless.
+ *
+ * The store is a directory with one file per distinct chunk, named by the SHA-256 of its data
+ * and fanned out by the first byte (store/ab/ab12...). An in-memory hash table of the chunks is
+ * built from the directory when the store is opened. A received file is kept as a recipe: the
+ * store paths of its chunks in order, one per line, so that "(cd store && xargs cat) < recipe"
+ * gives the file back. Chunks and recipes are written to a temporary name and renamed into
+ * place, so an interrupted transfer never leaves a chunk that does not match its name.
+ *
+ * 1. The client announces the transfer with NCP_F_DEDUP, cuts its file into chunks and sends the
+ *    length and hash of each in NCP_CHUNK_REFS chunks, closed by a trailer.
+ * 2. The server answers with an NCP_CHUNK_NEED bitmap, one bit per chunk, set for the chunks the
+ *    store lacks; of several equal ones only the first is asked for.
+ * 3. The client sends the data of those chunks, one NCP_CHUNK_DATA each, in order. The server
+ *    checks every one against its hash before it enters the store, and writes the recipe once
+ *    the trailer has arrived.
+ *
+ * All three are framed streams, so -a, -e and -z cover them. A server without a store asks for
+ * every chunk and writes the file itself. A plain transfer to a server with a store is cut by
+ * the server instead, which saves the disk space if not the network.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. W. Xia et al., "FastCDC: a Fast and Efficient Content-Defined Chunking Approach
+ * 		  for Data Deduplication", USENIX ATC 2016
+ * 	       2. S. Quinlan, S. Dorward, "Venti: a new approach to archival storage", FAST 2002
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>			// for PATH_MAX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <openssl/evp.h>
+
+#include "proto.h"
+#include "frame.h"
+#include "transfer.h"
+#include "dedup.h"
+#include "stats.h"			// telemetry for -v
+
+#define REFS_PER_CHUNK (NCP_MAX_CHUNK / DEDUP_REF_LEN)	// chunk references carried by one REFS chunk
+#define GEAR_SEED 0x6e65746361745f70ULL		// fixes the gear table, and with it every cut point, for good
+#define MASK_HARD (~0ULL << (64 - (DEDUP_AVG_BITS + 2)))	// before the average size: cut points are rarer
+#define MASK_EASY (~0ULL << (64 - (DEDUP_AVG_BITS - 2)))	// after it: cut points are more frequent
+#define HEX_LEN (2 * DEDUP_HASH_LEN)
+
+/**
+ * One chunk of a file: its length and the hash that names it in the store
+ **/
+typedef struct chunk_ref {
+    uint32_t len;
+    unsigned char hash[DEDUP_HASH_LEN];
+} chunk_ref_t;
+
+/**
+ * Slot of the store's hash table
+ **/
+typedef struct chunk_slot {
+    unsigned char used;
+    unsigned char hash[DEDUP_HASH_LEN];
+} chunk_slot_t;
+
+/**
+ * An open chunk store: its directory and an in-memory index of the chunks in it
+ **/
+typedef struct chunk_store {
+    const char *dir;
+    chunk_slot_t *slots;			// open addressing, at most half full
+    size_t mask;				// number of slots - 1
+    size_t count;				// chunks in the store
+    uint64_t added;				// chunks added by this transfer
+    uint64_t addedBytes;			// and their bytes
+} chunk_store_t;
+
+/**
+ * Recipe being written next to its final name
+ **/
+typedef struct recipe {
+    FILE *fp;
+    char tmpName[PATH_MAX];
+} recipe_t;
+
+static uint64_t gear[256];			// random value per byte value, added into the rolling hash
+static int gearReady;
+
+/**
+ * Fill the gear table from a fixed seed with splitmix64, so every build cuts a file the same way.
+ **/
+static void gearInit(void) {
+
+    uint64_t x = GEAR_SEED, z;
+    int i;
+
+    if (gearReady)
+	return;
+    for (i = 0; i < 256; i++) {
+	z = (x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	gear[i] = z ^ (z >> 31);
+    }
+    gearReady = 1;
+}
+
+/**
+ * Find the end of the chunk that starts at 'p'. 'len' must be at least DEDUP_MAX_CHUNK unless
+ * it is the rest of the input.
+ *
+ * Return:
+ * 	length of the chunk
+ **/
+static size_t cutPoint(const unsigned char *p, size_t len) {
+
+    uint64_t h = 0;
+    size_t i, normal;
+
+    if (len <= DEDUP_MIN_CHUNK)
+	return len;
+    if (len > DEDUP_MAX_CHUNK)
+	len = DEDUP_MAX_CHUNK;
+    normal = (len < DEDUP_AVG_CHUNK) ? len : DEDUP_AVG_CHUNK;
+
+    for (i = DEDUP_MIN_CHUNK; i < normal; i++) {
+	h = (h << 1) + gear[p[i]];
+	if ((h & MASK_HARD) == 0)
+	    return i + 1;
+    }
+    for (; i < len; i++) {
+	h = (h << 1) + gear[p[i]];
+	if ((h & MASK_EASY) == 0)
+	    return i + 1;
+    }
+    return len;
+}
+
+static int chunkHash(const unsigned char *p, size_t len, unsigned char *out) {
+    unsigned int mdLen;
+    return EVP_Digest(p, len, out, &mdLen, EVP_sha256(), NULL) ? 0 : -1;
+}
+
+/**
+ * Write the store path of chunk 'hash', "ab/ab12...", into 'name' (HEX_LEN + 4 bytes).
+ **/
+static void chunkName(const unsigned char *hash, char *name) {
+
+    static const char digits[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < DEDUP_HASH_LEN; i++) {
+	name[3 + 2 * i] = digits[hash[i] >> 4];
+	name[3 + 2 * i + 1] = digits[hash[i] & 0xf];
+    }
+    name[0] = name[3];
+    name[1] = name[4];
+    name[2] = '/';
+    name[3 + HEX_LEN] = '\0';
+}
+
+/**
+ * Parse the HEX_LEN hex digits of a chunk file name into 'hash'.
+ *
+ * Return:
+ * 	1 if 'name' is a chunk's name, 0 otherwise (e.g. a temporary file)
+ **/
+static int parseName(const char *name, unsigned char *hash) {
+
+    int i, hi, lo;
+
+    if (strlen(name) != HEX_LEN)
+	return 0;
+    for (i = 0; i < DEDUP_HASH_LEN; i++) {
+	hi = name[2 * i];
+	lo = name[2 * i + 1];
+	hi = (hi >= '0' && hi <= '9') ? hi - '0' : (hi >= 'a' && hi <= 'f') ? hi - 'a' + 10 : -1;
+	lo = (lo >= '0' && lo <= '9') ? lo - '0' : (lo >= 'a' && lo <= 'f') ? lo - 'a' + 10 : -1;
+	if (hi < 0 || lo < 0)
+	    return 0;
+	hash[i] = (unsigned char) (hi << 4 | lo);
+    }
+    return 1;
+}
+
+/**
+ * Return:
+ * 	slot of 'hash' in the index, or the empty slot where it would go
+ **/
+static chunk_slot_t *findSlot(const chunk_store_t *s, const unsigned char *hash) {
+
+    uint64_t h;
+    size_t slot;
+
+    memcpy(&h, hash, sizeof(h));		// a SHA-256 is as good a hash table key as any
+    for (slot = h & s->mask; s->slots[slot].used; slot = (slot + 1) & s->mask)
+	if (memcmp(s->slots[slot].hash, hash, DEDUP_HASH_LEN) == 0)
+	    break;
+    return &s->slots[slot];
+}
+
+/**
+ * Enter 'hash' into the index, doubling the table when it gets half full.
+ *
+ * Return:
+ * 	1 if it was new, 0 if it was there already, -1 on error
+ **/
+static int indexAdd(chunk_store_t *s, const unsigned char *hash) {
+
+    chunk_slot_t *slot, *old = s->slots;
+    size_t i, oldSlots = s->mask + 1;
+
+    if (2 * (s->count + 1) > oldSlots) {
+	if ( (s->slots = calloc(2 * oldSlots, sizeof(chunk_slot_t))) == NULL ) {
+	    s->slots = old;
+	    return -1;
+	}
+	s->mask = 2 * oldSlots - 1;
+	for (i = 0; i < oldSlots; i++)
+	    if (old[i].used)
+		*findSlot(s, old[i].hash) = old[i];
+	free(old);
+    }
+
+    slot = findSlot(s, hash);
+    if (slot->used)
+	return 0;
+    slot->used = 1;
+    memcpy(slot->hash, hash, DEDUP_HASH_LEN);
+    s->count++;
+    return 1;
+}
+
+/**
+ * Open the store in directory 'dir', creating it if need be, and index the chunks in it.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int openStore(chunk_store_t *s, const char *dir) {
+
+    char path[PATH_MAX];
+    unsigned char hash[DEDUP_HASH_LEN];
+    struct dirent *entry;
+    DIR *sub;
+    int i;
+
+    memset(s, 0, sizeof(chunk_store_t));
+    s->dir = dir;
+    s->mask = 1023;
+    if ( (s->slots = calloc(s->mask + 1, sizeof(chunk_slot_t))) == NULL )
+	return -1;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+	goto FAIL;
+
+    for (i = 0; i < 256; i++) {
+	snprintf(path, sizeof(path), "%s/%02x", dir, i);
+	if ( (sub = opendir(path)) == NULL )
+	    continue;				// no chunk starting with this byte yet
+	while ( (entry = readdir(sub)) != NULL )
+	    if (parseName(entry->d_name, hash) && hash[0] == i && indexAdd(s, hash) < 0) {
+		closedir(sub);
+		goto FAIL;
+	    }
+	closedir(sub);
+    }
+    return 0;
+
+    FAIL:
+    free(s->slots);
+    s->slots = NULL;
+    return -1;
+}
+
+/**
+ * Write the 'len' bytes at 'p' into the store as chunk 'hash'.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int storeChunk(chunk_store_t *s, const unsigned char *hash, const unsigned char *p, size_t len) {
+
+    char name[HEX_LEN + 4], path[PATH_MAX], tmpName[PATH_MAX];
+    int fd, savedErrno;
+
+    chunkName(hash, name);
+    snprintf(path, sizeof(path), "%s/%.2s", s->dir, name);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+	return -1;
+    if (snprintf(path, sizeof(path), "%s/%s", s->dir, name) >= (int) sizeof(path)
+	|| snprintf(tmpName, sizeof(tmpName), "%s.ncpXXXXXX", path) >= (int) sizeof(tmpName)) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    if ( (fd = mkstemp(tmpName)) < 0 )
+	return -1;
+    fchmod(fd, 0644);
+    if (writeFileAll(fd, p, len) < 0 || close(fd) < 0 || rename(tmpName, path) < 0) {
+	savedErrno = errno;
+	close(fd);
+	unlink(tmpName);
+	errno = savedErrno;
+	return -1;
+    }
+    s->added++;
+    s->addedBytes += len;
+    return 0;
+}
+
+static int recipeOpen(recipe_t *r, const char *filename) {
+
+    int fd;
+
+    r->fp = NULL;
+    if (snprintf(r->tmpName, sizeof(r->tmpName), "%s.ncpXXXXXX", filename) >= (int) sizeof(r->tmpName)) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    if ( (fd = mkstemp(r->tmpName)) < 0 )
+	return -1;
+    fchmod(fd, 0644);
+    if ( (r->fp = fdopen(fd, "w")) == NULL ) {
+	close(fd);
+	unlink(r->tmpName);
+	return -1;
+    }
+    return 0;
+}
+
+static int recipeAdd(recipe_t *r, const unsigned char *hash) {
+
+    char name[HEX_LEN + 4];
+
+    chunkName(hash, name);
+    return (fprintf(r->fp, "%s\n", name) < 0) ? -1 : 0;
+}
+
+/**
+ * Put the recipe in place of 'filename' if 'ok', throw it away otherwise.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int recipeClose(recipe_t *r, const char *filename, int ok) {
+
+    int savedErrno;
+
+    if (r->fp == NULL)
+	return -1;
+    if (fclose(r->fp) != 0)
+	ok = 0;
+    r->fp = NULL;
+    if (ok && rename(r->tmpName, filename) == 0)
+	return 0;
+    savedErrno = errno;
+    unlink(r->tmpName);
+    errno = savedErrno;
+    return -1;
+}
+
+off_t sendDedup(int sockfd, const ncp_hdr_t *hdr, int filefd, off_t offset, off_t count) {
+
+    frame_ctx_t ctx;
+    chunk_ref_t *refs = NULL, *grown;
+    unsigned char *map = NULL, *p = NULL, *buf = NULL, *need = NULL;
+    size_t mapLen = 0, nRefs = 0, maxRefs = 0, needLen, got = 0, i, j, n;
+    off_t at, sentBytes = 0, aligned;
+    uint64_t sentChunks = 0;
+    uint8_t type;
+    uint32_t len;
+    int status = -1;
+
+    gearInit();
+    if ( (buf = malloc(NCP_MAX_CHUNK)) == NULL )
+	return -1;
+
+    // cut the file through a read-only mapping; mmap() wants a page-aligned offset
+    if (count > 0) {
+	aligned = offset & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+	mapLen = count + (offset - aligned);
+	if ( (map = mmap(NULL, mapLen, PROT_READ, MAP_PRIVATE, filefd, aligned)) == MAP_FAILED ) {
+	    map = NULL;
+	    goto DONE;
+	}
+	madvise(map, mapLen, MADV_SEQUENTIAL);
+	p = map + (offset - aligned);
+    }
+    for (at = 0; at < count; at += refs[nRefs++].len) {
+	if (nRefs == maxRefs) {
+	    maxRefs = (maxRefs == 0) ? 1024 : 2 * maxRefs;
+	    if ( (grown = realloc(refs, maxRefs * sizeof(chunk_ref_t))) == NULL )
+		goto DONE;
+	    refs = grown;
+	}
+	refs[nRefs].len = cutPoint(p + at, count - at);
+	if (chunkHash(p + at, refs[nRefs].len, refs[nRefs].hash) < 0)
+	    goto DONE;
+    }
+
+    // step 1: every chunk's length and hash
+    if (frameInit(&ctx, sockfd, hdr) < 0)
+	goto DONE;
+    for (i = 0; i < nRefs; i += n) {
+	n = (nRefs - i < REFS_PER_CHUNK) ? nRefs - i : REFS_PER_CHUNK;
+	for (j = 0; j < n; j++) {
+	    put32(buf + j * DEDUP_REF_LEN, refs[i + j].len);
+	    memcpy(buf + j * DEDUP_REF_LEN + 4, refs[i + j].hash, DEDUP_HASH_LEN);
+	}
+	if (frameSend(&ctx, NCP_CHUNK_REFS, buf, n * DEDUP_REF_LEN) < 0)
+	    goto DONE_CTX;
+    }
+    if (frameFinish(&ctx) < 0)
+	goto DONE_CTX;
+    frameFree(&ctx);
+
+    // step 2: which of them the server needs
+    needLen = (nRefs + 7) / 8;
+    if ( (need = malloc(needLen + 1)) == NULL || frameInit(&ctx, sockfd, hdr) < 0 )
+	goto DONE;
+    while (1) {
+	if (frameRecv(&ctx, &type, buf, &len) < 0)
+	    goto DONE_CTX;
+	if (type == NCP_CHUNK_END)
+	    break;
+	if (type != NCP_CHUNK_NEED || len > needLen - got) {
+	    errno = EPROTO;
+	    goto DONE_CTX;
+	}
+	memcpy(need + got, buf, len);
+	got += len;
+    }
+    frameFree(&ctx);
+    if (got != needLen) {
+	errno = EPROTO;
+	goto DONE;
+    }
+
+    // step 3: the data of those
+    if (frameInit(&ctx, sockfd, hdr) < 0)
+	goto DONE;
+    for (i = 0, at = 0; i < nRefs; at += refs[i++].len) {
+	if (!(need[i / 8] & (1 << (i % 8))))
+	    continue;
+	if (frameSend(&ctx, NCP_CHUNK_DATA, p + at, refs[i].len) < 0)
+	    goto DONE_CTX;
+	sentChunks++;
+	sentBytes += refs[i].len;
+    }
+    if (frameFinish(&ctx) < 0)
+	goto DONE_CTX;
+
+    printf("Client says: dedup sent %llu of %llu chunks (%lld of %lld bytes)%s\n",
+	   (unsigned long long) sentChunks, (unsigned long long) nRefs, (long long) sentBytes, (long long) count,
+	   (sentChunks < nRefs) ? ", the server had the rest" : "");
+    status = 0;
+
+    DONE_CTX:
+    frameFree(&ctx);
+    DONE:
+    if (map != NULL)
+	munmap(map, mapLen);
+    free(refs);
+    free(need);
+    free(buf);
+    return (status < 0) ? -1 : count;
+}
+
+off_t receiveDedup(int sockfd, const ncp_hdr_t *hdr, const char *storeDir, const char *filename) {
+
+    frame_ctx_t ctx;
+    chunk_store_t store;
+    recipe_t recipe;
+    chunk_ref_t *refs = NULL, *grown;
+    unsigned char *buf = NULL, *need = NULL, hash[DEDUP_HASH_LEN];
+    size_t nRefs = 0, maxRefs = 0, needLen, i, n;
+    uint64_t total = 0;
+    uint8_t type;
+    uint32_t len;
+    int outfd = -1, fresh, ok = 0, savedErrno;
+
+    memset(&store, 0, sizeof(store));
+    recipe.fp = NULL;
+    if ( (buf = malloc(NCP_MAX_CHUNK)) == NULL )
+	return -1;
+
+    // step 1: the client's chunks, which must add up to the announced length
+    if (frameInit(&ctx, sockfd, hdr) < 0)
+	goto FAIL;
+    while (1) {
+	if (frameRecv(&ctx, &type, buf, &len) < 0)
+	    goto FAIL_CTX;
+	if (type == NCP_CHUNK_END)
+	    break;
+	if (type != NCP_CHUNK_REFS || len % DEDUP_REF_LEN != 0)
+	    goto BAD;
+	for (i = 0; i < len / DEDUP_REF_LEN; i++) {
+	    if (nRefs == maxRefs) {
+		maxRefs = (maxRefs == 0) ? 1024 : 2 * maxRefs;
+		if ( (grown = realloc(refs, maxRefs * sizeof(chunk_ref_t))) == NULL )
+		    goto FAIL_CTX;
+		refs = grown;
+	    }
+	    refs[nRefs].len = get32(buf + i * DEDUP_REF_LEN);
+	    memcpy(refs[nRefs].hash, buf + i * DEDUP_REF_LEN + 4, DEDUP_HASH_LEN);
+	    if (refs[nRefs].len == 0 || refs[nRefs].len > DEDUP_MAX_CHUNK || total + refs[nRefs].len > hdr->length)
+		goto BAD;
+	    total += refs[nRefs++].len;
+	}
+    }
+    frameFree(&ctx);
+    if (total != hdr->length) {
+	errno = EPROTO;
+	goto FAIL;
+    }
+
+    // step 2: ask for what the store lacks, each distinct chunk once; without a store, for everything
+    needLen = (nRefs + 7) / 8;
+    if ( (need = calloc(needLen + 1, 1)) == NULL )
+	goto FAIL;
+    if (storeDir != NULL) {
+	if (openStore(&store, storeDir) < 0 || recipeOpen(&recipe, filename) < 0)
+	    goto FAIL;
+	for (i = 0; i < nRefs; i++) {
+	    if ( (fresh = indexAdd(&store, refs[i].hash)) < 0 )
+		goto FAIL;
+	    if (fresh)
+		need[i / 8] |= 1 << (i % 8);
+	}
+    } else {
+	memset(need, 0xff, needLen);
+	if ( (outfd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 )
+	    goto FAIL;
+    }
+    if (frameInit(&ctx, sockfd, hdr) < 0)
+	goto FAIL;
+    for (i = 0; i < needLen; i += n) {
+	n = (needLen - i < NCP_MAX_CHUNK) ? needLen - i : NCP_MAX_CHUNK;
+	if (frameSend(&ctx, NCP_CHUNK_NEED, need + i, n) < 0)
+	    goto FAIL_CTX;
+    }
+    if (frameFinish(&ctx) < 0)
+	goto FAIL_CTX;
+    frameFree(&ctx);
+
+    // step 3: the data, checked against its hash before anything is written
+    if (frameInit(&ctx, sockfd, hdr) < 0)
+	goto FAIL;
+    for (i = 0; i < nRefs; i++) {
+	if (recipe.fp != NULL && recipeAdd(&recipe, refs[i].hash) < 0)
+	    goto FAIL_CTX;
+	if (!(need[i / 8] & (1 << (i % 8))))
+	    continue;
+	if (frameRecv(&ctx, &type, buf, &len) < 0)
+	    goto FAIL_CTX;
+	if (type != NCP_CHUNK_DATA || len != refs[i].len)
+	    goto BAD;
+	if (chunkHash(buf, len, hash) < 0)
+	    goto FAIL_CTX;
+	if (memcmp(hash, refs[i].hash, DEDUP_HASH_LEN) != 0) {
+	    errno = EBADMSG;
+	    goto FAIL_CTX;
+	}
+	if ((outfd >= 0) ? writeFileAll(outfd, buf, len) < 0 : storeChunk(&store, hash, buf, len) < 0)
+	    goto FAIL_CTX;
+    }
+    if (frameRecv(&ctx, &type, buf, &len) < 0)
+	goto FAIL_CTX;
+    if (type != NCP_CHUNK_END)
+	goto BAD;
+    frameFree(&ctx);
+
+    if (outfd >= 0) {
+	if (close(outfd) < 0)
+	    goto FAIL;
+	outfd = -1;
+    } else {
+	if (recipeClose(&recipe, filename, 1) < 0)
+	    goto FAIL;
+	printf("Server says: %llu chunks, %llu of them new (%llu bytes) stored in '%s'; recipe written to '%s'\n",
+	       (unsigned long long) nRefs, (unsigned long long) store.added, (unsigned long long) store.addedBytes,
+	       storeDir, filename);
+    }
+    ok = 1;
+    goto DONE;
+
+    BAD:
+    errno = EPROTO;
+    FAIL_CTX:
+    savedErrno = errno;
+    frameFree(&ctx);
+    errno = savedErrno;
+    FAIL:
+    DONE:
+    savedErrno = errno;
+    if (recipe.fp != NULL)
+	recipeClose(&recipe, filename, 0);
+    if (outfd >= 0)
+	close(outfd);
+    free(store.slots);
+    free(refs);
+    free(need);
+    free(buf);
+    errno = savedErrno;
+    return ok ? (off_t) total : -1;
+}
+
+off_t storeStream(int sockfd, const char *storeDir, const char *filename) {
+
+    chunk_store_t store;
+    recipe_t recipe;
+    unsigned char *buf, hash[DEDUP_HASH_LEN];
+    size_t avail = 0, len;
+    uint64_t start, chunks = 0;
+    off_t total = 0;
+    ssize_t n;
+    int eof = 0, fresh, ok = 0;
+
+    gearInit();
+    if ( (buf = malloc(2 * DEDUP_MAX_CHUNK)) == NULL )
+	return -1;
+    if (openStore(&store, storeDir) < 0) {
+	free(buf);
+	return -1;
+    }
+    if (recipeOpen(&recipe, filename) < 0)
+	goto DONE;
+
+    while (1) {
+	// a cut point can only be trusted with a whole largest chunk in view, or the end of the stream
+	while (!eof && avail < DEDUP_MAX_CHUNK) {
+	    start = statsStart();
+	    n = read(sockfd, buf + avail, 2 * DEDUP_MAX_CHUNK - avail);
+	    statsIo(STATS_NET, start, 2 * DEDUP_MAX_CHUNK - avail, n);
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n < 0)
+		goto DONE;
+	    if (n == 0)
+		eof = 1;
+	    avail += n;
+	}
+	if (avail == 0)
+	    break;
+
+	len = cutPoint(buf, avail);
+	if (chunkHash(buf, len, hash) < 0 || (fresh = indexAdd(&store, hash)) < 0
+	    || (fresh && storeChunk(&store, hash, buf, len) < 0) || recipeAdd(&recipe, hash) < 0)
+	    goto DONE;
+	chunks++;
+	total += len;
+	avail -= len;
+	memmove(buf, buf + len, avail);
+    }
+
+    if (recipeClose(&recipe, filename, 1) < 0)
+	goto DONE;
+    printf("Server says: %llu chunks, %llu of them new (%llu bytes) stored in '%s'; recipe written to '%s'\n",
+	   (unsigned long long) chunks, (unsigned long long) store.added, (unsigned long long) store.addedBytes,
+	   storeDir, filename);
+    ok = 1;
+
+    DONE:
+    if (recipe.fp != NULL)
+	recipeClose(&recipe, filename, 0);
+    free(store.slots);
+    free(buf);
+    return ok ? total : -1;
+}
@@ -0,0 +1,50 @@
+/*
+ * header file for the content-addressed chunk store and dedup transfers (-C, -c)
+ */
+
+#ifndef DEDUP_H_
+#define DEDUP_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "proto.h"
+
+#define DEDUP_MIN_CHUNK 2048			// content-defined chunk size bounds; no cut point is looked for below the minimum
+#define DEDUP_AVG_CHUNK 8192			// size the cut points are normalized around
+#define DEDUP_MAX_CHUNK 65536			// cut here at the latest; a chunk's data fits one NCP_MAX_CHUNK frame
+#define DEDUP_AVG_BITS 13			// log2(DEDUP_AVG_CHUNK)
+#define DEDUP_HASH_LEN 32			// SHA-256, which names a chunk in the store
+#define DEDUP_REF_LEN (4 + DEDUP_HASH_LEN)	// one chunk reference on the wire: length, hash
+
+/**
+ * Client side: after the header 'hdr' (NCP_F_DEDUP) was sent on 'sockfd', cut 'count' bytes of
+ * 'filefd' from 'offset' into content-defined chunks, send their hashes, and send the data of
+ * the chunks the server answers it does not have.
+ *
+ * Return:
+ * 	number of file bytes the server can put together ('count' on success), or -1 on error
+ **/
+off_t sendDedup(int sockfd, const ncp_hdr_t *hdr, int filefd, off_t offset, off_t count);
+
+/**
+ * Server side: receive the chunk hashes of a dedup transfer, tell the client which chunks the
+ * store in 'storeDir' lacks, and store those as they arrive. 'filename' becomes the file's
+ * recipe, the store paths of its chunks in order. Without a store (NULL) every chunk is asked
+ * for and 'filename' gets the data itself.
+ *
+ * Return:
+ * 	size of the file received, or -1 on error; errno is EBADMSG when a chunk does not match its hash
+ **/
+off_t receiveDedup(int sockfd, const ncp_hdr_t *hdr, const char *storeDir, const char *filename);
+
+/**
+ * Server side: cut a plain transfer arriving on 'sockfd' into content-defined chunks, add the
+ * new ones to the store in 'storeDir' and write the recipe to 'filename'.
+ *
+ * Return:
+ * 	number of bytes received, or -1 on error
+ **/
+off_t storeStream(int sockfd, const char *storeDir, const char *filename);
+
+#endif
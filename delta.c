@@ -0,0 +1,518 @@
+/*
+ * rsync-style delta transfers (-D): only the parts of a file the server does not already have
+ * cross the network.
+ *
+ * 1. The client announces the transfer with NCP_F_DELTA. The server cuts its current copy of the
+ *    output file into blocks and answers with one signature per full block: a weak rolling
+ *    checksum and a strong checksum (the first DELTA_STRONG_LEN bytes of SHA-256), carried in
+ *    NCP_CHUNK_SIG chunks and closed by a trailer.
+ * 2. The client slides a window of one block over its file. The weak checksum is updated in O(1)
+ *    per byte; only when it hits a signature is the strong checksum computed. A match turns into
+ *    a block reference (runs of consecutive blocks into a single NCP_CHUNK_COPY chunk), everything
+ *    in between is sent as literal NCP_CHUNK_DATA.
+ * 3. The server rebuilds the file into a temporary file next to it, copying referenced blocks
+ *    from the old copy with copy_file_range() and appending the literals, and renames it over
+ *    the old copy once the trailer has arrived and the size is right. A failed transfer leaves
+ *    the old copy untouched.
+ *
+ * Both directions are framed streams, so with -a the signatures, references and literals are
+ * all authenticated. The short last block of the old copy gets no signature; whatever it held
+ * is sent as literal data.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. A. Tridgell, P. Mackerras, "The rsync algorithm", TR-CS-96-05, ANU, 1996
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>			// for PATH_MAX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <openssl/evp.h>
+
+#include "proto.h"
+#include "frame.h"
+#include "transfer.h"
+#include "delta.h"
+#include "stats.h"			// telemetry for -v
+#include "output.h"			// preallocation of the rebuilt file
+
+#define SIGS_PER_CHUNK ((NCP_MAX_CHUNK - 4) / DELTA_SIG_LEN)	// signatures carried by one SIG chunk after its block size
+
+/**
+ * Weak rolling checksum of a window of 'len' bytes (the rsync/Adler-32 style sums, mod 2^16)
+ **/
+typedef struct rolling {
+    uint32_t a;					// sum of the bytes
+    uint32_t b;					// sum of the bytes weighted by their distance from the window end
+    size_t len;
+} rolling_t;
+
+/**
+ * Signatures of the server's copy, as seen by the client
+ **/
+typedef struct sig_table {
+    size_t blockLen;
+    size_t count;				// number of signatures
+    unsigned char *sigs;			// count * DELTA_SIG_LEN bytes, in block order
+    uint32_t *slots;				// hash table on the weak checksum: block index + 1, 0 if empty
+    size_t mask;				// number of slots - 1
+} sig_table_t;
+
+/**
+ * Sending side of the delta: pending run of block references and what was sent
+ **/
+typedef struct delta_out {
+    frame_ctx_t ctx;
+    int haveRun;				// a run of consecutive blocks is waiting to be sent
+    uint64_t runStart, runLen;			// first block and number of blocks of that run
+    off_t literal;				// literal bytes sent
+    off_t copied;				// bytes the server copies from its old copy
+} delta_out_t;
+
+static void rollInit(rolling_t *r, const unsigned char *p, size_t len) {
+    size_t i;
+    r->a = r->b = 0;
+    r->len = len;
+    for (i = 0; i < len; i++) {
+	r->a += p[i];
+	r->b += (uint32_t) (len - i) * p[i];
+    }
+}
+
+/**
+ * Slide the window one byte: 'out' leaves at the front, 'in' enters at the back.
+ **/
+static void rollStep(rolling_t *r, unsigned char out, unsigned char in) {
+    r->a += in - out;
+    r->b += r->a - (uint32_t) r->len * out;
+}
+
+static uint32_t rollDigest(const rolling_t *r) {
+    return (r->a & 0xffff) | (r->b << 16);
+}
+
+static int strongSum(const unsigned char *p, size_t len, unsigned char *out) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdLen;
+    if (!EVP_Digest(p, len, md, &mdLen, EVP_sha256(), NULL))
+	return -1;
+    memcpy(out, md, DELTA_STRONG_LEN);
+    return 0;
+}
+
+/**
+ * Block size for a file of 'size' bytes: about its square root, which balances the size of the
+ * signature list against the literal data a single changed byte costs.
+ **/
+static size_t blockLenFor(off_t size) {
+    size_t len = DELTA_MIN_BLOCK;
+    while ((off_t) len * (off_t) len < size && len < DELTA_MAX_BLOCK)
+	len *= 2;
+    return len;
+}
+
+/**
+ * Server: send the signature of every full block of 'oldfd' ('size' bytes, -1 if there is no
+ * old copy) on 'ctx', then the trailer.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int sendSignatures(frame_ctx_t *ctx, int oldfd, off_t size, size_t blockLen) {
+
+    unsigned char *chunk, *block;
+    rolling_t r;
+    size_t n = 0;				// signatures in the current chunk
+    off_t at;
+    uint64_t start;
+    ssize_t got;
+    int status = -1;
+
+    chunk = malloc(NCP_MAX_CHUNK);
+    block = malloc(blockLen);
+    if (chunk == NULL || block == NULL)
+	goto DONE;
+
+    put32(chunk, blockLen);
+    for (at = 0; oldfd >= 0 && at + (off_t) blockLen <= size; at += blockLen) {
+	start = statsStart();
+	got = pread(oldfd, block, blockLen, at);
+	statsIo(STATS_DISK, start, blockLen, got);
+	if (got != (ssize_t) blockLen)
+	    goto DONE;
+
+	rollInit(&r, block, blockLen);
+	put32(chunk + 4 + n * DELTA_SIG_LEN, rollDigest(&r));
+	if (strongSum(block, blockLen, chunk + 4 + n * DELTA_SIG_LEN + 4) < 0)
+	    goto DONE;
+	if (++n == SIGS_PER_CHUNK) {
+	    if (frameSend(ctx, NCP_CHUNK_SIG, chunk, 4 + n * DELTA_SIG_LEN) < 0)
+		goto DONE;
+	    n = 0;
+	}
+    }
+    // the last, possibly empty chunk always goes out so that the client learns the block size
+    if (frameSend(ctx, NCP_CHUNK_SIG, chunk, 4 + n * DELTA_SIG_LEN) < 0 || frameFinish(ctx) < 0)
+	goto DONE;
+    status = 0;
+
+    DONE:
+    free(chunk);
+    free(block);
+    return status;
+}
+
+/**
+ * Client: receive the server's signatures from 'ctx' into 't' and index them by weak checksum.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int recvSignatures(frame_ctx_t *ctx, sig_table_t *t) {
+
+    unsigned char *buf, *grown;
+    uint8_t type;
+    uint32_t len, weak;
+    size_t i, n, slot;
+
+    memset(t, 0, sizeof(sig_table_t));
+    if ( (buf = malloc(NCP_MAX_CHUNK)) == NULL )
+	return -1;
+
+    while (1) {
+	if (frameRecv(ctx, &type, buf, &len) < 0)
+	    goto FAIL;
+	if (type == NCP_CHUNK_END)
+	    break;
+	if (type != NCP_CHUNK_SIG || len < 4 || (len - 4) % DELTA_SIG_LEN != 0
+	    || get32(buf) < DELTA_MIN_BLOCK || get32(buf) > DELTA_MAX_BLOCK || (t->blockLen != 0 && get32(buf) != t->blockLen))
+	    goto BAD;
+	t->blockLen = get32(buf);
+	n = (len - 4) / DELTA_SIG_LEN;
+	if ( (grown = realloc(t->sigs, (t->count + n) * DELTA_SIG_LEN + 1)) == NULL )
+	    goto FAIL;
+	t->sigs = grown;
+	memcpy(t->sigs + t->count * DELTA_SIG_LEN, buf + 4, n * DELTA_SIG_LEN);
+	t->count += n;
+    }
+    free(buf);
+    if (t->blockLen == 0) {
+	errno = EPROTO;
+	return -1;
+    }
+
+    // open addressing, at most half full
+    for (n = 16; n < 2 * t->count; n *= 2)
+	;
+    if ( (t->slots = calloc(n, sizeof(uint32_t))) == NULL )
+	return -1;
+    t->mask = n - 1;
+    for (i = 0; i < t->count; i++) {
+	weak = get32(t->sigs + i * DELTA_SIG_LEN);
+	for (slot = (weak * 2654435761u) & t->mask; t->slots[slot] != 0; slot = (slot + 1) & t->mask)
+	    ;
+	t->slots[slot] = i + 1;
+    }
+    return 0;
+
+    BAD:
+    errno = EPROTO;
+    FAIL:
+    free(buf);
+    free(t->sigs);
+    t->sigs = NULL;
+    return -1;
+}
+
+/**
+ * Find a block of the server's copy equal to the 'blockLen' bytes at 'p', whose weak checksum is
+ * 'weak'. The strong checksum is only computed once the weak one matched.
+ *
+ * Return:
+ * 	block index, or -1 if there is none
+ **/
+static long findBlock(const sig_table_t *t, uint32_t weak, const unsigned char *p) {
+
+    unsigned char strong[DELTA_STRONG_LEN];
+    int haveStrong = 0;
+    const unsigned char *sig;
+    size_t slot;
+
+    for (slot = (weak * 2654435761u) & t->mask; t->slots[slot] != 0; slot = (slot + 1) & t->mask) {
+	sig = t->sigs + (t->slots[slot] - 1) * DELTA_SIG_LEN;
+	if (get32(sig) != weak)
+	    continue;
+	if (!haveStrong) {
+	    if (strongSum(p, t->blockLen, strong) < 0)
+		return -1;
+	    haveStrong = 1;
+	}
+	if (memcmp(sig + 4, strong, DELTA_STRONG_LEN) == 0)
+	    return t->slots[slot] - 1;
+    }
+    return -1;
+}
+
+/**
+ * Send the pending run of block references, if any.
+ **/
+static int flushRun(delta_out_t *o) {
+
+    unsigned char ref[16];			// first block, number of blocks
+
+    if (!o->haveRun)
+	return 0;
+    o->haveRun = 0;
+    put64(ref, o->runStart);
+    put64(ref + 8, o->runLen);
+    return frameSend(&o->ctx, NCP_CHUNK_COPY, ref, sizeof(ref));
+}
+
+/**
+ * Send 'len' bytes at 'p' as literal data, after any pending block references.
+ **/
+static int sendLiteral(delta_out_t *o, const unsigned char *p, size_t len) {
+
+    uint32_t n;
+
+    if (len > 0 && flushRun(o) < 0)
+	return -1;
+    while (len > 0) {
+	n = (len < NCP_MAX_CHUNK) ? len : NCP_MAX_CHUNK;
+	if (frameSend(&o->ctx, NCP_CHUNK_DATA, p, n) < 0)
+	    return -1;
+	p += n;
+	len -= n;
+	o->literal += n;
+    }
+    return 0;
+}
+
+/**
+ * Reference block 'index' of the server's copy, extending the pending run when it is the next one.
+ **/
+static int addCopy(delta_out_t *o, uint64_t index, size_t blockLen) {
+
+    o->copied += blockLen;
+    if (o->haveRun && index == o->runStart + o->runLen) {
+	o->runLen++;
+	return 0;
+    }
+    if (flushRun(o) < 0)
+	return -1;
+    o->haveRun = 1;
+    o->runStart = index;
+    o->runLen = 1;
+    return 0;
+}
+
+off_t sendDelta(int sockfd, const ncp_hdr_t *hdr, int filefd, off_t offset, off_t count) {
+
+    frame_ctx_t in;
+    delta_out_t out;
+    sig_table_t t;
+    rolling_t r;
+    unsigned char *map = NULL, *p = NULL;
+    size_t mapLen = 0, L;
+    off_t i = 0, litStart = 0, aligned;
+    long index;
+    int status = -1;
+
+    memset(&out, 0, sizeof(out));
+    memset(&t, 0, sizeof(t));
+
+    // step 1: the server's signatures come first
+    if (frameInit(&in, sockfd, hdr) < 0)
+	return -1;
+    status = recvSignatures(&in, &t);
+    frameFree(&in);
+    if (status < 0)
+	return -1;
+    status = -1;
+    L = t.blockLen;
+
+    if (frameInit(&out.ctx, sockfd, hdr) < 0)
+	goto DONE;
+
+    // step 2: scan the file through a read-only mapping; mmap() wants a page-aligned offset
+    if (count > 0) {
+	aligned = offset & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+	mapLen = count + (offset - aligned);
+	if ( (map = mmap(NULL, mapLen, PROT_READ, MAP_PRIVATE, filefd, aligned)) == MAP_FAILED ) {
+	    map = NULL;
+	    goto DONE;
+	}
+	madvise(map, mapLen, MADV_SEQUENTIAL);
+	p = map + (offset - aligned);
+    }
+
+    if (t.count > 0 && count >= (off_t) L) {
+	rollInit(&r, p, L);
+	while (i + (off_t) L <= count) {
+	    if ( (index = findBlock(&t, rollDigest(&r), p + i)) >= 0 ) {
+		if (sendLiteral(&out, p + litStart, i - litStart) < 0 || addCopy(&out, index, L) < 0)
+		    goto DONE;
+		i += L;
+		litStart = i;
+		if (i + (off_t) L <= count)
+		    rollInit(&r, p + i, L);
+		continue;
+	    }
+	    if (i + (off_t) L < count)
+		rollStep(&r, p[i], p[i + L]);
+	    i++;
+	}
+    }
+    if (sendLiteral(&out, p + litStart, count - litStart) < 0 || flushRun(&out) < 0 || frameFinish(&out.ctx) < 0)
+	goto DONE;
+
+    printf("Client says: delta sent %lld literal bytes, %lld bytes matched the server's copy\n",
+	   (long long) out.literal, (long long) out.copied);
+    status = 0;
+
+    DONE:
+    if (map != NULL)
+	munmap(map, mapLen);
+    frameFree(&out.ctx);
+    free(t.sigs);
+    free(t.slots);
+    return (status < 0) ? -1 : count;
+}
+
+/**
+ * Append blocks 'first' .. 'first + n - 1' of 'oldfd' to 'newfd', in the kernel when possible.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int copyBlocks(int newfd, int oldfd, uint64_t first, uint64_t n, size_t blockLen) {
+
+    off_t at = first * blockLen, len = n * blockLen;
+    char *buf;
+    ssize_t moved;
+
+    moved = zeroCopySend(newfd, oldfd, at, len);
+    if (moved < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EXDEV)) {
+	if ( (buf = malloc(blockLen)) == NULL )
+	    return -1;
+	for (moved = 0; moved < len; moved += blockLen)
+	    if (pread(oldfd, buf, blockLen, at + moved) != (ssize_t) blockLen || writeFileAll(newfd, buf, blockLen) < 0)
+		break;
+	free(buf);
+    }
+    return (moved == len) ? 0 : -1;
+}
+
+off_t receiveDelta(int sockfd, const ncp_hdr_t *hdr, const char *filename) {
+
+    frame_ctx_t ctx;
+    struct stat oldStat;
+    char tmpName[PATH_MAX];
+    unsigned char *buf = NULL;
+    uint8_t type;
+    uint32_t len;
+    uint64_t first, n, blocks = 0;
+    off_t total = 0, copied = 0;
+    size_t blockLen;
+    int oldfd, newfd = -1, savedErrno;
+
+    // step 1: signatures of the current copy, if there is one
+    if ( (oldfd = open(filename, O_RDONLY)) >= 0 && fstat(oldfd, &oldStat) < 0 ) {
+	close(oldfd);
+	return -1;
+    }
+    if (oldfd < 0)
+	oldStat.st_size = 0;
+    blockLen = blockLenFor(oldStat.st_size);
+    if (oldfd >= 0)
+	blocks = oldStat.st_size / blockLen;
+
+    if (frameInit(&ctx, sockfd, hdr) < 0)
+	goto FAIL;
+    if (sendSignatures(&ctx, oldfd, oldfd >= 0 ? oldStat.st_size : -1, blockLen) < 0) {
+	frameFree(&ctx);
+	goto FAIL;
+    }
+    frameFree(&ctx);
+
+    // step 3: rebuild next to the old copy, so the final rename() stays within one file system
+    if (snprintf(tmpName, sizeof(tmpName), "%s.ncpXXXXXX", filename) >= (int) sizeof(tmpName)) {
+	errno = ENAMETOOLONG;
+	goto FAIL;
+    }
+    if ( (newfd = mkstemp(tmpName)) < 0 )
+	goto FAIL;
+    if (outputReserve(newfd, 0, hdr->length, 1) < 0)
+	goto FAIL;
+    fchmod(newfd, (oldfd >= 0) ? (oldStat.st_mode & 07777) : 0644);
+
+    if (frameInit(&ctx, sockfd, hdr) < 0)
+	goto FAIL;
+    if ( (buf = malloc(NCP_MAX_CHUNK)) == NULL )
+	goto FAIL_CTX;
+    while (1) {
+	if (frameRecv(&ctx, &type, buf, &len) < 0)
+	    goto FAIL_CTX;
+	if (type == NCP_CHUNK_END)
+	    break;
+	if (type == NCP_CHUNK_DATA) {
+	    if (total + len > (off_t) hdr->length)
+		goto BAD;
+	    if (writeFileAll(newfd, buf, len) < 0)
+		goto FAIL_CTX;
+	    total += len;
+	} else if (type == NCP_CHUNK_COPY && len == 16) {
+	    first = get64(buf);
+	    n = get64(buf + 8);
+	    if (first >= blocks || n > blocks - first || total + (off_t) (n * blockLen) > (off_t) hdr->length)
+		goto BAD;
+	    if (copyBlocks(newfd, oldfd, first, n, blockLen) < 0)
+		goto FAIL_CTX;
+	    total += n * blockLen;
+	    copied += n * blockLen;
+	} else
+	    goto BAD;
+    }
+    frameFree(&ctx);
+    free(buf);
+    buf = NULL;
+
+    if (total != (off_t) hdr->length) {
+	errno = EPROTO;
+	goto FAIL;
+    }
+    if (rename(tmpName, filename) < 0)
+	goto FAIL;
+    close(newfd);
+    if (oldfd >= 0)
+	close(oldfd);
+
+    printf("Server says: delta rebuilt '%s', %lld bytes reused from the old copy\n", filename, (long long) copied);
+    return total;
+
+    BAD:
+    errno = EPROTO;
+    FAIL_CTX:
+    savedErrno = errno;
+    frameFree(&ctx);
+    errno = savedErrno;
+    FAIL:
+    savedErrno = errno;
+    free(buf);
+    if (newfd >= 0) {
+	close(newfd);
+	unlink(tmpName);
+    }
+    if (oldfd >= 0)
+	close(oldfd);
+    errno = savedErrno;
+    return -1;
+}
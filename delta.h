@@ -0,0 +1,38 @@
+/*
+ * header file for rsync-style delta transfers (-D)
+ */
+
+#ifndef DELTA_H_
+#define DELTA_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "proto.h"
+
+#define DELTA_MIN_BLOCK 2048			// block size bounds; in between it grows with the square root of the file size
+#define DELTA_MAX_BLOCK (128 * 1024)
+#define DELTA_STRONG_LEN 16			// bytes of SHA-256 kept as a block's strong checksum
+#define DELTA_SIG_LEN (4 + DELTA_STRONG_LEN)	// one block signature on the wire: weak, strong
+
+/**
+ * Client side: after the header 'hdr' (NCP_F_DELTA) was sent on 'sockfd', read the server's block
+ * signatures of its current copy, scan 'count' bytes of 'filefd' from 'offset' with a rolling
+ * checksum, and send literal data for what the server lacks and block references for the rest.
+ *
+ * Return:
+ * 	number of file bytes the server can rebuild ('count' on success), or -1 on error
+ **/
+off_t sendDelta(int sockfd, const ncp_hdr_t *hdr, int filefd, off_t offset, off_t count);
+
+/**
+ * Server side: send the block signatures of 'filename' (none if it does not exist yet), then
+ * rebuild it from the client's literals and block references into a temporary file that
+ * replaces 'filename' once the whole delta has been received and verified.
+ *
+ * Return:
+ * 	size of the rebuilt file, or -1 on error ('filename' is then left as it was)
+ **/
+off_t receiveDelta(int sockfd, const ncp_hdr_t *hdr, const char *filename);
+
+#endif
@@ -0,0 +1,356 @@
+/*
+ * The persistent, concurrent form of the server (-k).
+ *
+ * Instead of accepting one client and exiting, the listening socket and every accepted
+ * connection are made non-blocking and registered with one epoll instance. Whenever a
+ * connection becomes readable, whatever it has buffered is spliced into that connection's
+ * own output file; a closed connection is reported and its slot freed. Hundreds of senders
+ * can therefore be drained at once by a single thread.
+ *
+ * Per-connection state lives in a small table indexed by the connection's descriptor, so
+ * looking a connection up on every event is a single array access.
+ *
+ * Every connection opens with its transfer header, which is read (in as many pieces as it
+ * arrives) before anything reaches the output file. Only plain transfers are served: any other
+ * header expects frames to be verified, answers to be sent or stripes to be joined, which does
+ * not fit one splice per event. Such a client, or one that sends no header at all, is refused
+ * and its output file removed, so it sees its connection closed instead of a file that holds
+ * the header.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. man 7 epoll
+ */
+
+#define _GNU_SOURCE			// for accept4(), splice()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+
+#include "nc_args_t.h"
+#include "transfer.h"
+#include "event_loop.h"
+#include "stats.h"			// telemetry for -v
+#include "proto.h"			// transfer header every connection opens with
+
+void promptError(char *);		// defined in prompt_error.h
+
+#define EVENT_CHUNK 65536			// bytes moved from one connection before serving the next
+#define EVENT_REFUSED 2				// readHeader(): the connection is not a plain transfer
+
+/**
+ * State kept for every open client connection
+ **/
+typedef struct conn_state {
+    int outfd;					// output file of this connection; -1 if slot is free
+    unsigned int id;				// connection sequence number, used in the output file name
+    off_t bytes;				// bytes written to the output file so far
+    uint64_t start;				// statsStart() when the connection was accepted
+    unsigned char wire[NCP_HDR_LEN];		// the transfer header, as far as it has arrived
+    size_t hdrLen;				// bytes of it read so far
+} conn_state_t;
+
+static conn_state_t *conns = NULL;		// connection table, indexed by socket descriptor
+static int connsCap = 0;			// number of slots in the connection table
+static int useSplice = 1;			// cleared once splice() turns out to be unsupported
+
+/**
+ * Make sure the connection table has a slot for descriptor 'fd'.
+ *
+ * Return:
+ * 	0 on success, -1 if memory could not be allocated
+ **/
+static int reserveSlot(int fd) {
+
+    int newCap, i;
+    conn_state_t *grown;
+
+    if (fd < connsCap)
+	return 0;
+
+    newCap = (connsCap == 0) ? 64 : connsCap;
+    while (newCap <= fd)
+	newCap *= 2;
+
+    if ( (grown = realloc(conns, newCap * sizeof(conn_state_t))) == NULL )
+	return -1;
+    for (i = connsCap; i < newCap; i++)
+	grown[i].outfd = -1;
+
+    conns = grown;
+    connsCap = newCap;
+    return 0;
+}
+
+void connFilename(char *name, size_t len, const char *template, unsigned int id) {
+
+    const char *mark = strstr(template, "%d");
+
+    if (mark != NULL && strchr(mark + 2, '%') == NULL && strchr(template, '%') == mark)	// exactly one conversion
+	snprintf(name, len, template, id);
+    else
+	snprintf(name, len, "%s.%u", template, id);
+}
+
+/**
+ * Close connection 'fd', its output file, and report what was received on it.
+ *
+ * Return:
+ * 	void
+ **/
+static void closeConn(int epfd, int fd, const char *template, int failed) {
+
+    char name[4096];
+    conn_state_t *c = &conns[fd];
+
+    connFilename(name, sizeof(name), template, c->id);
+    if (failed)
+	fprintf(stderr, "Server says: transfer into '%s' failed after %lld bytes\n", name, (long long) c->bytes);
+    else
+	printf("Server says: %lld bytes written to file '%s'\n", (long long) c->bytes, name);
+    fflush(stdout);
+    statsConnection(c->id, c->bytes, c->start, fd);
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    close(c->outfd);
+    close(fd);
+    c->outfd = -1;
+}
+
+/**
+ * Refuse connection 'fd', whose header is not that of a plain transfer, and remove its output file.
+ *
+ * Return:
+ * 	void
+ **/
+static void refuseConn(int epfd, int fd, const char *template) {
+
+    char name[4096];
+    conn_state_t *c = &conns[fd];
+
+    connFilename(name, sizeof(name), template, c->id);
+    fprintf(stderr, "Server says: connection %u refused, -k takes plain transfers only\n", c->id);
+    unlink(name);
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    close(c->outfd);
+    close(fd);
+    c->outfd = -1;
+}
+
+/**
+ * Accept every pending connection on 'listenfd', open its output file and register it with epoll.
+ *
+ * Return:
+ * 	void
+ **/
+static void acceptAll(int epfd, int listenfd, const char *template, unsigned int *nextId) {
+
+    struct sockaddr_storage clientAddr;		// IPv4 or IPv6
+    socklen_t clientAddrLength;
+    struct epoll_event ev;
+    char name[4096];
+    int fd, outfd;
+
+    while (1) {
+	clientAddrLength = sizeof(clientAddr);
+	if ( (fd = accept4(listenfd, (struct sockaddr *) &clientAddr, &clientAddrLength, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0 ) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("Server could not accept client connection");
+	    return;				// backlog is empty
+	}
+
+	connFilename(name, sizeof(name), template, *nextId);
+	if ( (outfd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ) {
+	    perror("ERROR: Could not open output file at server");
+	    close(fd);
+	    continue;
+	}
+	if (reserveSlot(fd) < 0) {
+	    perror("ERROR: Server connection table is full");
+	    close(outfd);
+	    close(fd);
+	    continue;
+	}
+
+	conns[fd].outfd = outfd;
+	conns[fd].id = (*nextId)++;
+	conns[fd].bytes = 0;
+	conns[fd].start = statsStart();
+	conns[fd].hdrLen = 0;
+
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	    perror("ERROR: Could not watch client connection");
+	    close(outfd);
+	    close(fd);
+	    conns[fd].outfd = -1;
+	}
+    }
+}
+
+/**
+ * Read what has arrived of the transfer header of connection 'fd'.
+ *
+ * Return:
+ * 	1 while the connection is still open, -1 on error, EVENT_REFUSED if the header is not
+ * 	that of a plain transfer or the client closed the connection before it was whole
+ **/
+static int readHeader(int fd) {
+
+    conn_state_t *c = &conns[fd];
+    ncp_hdr_t hdr;
+    ssize_t n;
+
+    n = read(fd, c->wire + c->hdrLen, NCP_HDR_LEN - c->hdrLen);
+    if (n < 0)
+	return (errno == EAGAIN || errno == EINTR) ? 1 : -1;
+    if (n == 0)
+	return EVENT_REFUSED;
+    c->hdrLen += n;
+    if (c->hdrLen < NCP_HDR_LEN)
+	return 1;
+    return (decodeHeader(c->wire, &hdr) < 0 || hdr.flags != 0) ? EVENT_REFUSED : 1;
+}
+
+/**
+ * Move up to EVENT_CHUNK bytes that are waiting on connection 'fd' into its output file, through
+ * the shared pipe while splice() works and through 'buffer' otherwise.
+ * The connection is level-triggered, so anything left over is picked up on the next round,
+ * which keeps one fast sender from starving the others.
+ *
+ * Return:
+ * 	1 if the connection is still open, 0 once the client closed it, -1 on error
+ **/
+static int drainConn(int fd, int pipefd[2], char *buffer) {
+
+    conn_state_t *c = &conns[fd];
+    ssize_t n, m;
+    size_t inPipe;
+    uint64_t start;
+
+    if (useSplice) {
+	start = statsStart();
+	n = splice(fd, NULL, pipefd[1], NULL, EVENT_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	statsIo(STATS_NET, start, EVENT_CHUNK, n);
+	if (n < 0 && c->bytes == 0 && (errno == EINVAL || errno == ENOSYS)) {
+	    useSplice = 0;			// kernel cannot splice this socket, switch every connection to the buffered path
+	    return drainConn(fd, pipefd, buffer);
+	}
+	if (n < 0)
+	    return (errno == EAGAIN || errno == EINTR) ? 1 : -1;
+	if (n == 0)
+	    return 0;
+
+	// the pipe is shared by all connections, so empty it before touching the next one
+	for (inPipe = n; inPipe > 0; inPipe -= m) {
+	    start = statsStart();
+	    m = splice(pipefd[0], NULL, c->outfd, NULL, inPipe, SPLICE_F_MOVE);
+	    statsIo(STATS_DISK, start, inPipe, m);
+	    if (m > 0)
+		continue;
+	    if (m < 0 && (errno == EINVAL || errno == ENOSYS)) {
+		useSplice = 0;			// output files cannot be spliced into, copy what is stranded in the pipe
+		if ( (m = read(pipefd[0], buffer, inPipe)) > 0 && writeFileAll(c->outfd, buffer, m) == m )
+		    continue;
+	    }
+	    return -1;
+	}
+    } else {
+	start = statsStart();
+	n = read(fd, buffer, EVENT_CHUNK);
+	statsIo(STATS_NET, start, EVENT_CHUNK, n);
+	if (n < 0)
+	    return (errno == EAGAIN || errno == EINTR) ? 1 : -1;
+	if (n == 0)
+	    return 0;
+	if (writeFileAll(c->outfd, buffer, n) < 0)
+	    return -1;
+    }
+
+    c->bytes += n;
+    return 1;
+}
+
+/**
+ * Serve clients arriving on the listening socket 'listenfd' forever.
+ *
+ * Return:
+ * 	void; only returns if the event loop itself fails
+ **/
+void runEventLoop(int listenfd, nc_args_t *nc_args) {
+
+    struct epoll_event ev, events[MAXEVENTS];
+    int epfd, nready, i, fd, status;
+    int pipefd[2];				// shared socket -> file pipe for splice()
+    char *buffer;				// only used once splice() turns out to be unsupported
+    unsigned int nextId = 0;			// sequence number of the next accepted connection
+
+    if ( (buffer = malloc(EVENT_CHUNK)) == NULL )
+	promptError((char *) "ERROR: Server could not allocate its receive buffer");
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+	pipefd[0] = pipefd[1] = -1;
+	useSplice = 0;
+    }
+
+    if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) < 0)
+	promptError((char *) "ERROR: Could not make listening socket non-blocking");
+
+    if ( (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 )
+	promptError((char *) "ERROR: Could not create epoll instance");
+
+    ev.events = EPOLLIN;
+    ev.data.fd = listenfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+	promptError((char *) "ERROR: Could not watch listening socket");
+
+    while (1) {
+	if ( (nready = epoll_wait(epfd, events, MAXEVENTS, -1)) < 0 ) {
+	    if (errno == EINTR)
+		continue;
+	    perror("ERROR: epoll_wait failed");
+	    break;
+	}
+
+	for (i = 0; i < nready; i++) {
+	    fd = events[i].data.fd;
+
+	    if (fd == listenfd) {
+		acceptAll(epfd, listenfd, nc_args->serverFilename, &nextId);
+		continue;
+	    }
+
+	    // the header comes first; the payload after it is drained on the next rounds
+	    if (conns[fd].hdrLen < NCP_HDR_LEN) {
+		status = readHeader(fd);
+		if (status == EVENT_REFUSED)
+		    refuseConn(epfd, fd, nc_args->serverFilename);
+		else if (status < 0)
+		    closeConn(epfd, fd, nc_args->serverFilename, 1);
+		continue;
+	    }
+
+	    status = drainConn(fd, pipefd, buffer);
+	    if (status <= 0)
+		closeConn(epfd, fd, nc_args->serverFilename, status < 0);
+	}
+    }
+
+    close(epfd);
+    if (pipefd[0] >= 0) {
+	close(pipefd[0]);
+	close(pipefd[1]);
+    }
+    free(buffer);
+}
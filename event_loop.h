@@ -0,0 +1,32 @@
+/*
+ * header file for the epoll-driven concurrent server
+ */
+
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+#include <stddef.h>
+
+#include "nc_args_t.h"
+
+#define MAXEVENTS 256				// epoll events handled per epoll_wait() call
+
+/**
+ * Serve clients arriving on the listening socket 'listenfd' forever. Every connection is
+ * drained into its own output file, named from nc_args->serverFilename (see connFilename()).
+ *
+ * Return:
+ * 	void; only returns if the event loop itself fails
+ **/
+void runEventLoop(int listenfd, nc_args_t *nc_args);
+
+/**
+ * Build the output file name of connection number 'id' from the user's template. A "%d" in
+ * the template is replaced by the connection number; otherwise ".<id>" is appended.
+ *
+ * Return:
+ * 	void, but 'name' will have the result
+ **/
+void connFilename(char *name, size_t len, const char *template, unsigned int id);
+
+#endif
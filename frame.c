@@ -0,0 +1,665 @@
+/*
+ * The framed data stream used by every transfer mode that needs more than raw bytes.
+ *
+ * After the transfer header the payload travels as chunk frames:
+ *
+ * 	type (1) | flags (1) | reserved (2) | length (4) | payload (length) | MAC (NCP_MAC_LEN)
+ *
+ * The MAC is only present when the header carries NCP_F_HMAC. It is an HMAC keyed with the
+ * shared key over the chunk's sequence number, its frame header and its payload, so the
+ * receiver can verify each chunk as soon as it arrives and reject a corrupted or reordered
+ * transfer at the first bad chunk. Memory stays bounded by one chunk. A running HMAC over the
+ * transfer header and all payload is closed by the NCP_CHUNK_END trailer, which also carries
+ * the total length, so a truncated stream is detected as well.
+ *
+ * With NCP_F_COMPRESS data chunks that compress go out as NCP_CHUNK_ZDATA (see compress.c).
+ * The MACs cover the compressed bytes as sent, so nothing is inflated before it is verified,
+ * while the trailer's total counts the data as it was before compression.
+ *
+ * With NCP_F_GCM the stream is encrypted instead: every chunk, the trailer included, is sealed
+ * with AES-128-GCM, and its 16-byte tag takes the place of the MAC. The stream opens with an
+ * NCP_CHUNK_SALT chunk of fresh random bytes in the clear; the stream's key is derived from the
+ * shared key, that salt and the transfer header, so two streams never share a key and a changed
+ * header leaves the receiver with the wrong one. The nonce is the chunk's sequence number and
+ * the frame header is authenticated along with the payload, so chunks cannot be reordered,
+ * dropped or relabelled; a truncated stream still lacks its trailer. EVP picks the AES-NI and
+ * carry-less multiply code on CPUs that have them.
+ *
+ * With NCP_F_SPARSE the sender looks for holes in the range with SEEK_DATA/SEEK_HOLE and sends
+ * each one as a single NCP_CHUNK_HOLE carrying its length; only the data extents are read and
+ * sent. The receiver leaves the hole unwritten. Holes count towards the trailer's total and
+ * are authenticated like any other chunk.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. man 3 EVP_MAC
+ * 	       2. man 3 EVP_EncryptInit, "GCM and OCB Modes"
+ * 	       3. NIST SP 800-38D, Galois/Counter Mode
+ * 	       4. man 2 lseek, "Seeking file data and holes"
+ */
+
+#define _GNU_SOURCE			// for SEEK_DATA and SEEK_HOLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>			// for struct iovec
+#include <arpa/inet.h>
+
+#include <openssl/evp.h>
+#include <openssl/params.h>
+#include <openssl/crypto.h>		// for CRYPTO_memcmp()
+#include <openssl/rand.h>		// salt of an encrypted stream
+
+#include "proto.h"
+#include "frame.h"
+#include "transfer.h"
+#include "shared_key.h"			// key for the HMAC and for deriving stream keys
+#include "stats.h"			// telemetry for -v
+#include "tune.h"			// chunk sizing
+#include "pipeline.h"			// multi-threaded send of large files
+#include "output.h"			// staged, aligned writes of received data
+
+#define GCM_KEY_LEN 16				// AES-128
+#define GCM_IV_LEN 12				// 4 zero bytes, then the chunk's sequence number
+
+/**
+ * Create an HMAC context keyed with the shared key.
+ *
+ * Return:
+ * 	the context, or NULL on error
+ **/
+static EVP_MAC_CTX *newKeyedMac(void) {
+
+    EVP_MAC *mac;
+    EVP_MAC_CTX *macCtx;
+    OSSL_PARAM params[2];
+
+    if ( (mac = EVP_MAC_fetch(NULL, "HMAC", NULL)) == NULL )
+	return NULL;
+    macCtx = EVP_MAC_CTX_new(mac);
+    EVP_MAC_free(mac);				// the context keeps its own reference
+    if (macCtx == NULL)
+	return NULL;
+
+    params[0] = OSSL_PARAM_construct_utf8_string("digest", (char *) NCP_MAC_DIGEST, 0);
+    params[1] = OSSL_PARAM_construct_end();
+    // the key is binary, so its length is sizeof(key) and not strlen(key)
+    if (!EVP_MAC_init(macCtx, (const unsigned char *) key, sizeof(key), params)) {
+	EVP_MAC_CTX_free(macCtx);
+	return NULL;
+    }
+
+    return macCtx;
+}
+
+/**
+ * Prepare 'ctx' for the stream on 'fd' that follows header 'hdr'.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int frameInit(frame_ctx_t *ctx, int fd, const ncp_hdr_t *hdr) {
+
+    unsigned char wire[NCP_HDR_LEN];
+
+    memset(ctx, 0, sizeof(frame_ctx_t));
+    ctx->fd = fd;
+    ctx->flags = hdr->flags;
+
+    if (ctx->flags & NCP_F_HMAC) {
+	if ( (ctx->chunkMac = newKeyedMac()) == NULL || (ctx->streamMac = newKeyedMac()) == NULL ) {
+	    frameFree(ctx);
+	    errno = ENOMEM;
+	    return -1;
+	}
+	// the header is covered by the trailer's MAC, so its fields cannot be altered either
+	encodeHeader(hdr, wire);
+	EVP_MAC_update(ctx->streamMac, wire, NCP_HDR_LEN);
+    }
+    // an encrypted stream is keyed once its salt is sent or received
+    if (ctx->flags & NCP_F_GCM)
+	encodeHeader(hdr, ctx->hdrWire);
+
+    return 0;
+}
+
+/**
+ * Release the resources held by 'ctx'.
+ **/
+void frameFree(frame_ctx_t *ctx) {
+    EVP_MAC_CTX_free(ctx->chunkMac);
+    EVP_MAC_CTX_free(ctx->streamMac);
+    ctx->chunkMac = ctx->streamMac = NULL;
+    EVP_CIPHER_CTX_free(ctx->gcm);
+    ctx->gcm = NULL;
+    free(ctx->cbuf);
+    ctx->cbuf = NULL;
+    if (ctx->zc != NULL)
+	compressEnd(ctx->zc);
+    if (ctx->zin != NULL)
+	inflateEnd(ctx->zin);
+    free(ctx->zc);
+    free(ctx->zin);
+    free(ctx->zbuf);
+    ctx->zc = NULL;
+    ctx->zin = NULL;
+    ctx->zbuf = NULL;
+}
+
+/**
+ * Set up the compressor (sending) or decompressor (receiving) of 'ctx' and its chunk buffer.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int setupCompression(frame_ctx_t *ctx, int sending) {
+
+    if (ctx->zbuf == NULL && (ctx->zbuf = malloc(NCP_MAX_CHUNK)) == NULL)
+	return -1;
+    if (sending && ctx->zc == NULL) {
+	if ( (ctx->zc = malloc(sizeof(compress_state_t))) == NULL )
+	    return -1;
+	if (compressBegin(ctx->zc) < 0) {
+	    free(ctx->zc);
+	    ctx->zc = NULL;
+	    return -1;
+	}
+    } else if (!sending && ctx->zin == NULL) {
+	if ( (ctx->zin = calloc(1, sizeof(z_stream))) == NULL )
+	    return -1;
+	if (inflateInit(ctx->zin) != Z_OK) {
+	    free(ctx->zin);
+	    ctx->zin = NULL;
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/**
+ * Key the cipher of 'ctx' for the stream with salt 'salt': the stream key is the HMAC of the
+ * salt and the transfer header under the shared key, cut to AES-128.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int keyStream(frame_ctx_t *ctx, const unsigned char *salt, int sending) {
+
+    unsigned char msg[NCP_SALT_LEN + NCP_HDR_LEN];
+    unsigned char streamKey[EVP_MAX_MD_SIZE];
+    size_t keyLen;
+    int ok;
+
+    memcpy(msg, salt, NCP_SALT_LEN);
+    memcpy(msg + NCP_SALT_LEN, ctx->hdrWire, NCP_HDR_LEN);
+    if (EVP_Q_mac(NULL, "HMAC", NULL, NCP_MAC_DIGEST, NULL, key, sizeof(key), msg, sizeof(msg),
+		  streamKey, sizeof(streamKey), &keyLen) == NULL || keyLen < GCM_KEY_LEN)
+	return -1;
+
+    if ( (ctx->gcm = EVP_CIPHER_CTX_new()) == NULL )
+	return -1;
+    ok = EVP_CipherInit_ex(ctx->gcm, EVP_aes_128_gcm(), NULL, streamKey, NULL, sending);
+    OPENSSL_cleanse(streamKey, sizeof(streamKey));
+    if (!ok) {
+	EVP_CIPHER_CTX_free(ctx->gcm);
+	ctx->gcm = NULL;
+	return -1;
+    }
+    return 0;
+}
+
+/**
+ * Encrypt (sending) or decrypt (receiving) the 'len' bytes of 'data' in place as the chunk with
+ * frame header 'chdr' and the current sequence number. Sealing writes the tag to 'tag', opening
+ * checks it against 'tag'.
+ *
+ * Return:
+ * 	0 on success, -1 on error (errno EBADMSG if the tag does not match)
+ **/
+static int gcmChunk(frame_ctx_t *ctx, const unsigned char *chdr, unsigned char *data, uint32_t len, unsigned char *tag) {
+
+    unsigned char iv[GCM_IV_LEN] = { 0 };
+    int outLen, sending = EVP_CIPHER_CTX_is_encrypting(ctx->gcm);
+
+    put64(iv + 4, ctx->seq);
+    if (!EVP_CipherInit_ex(ctx->gcm, NULL, NULL, NULL, iv, -1)
+	|| !EVP_CipherUpdate(ctx->gcm, NULL, &outLen, chdr, NCP_CHUNK_HDR_LEN)	// frame header as AAD
+	|| (len > 0 && !EVP_CipherUpdate(ctx->gcm, data, &outLen, data, len)))
+	return -1;
+
+    if (sending)
+	return (EVP_CipherFinal_ex(ctx->gcm, data + len, &outLen)
+		&& EVP_CIPHER_CTX_ctrl(ctx->gcm, EVP_CTRL_GCM_GET_TAG, NCP_GCM_TAG_LEN, tag)) ? 0 : -1;
+
+    if (!EVP_CIPHER_CTX_ctrl(ctx->gcm, EVP_CTRL_GCM_SET_TAG, NCP_GCM_TAG_LEN, tag))
+	return -1;
+    if (EVP_CipherFinal_ex(ctx->gcm, data + len, &outLen) <= 0) {
+	errno = EBADMSG;			// forged, corrupted or out of place
+	return -1;
+    }
+    return 0;
+}
+
+/**
+ * Start the sending side of 'ctx': send the salt of an encrypted stream and key it.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int frameStart(frame_ctx_t *ctx) {
+
+    unsigned char chunk[NCP_CHUNK_HDR_LEN + NCP_SALT_LEN];
+    uint32_t netLen = htonl(NCP_SALT_LEN);
+
+    if (!(ctx->flags & NCP_F_GCM) || ctx->gcm != NULL)
+	return 0;
+
+    chunk[0] = NCP_CHUNK_SALT;
+    chunk[1] = chunk[2] = chunk[3] = 0;
+    memcpy(chunk + 4, &netLen, 4);
+    if (RAND_bytes(chunk + NCP_CHUNK_HDR_LEN, NCP_SALT_LEN) != 1
+	|| keyStream(ctx, chunk + NCP_CHUNK_HDR_LEN, 1) < 0)
+	return -1;
+    return (writeAll(ctx->fd, chunk, sizeof(chunk)) < 0) ? -1 : 0;
+}
+
+/**
+ * Return:
+ * 	bytes of MAC or tag after each chunk of 'ctx'
+ **/
+size_t frameTagLen(const frame_ctx_t *ctx) {
+    if (ctx->flags & NCP_F_GCM)
+	return NCP_GCM_TAG_LEN;
+    return (ctx->flags & NCP_F_HMAC) ? NCP_MAC_LEN : 0;
+}
+
+/**
+ * Compute the MAC of one chunk into 'mac'. The trailer is authenticated by the running
+ * stream MAC instead of a per-chunk one.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int chunkMac(frame_ctx_t *ctx, const unsigned char *chdr, const void *data, uint32_t len, unsigned char *mac) {
+
+    unsigned char seq[8];
+    size_t macLen;
+    EVP_MAC_CTX *macCtx = (chdr[0] == NCP_CHUNK_END) ? ctx->streamMac : ctx->chunkMac;
+
+    put64(seq, ctx->seq);
+    if (macCtx == ctx->chunkMac && !EVP_MAC_init(macCtx, NULL, 0, NULL))	// same key, fresh state
+	return -1;
+    if (!EVP_MAC_update(macCtx, seq, sizeof(seq)) || !EVP_MAC_update(macCtx, chdr, NCP_CHUNK_HDR_LEN)
+	|| !EVP_MAC_update(macCtx, data, len) || !EVP_MAC_final(macCtx, mac, &macLen, NCP_MAC_LEN))
+	return -1;
+
+    return 0;
+}
+
+/**
+ * Build the frame header and MAC of one chunk and advance the stream state.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int frameSeal(frame_ctx_t *ctx, uint8_t type, void *data, uint32_t len, unsigned char *chdr, unsigned char *mac) {
+
+    uint32_t netLen = htonl(len);
+    uint64_t counted = 0;			// file bytes the chunk stands for, read before encryption
+
+    if (type == NCP_CHUNK_DATA)
+	counted = len;
+    else if (type == NCP_CHUNK_ZDATA)		// the trailer counts data bytes as they were before compression
+	counted = get32(data);
+    else if (type == NCP_CHUNK_HOLE)
+	counted = get64(data);
+
+    chdr[0] = type;
+    chdr[1] = chdr[2] = chdr[3] = 0;
+    memcpy(chdr + 4, &netLen, 4);
+
+    if (ctx->flags & NCP_F_HMAC) {
+	if (type != NCP_CHUNK_END)
+	    EVP_MAC_update(ctx->streamMac, data, len);
+	if (chunkMac(ctx, chdr, data, len, mac) < 0)
+	    return -1;
+    } else if ((ctx->flags & NCP_F_GCM) && gcmChunk(ctx, chdr, data, len, mac) < 0)
+	return -1;
+
+    ctx->seq++;
+    ctx->bytes += counted;
+    if (type == NCP_CHUNK_ZDATA) {
+	ctx->zIn += counted;
+	ctx->zOut += len;
+    } else if (type == NCP_CHUNK_HOLE)
+	ctx->holes += counted;
+    return 0;
+}
+
+/**
+ * Send one chunk frame of type 'type' carrying 'len' bytes of 'data'.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int frameSend(frame_ctx_t *ctx, uint8_t type, const void *data, uint32_t len) {
+
+    unsigned char chdr[NCP_CHUNK_HDR_LEN];
+    unsigned char mac[NCP_MAC_LEN];
+    struct iovec iov[3];
+    uint32_t zlen;
+
+    if (frameStart(ctx) < 0)
+	return -1;
+
+    if (type == NCP_CHUNK_DATA && (ctx->flags & NCP_F_COMPRESS)) {
+	if (setupCompression(ctx, 1) < 0)
+	    return -1;
+	if ( (zlen = compressChunk(ctx->zc, data, len, ctx->zbuf)) > 0 ) {
+	    type = NCP_CHUNK_ZDATA;
+	    data = ctx->zbuf;
+	    len = zlen;
+	}
+    }
+
+    // encryption works in place, so the caller's data is copied unless it is the compressed copy already
+    if ((ctx->flags & NCP_F_GCM) && data != ctx->zbuf) {
+	if (ctx->cbuf == NULL && (ctx->cbuf = malloc(NCP_MAX_CHUNK)) == NULL)
+	    return -1;
+	memcpy(ctx->cbuf, data, len);
+	data = ctx->cbuf;
+    }
+
+    if (frameSeal(ctx, type, (void *) data, len, chdr, mac) < 0)
+	return -1;
+
+    // one gathered write per frame, so small frames never wait on Nagle behind their own header
+    iov[0].iov_base = chdr;
+    iov[0].iov_len = NCP_CHUNK_HDR_LEN;
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = len;
+    iov[2].iov_base = mac;
+    iov[2].iov_len = frameTagLen(ctx);
+    return (writevAll(ctx->fd, iov, (iov[2].iov_len > 0) ? 3 : 2) < 0) ? -1 : 0;
+}
+
+/**
+ * Send the trailer that closes the stream.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int frameFinish(frame_ctx_t *ctx) {
+
+    unsigned char total[8];
+
+    put64(total, ctx->bytes);
+    return frameSend(ctx, NCP_CHUNK_END, total, sizeof(total));
+}
+
+/**
+ * Receive and verify one chunk frame into 'buf' (NCP_MAX_CHUNK bytes).
+ *
+ * Return:
+ * 	0 on success with '*type' and '*len' set, -1 on error
+ **/
+int frameRecv(frame_ctx_t *ctx, uint8_t *type, void *buf, uint32_t *len) {
+
+    unsigned char chdr[NCP_CHUNK_HDR_LEN];
+    unsigned char mac[NCP_MAC_LEN], expected[NCP_MAC_LEN];
+    unsigned char *payload = buf;		// where the chunk's payload is read to
+    uint32_t netLen;
+
+    NEXT:
+    if (readAll(ctx->fd, chdr, NCP_CHUNK_HDR_LEN) != NCP_CHUNK_HDR_LEN)
+	goto TRUNCATED;
+    memcpy(&netLen, chdr + 4, 4);
+    *type = chdr[0];
+    *len = ntohl(netLen);
+
+    // an encrypted stream opens with its salt, and nothing else may come before it
+    if ((ctx->flags & NCP_F_GCM) && ctx->gcm == NULL) {
+	if (*type != NCP_CHUNK_SALT || *len != NCP_SALT_LEN) {
+	    errno = EPROTO;
+	    return -1;
+	}
+	if (readAll(ctx->fd, buf, NCP_SALT_LEN) != NCP_SALT_LEN)
+	    goto TRUNCATED;
+	if (keyStream(ctx, buf, 0) < 0)
+	    return -1;
+	goto NEXT;
+    }
+
+    if (*len > NCP_MAX_CHUNK || (*type == NCP_CHUNK_END && *len != 8)
+	|| (*type == NCP_CHUNK_ZDATA && !(ctx->flags & NCP_F_COMPRESS))
+	|| (*type == NCP_CHUNK_HOLE && (*len != 8 || !(ctx->flags & NCP_F_SPARSE)))) {
+	errno = EPROTO;
+	return -1;
+    }
+    // a compressed payload lands in the stream's own buffer and is inflated into 'buf' once verified
+    if (*type == NCP_CHUNK_ZDATA) {
+	if (setupCompression(ctx, 0) < 0)
+	    return -1;
+	payload = ctx->zbuf;
+    }
+    if (readAll(ctx->fd, payload, *len) != *len)
+	goto TRUNCATED;
+
+    if (ctx->flags & NCP_F_HMAC) {
+	if (readAll(ctx->fd, mac, NCP_MAC_LEN) != NCP_MAC_LEN)
+	    goto TRUNCATED;
+	if (*type != NCP_CHUNK_END)
+	    EVP_MAC_update(ctx->streamMac, payload, *len);
+	if (chunkMac(ctx, chdr, payload, *len, expected) < 0)
+	    return -1;
+	if (CRYPTO_memcmp(mac, expected, NCP_MAC_LEN) != 0) {
+	    errno = EBADMSG;			// reject the transfer right here, before the chunk is used
+	    return -1;
+	}
+    } else if (ctx->flags & NCP_F_GCM) {
+	if (readAll(ctx->fd, mac, NCP_GCM_TAG_LEN) != NCP_GCM_TAG_LEN)
+	    goto TRUNCATED;
+	if (gcmChunk(ctx, chdr, payload, *len, mac) < 0)
+	    return -1;
+    }
+
+    if (*type == NCP_CHUNK_END && get64((unsigned char *) buf) != ctx->bytes) {
+	errno = EBADMSG;			// chunks went missing although each one verified
+	return -1;
+    }
+
+    if (*type == NCP_CHUNK_ZDATA) {
+	if (decompressChunk(ctx->zin, payload, *len, buf, NCP_MAX_CHUNK, len) < 0)
+	    return -1;
+	*type = NCP_CHUNK_DATA;
+    }
+
+    ctx->seq++;
+    if (*type == NCP_CHUNK_DATA)
+	ctx->bytes += *len;
+    else if (*type == NCP_CHUNK_HOLE) {
+	ctx->bytes += get64(buf);
+	ctx->holes += get64(buf);
+    }
+    return 0;
+
+    TRUNCATED:
+    errno = EPROTO;				// connection closed before the trailer
+    return -1;
+}
+
+/**
+ * Send 'count' bytes of file 'filefd' starting at 'offset' as data chunks.
+ *
+ * Return:
+ * 	number of payload bytes sent, or -1 on error
+ **/
+static off_t sendRange(frame_ctx_t *ctx, int filefd, off_t offset, off_t count) {
+
+    char *buf;
+    off_t total = 0;
+    ssize_t n;
+    size_t want;
+    uint64_t start;
+    tune_state_t tune;
+
+    // large files go through the reader/hasher/sender threads, reading and MACs then overlap the network
+    if (count >= PIPELINE_MIN_BYTES)
+	return pipelineSendData(ctx, filefd, offset, count);
+
+    if ( (buf = malloc(NCP_MAX_CHUNK)) == NULL )
+	return -1;
+    tuneBegin(&tune, ctx->fd, 1);
+
+    while (total < count) {
+	want = (tune.chunk < NCP_MAX_CHUNK) ? tune.chunk : NCP_MAX_CHUNK;	// a chunk frame holds NCP_MAX_CHUNK at most
+	if (want > count - total)
+	    want = count - total;
+	start = statsStart();
+	n = pread(filefd, buf, want, offset + total);
+	statsIo(STATS_DISK, start, want, n);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    goto FAIL;
+	}
+	if (n == 0)				// file shrank underneath us
+	    break;
+	if (frameSend(ctx, NCP_CHUNK_DATA, buf, n) < 0)
+	    goto FAIL;
+	total += n;
+	tuneUpdate(&tune, n);
+    }
+
+    free(buf);
+    return total;
+
+    FAIL:
+    free(buf);
+    return -1;
+}
+
+/**
+ * Send 'count' bytes of file 'filefd' starting at 'offset' as data chunks, with NCP_F_SPARSE
+ * one NCP_CHUNK_HOLE per hole in between.
+ *
+ * Return:
+ * 	number of bytes covered, holes included, or -1 on error
+ **/
+off_t frameSendData(frame_ctx_t *ctx, int filefd, off_t offset, off_t count) {
+
+    unsigned char hole[8];
+    off_t pos = offset, end = offset + count, data, next, n;
+
+    if (!(ctx->flags & NCP_F_SPARSE))
+	return sendRange(ctx, filefd, offset, count);
+
+    while (pos < end) {
+	// next data at or after 'pos'; none left means the range ends in a hole
+	if ( (data = lseek(filefd, pos, SEEK_DATA)) < 0 ) {
+	    if (errno == ENXIO)
+		data = end;
+	    else if (errno == EINVAL)		// file system without hole reporting, all data
+		data = pos;
+	    else
+		return -1;
+	}
+	if (data > end)
+	    data = end;
+	if (data > pos) {
+	    put64(hole, data - pos);
+	    if (frameSend(ctx, NCP_CHUNK_HOLE, hole, sizeof(hole)) < 0)
+		return -1;
+	    pos = data;
+	    continue;
+	}
+
+	// the data extent lasts up to the next hole (the end of the file is one)
+	if ( (next = lseek(filefd, pos, SEEK_HOLE)) < 0 || next > end)
+	    next = end;
+	if ( (n = sendRange(ctx, filefd, pos, next - pos)) < 0 )
+	    return -1;
+	if (n < next - pos) {			// file shrank underneath us
+	    pos += n;
+	    break;
+	}
+	pos = next;
+    }
+
+    return pos - offset;
+}
+
+/**
+ * Send 'count' bytes of file 'filefd' starting at 'offset' as data chunks, then the trailer.
+ *
+ * Return:
+ * 	number of payload bytes sent, or -1 on error
+ **/
+off_t frameSendFile(frame_ctx_t *ctx, int filefd, off_t offset, off_t count) {
+
+    off_t total = frameSendData(ctx, filefd, offset, count);
+
+    if (total < 0 || frameFinish(ctx) < 0)
+	return -1;
+    return total;
+}
+
+/**
+ * Receive data chunks up to the trailer and write them to 'outfd' starting at 'offset'. The
+ * chunks are verified in place in the output's staging buffer and written out in large blocks.
+ *
+ * Return:
+ * 	number of payload bytes written, or -1 on error
+ **/
+off_t frameReceiveFile(frame_ctx_t *ctx, int outfd, off_t offset, off_t count) {
+
+    output_t out;
+    void *buf;
+    off_t total = 0;
+    uint8_t type;
+    uint32_t len;
+    uint64_t hole;
+    int savedErrno;
+
+    if (outputOpen(&out, outfd, offset) < 0)
+	return -1;
+
+    while (1) {
+	if ( (buf = outputBuffer(&out, NCP_MAX_CHUNK)) == NULL )
+	    goto FAIL;
+	if (frameRecv(ctx, &type, buf, &len) < 0)
+	    goto FAIL;
+	if (type == NCP_CHUNK_END)
+	    break;
+	if (type == NCP_CHUNK_HOLE) {
+	    hole = get64(buf);
+	    if (hole > (uint64_t) (count - total)) {
+		errno = EPROTO;
+		goto FAIL;
+	    }
+	    if (outputSkip(&out, hole) < 0)
+		goto FAIL;
+	    total += hole;
+	    continue;
+	}
+	if (type != NCP_CHUNK_DATA || len > count - total) {
+	    errno = EPROTO;
+	    goto FAIL;
+	}
+	outputCommit(&out, len);
+	total += len;
+    }
+
+    return (outputClose(&out) < 0) ? -1 : total;
+
+    FAIL:
+    // what was verified before the failure still goes to the file, a resumed transfer keeps it
+    savedErrno = errno;
+    outputClose(&out);
+    errno = savedErrno;
+    return -1;
+}
@@ -0,0 +1,148 @@
+/*
+ * header file for the framed data stream that follows a transfer header
+ */
+
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+
+#include "proto.h"
+#include "compress.h"
+
+#define NCP_CHUNK_HDR_LEN 8			// type, flags, reserved, payload length
+#define NCP_MAX_CHUNK 65536			// largest payload a chunk frame may carry
+#define NCP_MAC_DIGEST "SHA256"			// digest used for HMAC
+#define NCP_MAC_LEN 32				// bytes of MAC after an authenticated chunk
+#define NCP_GCM_TAG_LEN 16			// bytes of AES-GCM tag after an encrypted chunk
+#define NCP_SALT_LEN 16				// random salt an encrypted stream's key is derived from
+
+#define NCP_CHUNK_DATA 1			// payload bytes for the output file
+#define NCP_CHUNK_END 2				// trailer: 8-byte total length, MAC covers the whole stream
+#define NCP_CHUNK_FILE 3			// batch transfers: 8-byte size and name of the file whose data follows
+#define NCP_CHUNK_SIG 4				// delta transfers: 4-byte block size and block signatures of the server's copy
+#define NCP_CHUNK_COPY 5			// delta transfers: 8-byte first block and 8-byte count of the server's copy to reuse
+#define NCP_CHUNK_ZDATA 6			// compressed data: 4-byte original length, then a zlib stream (see compress.c)
+#define NCP_CHUNK_SALT 7			// first chunk of an encrypted stream: NCP_SALT_LEN bytes, sent in the clear
+#define NCP_CHUNK_HOLE 8			// sparse transfers: 8-byte length of a hole the receiver leaves unwritten
+#define NCP_CHUNK_REFS 9			// dedup transfers: 4-byte length and SHA-256 of each content-defined chunk
+#define NCP_CHUNK_NEED 10			// dedup transfers: one bit per chunk reference, set for the chunks to send
+
+/**
+ * State of one framed stream, either direction
+ **/
+typedef struct frame_ctx {
+    int fd;					// socket the frames travel on
+    uint32_t flags;				// NCP_F_* bits of the transfer
+    uint64_t seq;				// sequence number of the next chunk
+    uint64_t bytes;				// payload bytes framed so far, holes included
+    uint64_t holes;				// NCP_F_SPARSE: bytes of them that were holes
+    EVP_MAC_CTX *chunkMac;			// keyed HMAC, re-initialized for every chunk
+    EVP_MAC_CTX *streamMac;			// running HMAC over header and every payload, closed by the trailer
+    compress_state_t *zc;			// NCP_F_COMPRESS: compressor of a sending stream, set up on first use
+    z_stream *zin;				// NCP_F_COMPRESS: decompressor of a receiving stream, set up on first use
+    unsigned char *zbuf;			// compressed payload of the current chunk
+    uint64_t zIn, zOut;				// data bytes sent compressed, and their size on the wire
+    EVP_CIPHER_CTX *gcm;			// NCP_F_GCM: AES-128-GCM under the stream's key, once its salt is known
+    unsigned char *cbuf;			// NCP_F_GCM: copy of a caller's payload, encrypted in place
+    unsigned char hdrWire[NCP_HDR_LEN];		// NCP_F_GCM: the transfer header, bound into the stream's key
+} frame_ctx_t;
+
+/**
+ * Prepare 'ctx' for the stream on 'fd' that follows header 'hdr' (already sent or received).
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int frameInit(frame_ctx_t *ctx, int fd, const ncp_hdr_t *hdr);
+
+/**
+ * Release the resources held by 'ctx'.
+ **/
+void frameFree(frame_ctx_t *ctx);
+
+/**
+ * Start the sending side of 'ctx': an encrypted stream sends its salt chunk. frameSend() does
+ * this by itself; callers of frameSeal() have to do it first.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int frameStart(frame_ctx_t *ctx);
+
+/**
+ * Return:
+ * 	bytes of MAC or tag that follow each chunk's payload on 'ctx' (0 for plain frames)
+ **/
+size_t frameTagLen(const frame_ctx_t *ctx);
+
+/**
+ * Build the frame header 'chdr' (NCP_CHUNK_HDR_LEN bytes) and, with NCP_F_HMAC or NCP_F_GCM,
+ * the MAC or tag 'mac' (frameTagLen() bytes, room for NCP_MAC_LEN) of one chunk, and advance
+ * the stream state as if it had been sent. With NCP_F_GCM 'data' is encrypted in place. The
+ * caller then writes header, payload and MAC in this order. Chunks must be sealed in the order
+ * they go out.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int frameSeal(frame_ctx_t *ctx, uint8_t type, void *data, uint32_t len, unsigned char *chdr, unsigned char *mac);
+
+/**
+ * Send one chunk frame of type 'type' carrying 'len' bytes of 'data'. With NCP_F_COMPRESS a data
+ * chunk goes out as NCP_CHUNK_ZDATA when it compresses well enough.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int frameSend(frame_ctx_t *ctx, uint8_t type, const void *data, uint32_t len);
+
+/**
+ * Send the trailer that closes the stream.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int frameFinish(frame_ctx_t *ctx);
+
+/**
+ * Receive and verify one chunk frame into 'buf' (NCP_MAX_CHUNK bytes). Nothing is returned
+ * to the caller before its MAC has been checked. A compressed chunk is returned decompressed,
+ * as NCP_CHUNK_DATA; a hole as NCP_CHUNK_HOLE with its 8-byte length in 'buf'.
+ *
+ * Return:
+ * 	0 on success with '*type' and '*len' set, -1 on error; errno is EBADMSG when a chunk or
+ * 	the trailer fails verification
+ **/
+int frameRecv(frame_ctx_t *ctx, uint8_t *type, void *buf, uint32_t *len);
+
+/**
+ * Send 'count' bytes of file 'filefd' starting at 'offset' as data chunks, without a trailer.
+ * With NCP_F_SPARSE the holes of the range go out as NCP_CHUNK_HOLE and count as sent.
+ *
+ * Return:
+ * 	number of payload bytes sent (less than 'count' if the file is shorter), or -1 on error
+ **/
+off_t frameSendData(frame_ctx_t *ctx, int filefd, off_t offset, off_t count);
+
+/**
+ * Send 'count' bytes of file 'filefd' starting at 'offset' as data chunks, then the trailer.
+ *
+ * Return:
+ * 	number of payload bytes sent, or -1 on error
+ **/
+off_t frameSendFile(frame_ctx_t *ctx, int filefd, off_t offset, off_t count);
+
+/**
+ * Receive data chunks up to the trailer and write them to 'outfd' starting at 'offset'; holes
+ * are left unwritten (or punched, if the file had data there). At most 'count' bytes are
+ * accepted.
+ *
+ * Return:
+ * 	number of payload bytes written, or -1 on error
+ **/
+off_t frameReceiveFile(frame_ctx_t *ctx, int outfd, off_t offset, off_t count);
+
+#endif
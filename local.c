@@ -0,0 +1,494 @@
+/*
+ * Same-host transports, for a sender and a receiver that share a machine (a sidecar and the
+ * service next to it), where the TCP loopback path is pure overhead: headers, checksums, ACKs
+ * and congestion control for bytes that never leave the host.
+ *
+ * "unix:PATH" swaps the TCP socket for a Unix domain stream socket at PATH. Everything above
+ * the socket stays as it is, so framing, stripes, resume, delta, -k and the rest work the same;
+ * sendfile() and splice() still move the file data without it entering user space.
+ *
+ * "shm:NAME" does without sockets. The server maps a ring of LOCAL_RING_SIZE bytes under
+ * /dev/shm and a client maps the same pages: the client pread()s its file straight into the
+ * ring and the server write()s it from there into the output file, so each byte is copied
+ * once into the ring and once out of it, and no socket buffer sits in between. The ring is a
+ * single-producer/single-consumer queue of two byte counters, head and tail, each written by
+ * one side only and kept on a cache line of its own. A side that finds the ring empty or full
+ * spins for a moment and then sleeps in futex() on the other side's counter, as the stages of
+ * pipeline.c do, except that these futexes are shared between processes. A sleep lasts at
+ * most LOCAL_NAP_NS, after which the sleeper makes sure its peer is still alive.
+ *
+ * The ring carries a plain byte stream, like an unframed TCP transfer, for one client at a
+ * time: a client claims it by storing its pid in 'owner', and the server hands it back once
+ * the client's last byte is in the output file.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. man 7 unix
+ * 	       2. man 7 shm_overview, man 3 shm_open
+ * 	       3. man 2 futex
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>			// for INT_MAX, NAME_MAX
+#include <signal.h>			// for kill()
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>			// for fstat(), lstat()
+#include <sys/mman.h>			// for shm_open(), mmap()
+#include <sys/socket.h>
+#include <sys/un.h>			// for sockaddr_un
+#include <netinet/in.h>
+#include <sys/syscall.h>		// for SYS_futex
+#include <linux/futex.h>
+
+#include "nc_args_t.h"
+#include "local.h"
+#include "transfer.h"			// writeFileAll()
+#include "stats.h"			// telemetry for -v
+#include "tune.h"			// -w socket buffers
+#include "output.h"			// -O
+#include "event_loop.h"			// connFilename() for -k
+
+#define LOCAL_MAGIC 0x4e435052			// "NCPR": the server has set the ring up
+#define LOCAL_RING_HDR 4096			// header page, the data follows page-aligned
+#define LOCAL_FREE 0				// 'owner' when no client holds the ring
+#define LOCAL_CLOSED 0xffffffffu		// 'owner' once the server has stopped taking clients
+
+/**
+ * One side of the ring: the bytes it has handed over to the other
+ **/
+typedef struct ring_side {
+    uint64_t pos;				// written by its own side only
+    uint32_t seq;				// futex word, bumped on every hand-over
+    uint32_t sleeping;				// set while the other side sleeps on 'seq'
+} __attribute__((aligned(64))) ring_side_t;
+
+/**
+ * Header page of the shared-memory ring
+ **/
+typedef struct local_ring {
+    uint32_t magic;				// LOCAL_MAGIC once the fields below are valid
+    uint32_t server;				// pid of the server
+    uint64_t size;				// data bytes after the header page, a power of two
+    uint32_t owner;				// futex word: pid of the client holding the ring, LOCAL_FREE or LOCAL_CLOSED
+    uint32_t ended;				// the client has handed over its last byte
+    uint32_t failed;				// the server gave up on the client's data
+    ring_side_t head;				// bytes the client has put into the ring
+    ring_side_t tail;				// bytes the server has written out of it
+} local_ring_t;
+
+int localParse(const char *address, nc_args_t *nc_args) {
+
+    struct sockaddr_un addr;
+    const char *name;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+	name = address + 5;
+	if (*name == '\0' || strlen(name) >= sizeof(addr.sun_path))
+	    return -1;
+	nc_args->local = LOCAL_UNIX;
+    } else if (strncmp(address, "shm:", 4) == 0) {
+	name = address + 4;
+	// becomes the shm_open() name "/netcat_part.NAME"
+	if (*name == '\0' || strchr(name, '/') != NULL || strlen(name) > NAME_MAX - 16)
+	    return -1;
+	nc_args->local = LOCAL_SHM;
+    } else {
+	return 0;
+    }
+    if ( (nc_args->localName = strdup(name)) == NULL )
+	return -1;
+    return 1;
+}
+
+/**
+ * Fill in the Unix socket address of the server.
+ *
+ * Return:
+ * 	void, but 'addr' will have the result
+ **/
+static void unixAddr(nc_args_t *nc_args, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, nc_args->localName, sizeof(addr->sun_path) - 1);
+}
+
+int localConnect(nc_args_t *nc_args) {
+
+    struct sockaddr_un addr;
+    int sockfd;
+
+    if ( (sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 )
+	return -1;
+    tuneSocketBuffers(sockfd);
+    unixAddr(nc_args, &addr);
+    if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+	close(sockfd);
+	return -1;
+    }
+    return sockfd;
+}
+
+int localListen(nc_args_t *nc_args, int backlog) {
+
+    struct sockaddr_un addr;
+    struct stat pathStat;
+    int sockfd;
+
+    if ( (sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 )
+	return -1;
+    tuneSocketBuffers(sockfd);
+    unixAddr(nc_args, &addr);
+
+    // a server that was killed leaves its socket file behind, and bind() will not reuse it
+    if (lstat(addr.sun_path, &pathStat) == 0 && S_ISSOCK(pathStat.st_mode))
+	unlink(addr.sun_path);
+    if (bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sockfd, backlog) < 0) {
+	close(sockfd);
+	return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * Wake whoever sleeps on the shared futex word 'word'.
+ **/
+static void wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Hand 'n' more bytes over from side 's', waking the other side if it sleeps on it.
+ **/
+static void advance(ring_side_t *s, uint64_t n) {
+    __atomic_store_n(&s->pos, s->pos + n, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&s->sleeping, 0, __ATOMIC_SEQ_CST))
+	wake(&s->seq);
+}
+
+/**
+ * Return:
+ * 	non-zero once the ring's client has ended, if 'ended' asks for it
+ **/
+static int hasEnded(local_ring_t *ring, int ended) {
+    return ended && __atomic_load_n(&ring->ended, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Wait until side 's', moved by process 'peer', has handed over more than 'pos' bytes. With
+ * 'ended' the end of the client's data also counts.
+ *
+ * Return:
+ * 	0 once it has, -1 if 'peer' died meanwhile (EPIPE)
+ **/
+static int waitPast(local_ring_t *ring, ring_side_t *s, uint64_t pos, pid_t peer, int ended) {
+
+    struct timespec nap = { LOCAL_NAP_NS / 1000000000, LOCAL_NAP_NS % 1000000000 };
+    uint32_t seq;
+    int spins = 0;
+
+    while (__atomic_load_n(&s->pos, __ATOMIC_ACQUIRE) <= pos && !hasEnded(ring, ended)) {
+	if (++spins < LOCAL_SPINS)
+	    continue;
+	// announce the sleep before checking once more, so a hand-over in between is not missed
+	seq = __atomic_load_n(&s->seq, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->pos, __ATOMIC_SEQ_CST) > pos || hasEnded(ring, ended))
+	    break;
+	if (syscall(SYS_futex, &s->seq, FUTEX_WAIT, seq, &nap, NULL, 0) < 0 && errno == ETIMEDOUT
+	    && kill(peer, 0) < 0 && errno == ESRCH) {
+	    errno = EPIPE;
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/**
+ * Build the shm_open() name of ring 'name'.
+ *
+ * Return:
+ * 	void, but 'shmName' will have the result
+ **/
+static void ringName(char *shmName, size_t len, const char *name) {
+    snprintf(shmName, len, "/netcat_part.%s", name);
+}
+
+off_t localSend(nc_args_t *nc_args) {
+
+    char shmName[NAME_MAX + 1];
+    local_ring_t *ring = MAP_FAILED;
+    unsigned char *data;
+    struct stat ringStat, fileStat;
+    struct timespec nap = { LOCAL_NAP_NS / 1000000000, LOCAL_NAP_NS % 1000000000 };
+    uint32_t me = getpid(), owner;
+    uint64_t head, room, at;
+    off_t offset = nc_args->offset, count, total = 0;
+    size_t want;
+    ssize_t n;
+    uint64_t start;
+    int fd, filefd = -1, savedErrno;
+
+    // find the server's ring
+    ringName(shmName, sizeof(shmName), nc_args->localName);
+    if ( (fd = shm_open(shmName, O_RDWR | O_CLOEXEC, 0)) < 0 ) {
+	if (errno == ENOENT)
+	    errno = ECONNREFUSED;
+	return -1;
+    }
+    if (fstat(fd, &ringStat) < 0 || ringStat.st_size < LOCAL_RING_HDR
+	|| (ring = mmap(NULL, ringStat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	close(fd);
+	return -1;
+    }
+    close(fd);
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != LOCAL_MAGIC
+	|| ringStat.st_size < (off_t) (LOCAL_RING_HDR + ring->size)) {
+	errno = ECONNREFUSED;
+	goto FAIL;
+    }
+    data = (unsigned char *) ring + LOCAL_RING_HDR;
+
+    // claim it, waiting for the client before us if there is one
+    while (1) {
+	owner = LOCAL_FREE;
+	if (__atomic_compare_exchange_n(&ring->owner, &owner, me, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	    break;
+	if (owner == LOCAL_CLOSED || (kill(ring->server, 0) < 0 && errno == ESRCH)) {
+	    errno = ECONNREFUSED;
+	    goto FAIL;
+	}
+	syscall(SYS_futex, &ring->owner, FUTEX_WAIT, owner, &nap, NULL, 0);
+    }
+    wake(&ring->owner);
+
+    if (nc_args->message_mode) {
+	count = strlen(nc_args->message);
+	offset = 0;
+    } else {
+	if ( (filefd = open(nc_args->clientFilename, O_RDONLY | O_CLOEXEC)) < 0 || fstat(filefd, &fileStat) < 0 )
+	    goto FAIL;
+	if (offset > fileStat.st_size) {
+	    errno = EINVAL;
+	    goto FAIL;
+	}
+	count = fileStat.st_size - offset;
+    }
+    if (nc_args->n_bytes > 0 && nc_args->n_bytes < count)
+	count = nc_args->n_bytes;
+
+    // fill the ring a slice at a time, each slice straight from the file into the shared pages
+    head = 0;
+    while (total < count) {
+	if (head - __atomic_load_n(&ring->tail.pos, __ATOMIC_ACQUIRE) >= ring->size
+	    && waitPast(ring, &ring->tail, head - ring->size, ring->server, 0) < 0)
+	    goto FAIL;
+	room = ring->size - (head - __atomic_load_n(&ring->tail.pos, __ATOMIC_ACQUIRE));
+	at = head & (ring->size - 1);
+	want = LOCAL_SLICE;
+	if (want > room)
+	    want = room;
+	if (want > ring->size - at)			// the slice stops at the end of the ring
+	    want = ring->size - at;
+	if ((off_t) want > count - total)
+	    want = count - total;
+
+	if (filefd < 0) {
+	    memcpy(data + at, nc_args->message + total, want);
+	    n = want;
+	} else {
+	    start = statsStart();
+	    n = pread(filefd, data + at, want, offset + total);
+	    statsIo(STATS_DISK, start, want, n);
+	    if (n < 0) {
+		if (errno == EINTR)
+		    continue;
+		goto FAIL;
+	    }
+	    if (n == 0)				// file shrank underneath us
+		break;
+	}
+	advance(&ring->head, n);
+	head += n;
+	total += n;
+    }
+    __atomic_store_n(&ring->ended, 1, __ATOMIC_SEQ_CST);
+    advance(&ring->head, 0);
+
+    // the server hands the ring back once everything is in the output file
+    while (__atomic_load_n(&ring->owner, __ATOMIC_ACQUIRE) == me) {
+	if (syscall(SYS_futex, &ring->owner, FUTEX_WAIT, me, &nap, NULL, 0) < 0 && errno == ETIMEDOUT
+	    && kill(ring->server, 0) < 0 && errno == ESRCH)
+	    break;
+    }
+    if (__atomic_load_n(&ring->owner, __ATOMIC_ACQUIRE) == me || __atomic_load_n(&ring->failed, __ATOMIC_ACQUIRE)) {
+	errno = EPIPE;
+	goto FAIL;
+    }
+
+    if (filefd >= 0)
+	close(filefd);
+    munmap(ring, ringStat.st_size);
+    return total;
+
+    FAIL:
+    savedErrno = errno;
+    if (filefd >= 0)
+	close(filefd);
+    munmap(ring, ringStat.st_size);
+    errno = savedErrno;
+    return -1;
+}
+
+/**
+ * Write everything the client holding 'ring' hands over into 'outfd', until it ends.
+ *
+ * Return:
+ * 	number of bytes written, or -1 on error (EPIPE if the client died first)
+ **/
+static off_t drain(local_ring_t *ring, int outfd, pid_t client) {
+
+    unsigned char *data = (unsigned char *) ring + LOCAL_RING_HDR;
+    uint64_t head, tail = 0, at, n;
+    output_t out;
+    void *buf;
+
+    if (outputDirect() && outputOpen(&out, outfd, 0) < 0)
+	return -1;
+
+    while (1) {
+	head = __atomic_load_n(&ring->head.pos, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+	    // 'ended' is set after the last hand-over, so a second look at head is final
+	    if (__atomic_load_n(&ring->ended, __ATOMIC_SEQ_CST)
+		&& __atomic_load_n(&ring->head.pos, __ATOMIC_SEQ_CST) == tail)
+		break;
+	    if (waitPast(ring, &ring->head, tail, client, 1) < 0)
+		goto FAIL;
+	    continue;
+	}
+
+	at = tail & (ring->size - 1);
+	n = head - tail;
+	if (n > LOCAL_SLICE)
+	    n = LOCAL_SLICE;
+	if (n > ring->size - at)
+	    n = ring->size - at;
+
+	if (outputDirect()) {
+	    // O_DIRECT wants its own aligned staging, the ring's pages go back to the client first
+	    if ( (buf = outputBuffer(&out, n)) == NULL )
+		goto FAIL;
+	    memcpy(buf, data + at, n);
+	    outputCommit(&out, n);
+	} else if (writeFileAll(outfd, data + at, n) < 0) {
+	    goto FAIL;
+	}
+	advance(&ring->tail, n);
+	tail += n;
+    }
+
+    if (outputDirect() && outputClose(&out) < 0)
+	return -1;
+    return tail;
+
+    FAIL:
+    if (outputDirect()) {
+	int savedErrno = errno;
+	outputClose(&out);
+	errno = savedErrno;
+    }
+    return -1;
+}
+
+off_t localServe(nc_args_t *nc_args) {
+
+    char shmName[NAME_MAX + 1];
+    char name[4096];
+    local_ring_t *ring;
+    size_t length = LOCAL_RING_HDR + LOCAL_RING_SIZE;
+    uint32_t owner;
+    unsigned int id;
+    off_t bytes, total = 0;
+    int fd, outfd, savedErrno;
+
+    // a server that was killed leaves its ring behind; its clients are gone with it
+    ringName(shmName, sizeof(shmName), nc_args->localName);
+    shm_unlink(shmName);
+    if ( (fd = shm_open(shmName, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0 )
+	return -1;
+    if (ftruncate(fd, length) < 0
+	|| (ring = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	savedErrno = errno;
+	close(fd);
+	shm_unlink(shmName);
+	errno = savedErrno;
+	return -1;
+    }
+    close(fd);
+
+    // the new object is all zeroes: owner is LOCAL_FREE and both counters are at 0
+    ring->size = LOCAL_RING_SIZE;
+    ring->server = getpid();
+    __atomic_store_n(&ring->magic, LOCAL_MAGIC, __ATOMIC_RELEASE);
+
+    for (id = 0; ; id++) {
+	while ( (owner = __atomic_load_n(&ring->owner, __ATOMIC_ACQUIRE)) == LOCAL_FREE )
+	    syscall(SYS_futex, &ring->owner, FUTEX_WAIT, LOCAL_FREE, NULL, NULL, 0);
+
+	if (nc_args->persistent)
+	    connFilename(name, sizeof(name), nc_args->serverFilename, id);
+	else
+	    snprintf(name, sizeof(name), "%s", nc_args->serverFilename);
+	if ( (outfd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 )
+	    goto FAIL;
+	bytes = drain(ring, outfd, owner);
+	savedErrno = errno;
+	close(outfd);
+	if (bytes < 0 && !(nc_args->persistent && savedErrno == EPIPE)) {
+	    errno = savedErrno;
+	    goto FAIL;
+	}
+
+	if (nc_args->persistent) {
+	    if (bytes < 0)
+		fprintf(stderr, "Server says: client of '%s' died before it was done\n", name);
+	    else
+		printf("Server says: %lld bytes written to file '%s'\n", (long long) bytes, name);
+	    fflush(stdout);
+	} else {
+	    total = bytes;
+	}
+
+	// hand the ring to the next client, or tell the waiting ones there is none
+	ring->head.pos = ring->tail.pos = 0;
+	ring->ended = 0;
+	__atomic_store_n(&ring->owner, nc_args->persistent ? LOCAL_FREE : LOCAL_CLOSED, __ATOMIC_SEQ_CST);
+	wake(&ring->owner);
+	if (!nc_args->persistent)
+	    break;
+    }
+
+    munmap(ring, length);
+    shm_unlink(shmName);
+    return total;
+
+    FAIL:
+    savedErrno = errno;
+    __atomic_store_n(&ring->failed, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ring->owner, LOCAL_CLOSED, __ATOMIC_SEQ_CST);
+    wake(&ring->owner);
+    munmap(ring, length);
+    shm_unlink(shmName);
+    errno = savedErrno;
+    return -1;
+}
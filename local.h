@@ -0,0 +1,64 @@
+/*
+ * header file for the same-host transports: Unix domain sockets and a shared-memory ring
+ */
+
+#ifndef LOCAL_H_
+#define LOCAL_H_
+
+#include <sys/types.h>
+
+#include "nc_args_t.h"
+
+#define LOCAL_NONE 0				// TCP to an IP address or host name
+#define LOCAL_UNIX 1				// "unix:PATH": Unix domain stream socket at PATH
+#define LOCAL_SHM 2				// "shm:NAME": shared-memory ring /dev/shm/netcat_part.NAME
+
+#define LOCAL_RING_SIZE (16 * 1024 * 1024)	// data bytes of the ring, a power of two
+#define LOCAL_SLICE (1024 * 1024)		// most bytes handed over at once, so the reader starts early
+#define LOCAL_SPINS 256				// polls of an empty or full ring before sleeping on it
+#define LOCAL_NAP_NS 100000000			// upper bound of one sleep, so a peer that died is noticed
+
+/**
+ * Recognize a same-host address, "unix:PATH" or "shm:NAME", and store it in 'nc_args'.
+ *
+ * Return:
+ * 	1 if 'address' is one, 0 if it is an IP address or host name, -1 if it is malformed
+ **/
+int localParse(const char *address, nc_args_t *nc_args);
+
+/**
+ * Connect a Unix domain stream socket to the server's path.
+ *
+ * Return:
+ * 	connected socket descriptor, or -1 on error
+ **/
+int localConnect(nc_args_t *nc_args);
+
+/**
+ * Bind a Unix domain stream socket to the server's path, replacing a socket file left behind
+ * by an earlier server, and listen on it.
+ *
+ * Return:
+ * 	listening socket descriptor, or -1 on error
+ **/
+int localListen(nc_args_t *nc_args, int backlog);
+
+/**
+ * Send the message or the file range given by 'nc_args' through the server's shared-memory
+ * ring, waiting for the ring if another client holds it.
+ *
+ * Return:
+ * 	number of bytes sent, or -1 on error (ECONNREFUSED if no server has set up the ring)
+ **/
+off_t localSend(nc_args_t *nc_args);
+
+/**
+ * Set up the shared-memory ring and drain the clients that attach to it into the output
+ * file, one at a time; with -k forever, one output file each (see connFilename()).
+ *
+ * Return:
+ * 	number of bytes written, or -1 on error
+ **/
+off_t localServe(nc_args_t *nc_args);
+
+#endif
@@ -0,0 +1,332 @@
+/*
+ * Merkle-tree integrity digests (-M): the whole output is checked against the client's file
+ * with hashing spread over every core on both ends.
+ *
+ * The range is cut into MERKLE_LEAF-byte leaves. Each leaf is hashed on its own (SHA-256 of a
+ * 0x00 byte and the leaf), so a pool of threads can pick leaves off a shared counter and hash
+ * them in parallel; inner nodes are SHA-256 of a 0x01 byte and their two children, an odd node
+ * at the end of a level moves up unchanged. Only the root is authenticated: its HMAC with the
+ * shared key (over the root, the range length and the leaf size) closes the digest.
+ *
+ * The client starts hashing when the transfer starts, so its hashes are ready about when the
+ * payload is out, and then sends
+ *
+ * 	leaf size (4) | reserved (4) | number of leaves (8) | leaf hashes | root HMAC (32)
+ *
+ * The server rebuilds the root from those leaves and checks the HMAC, which authenticates every
+ * leaf hash at once. It then hashes what it wrote, compares leaf by leaf and answers with the
+ * number of differing byte ranges (8), followed by each range's offset and length (8 + 8),
+ * neighbouring leaves merged. MERKLE_REJECTED instead of a count means the digest itself did
+ * not verify.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. R. Merkle, "A Digital Signature Based on a Conventional Encryption Function", 1987
+ * 	       2. RFC 6962, section 2.1 (leaf and node prefixes)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <openssl/evp.h>
+#include <openssl/crypto.h>		// for CRYPTO_memcmp()
+
+#include "merkle.h"
+#include "proto.h"			// put32(), put64(), get32(), get64()
+#include "transfer.h"
+#include "shared_key.h"			// key for the root's HMAC
+#include "stats.h"			// telemetry for -v
+
+#define MERKLE_HDR_LEN 16			// digest header: leaf size, reserved, number of leaves
+#define MERKLE_REJECTED UINT64_MAX		// server's answer to a digest whose root did not verify
+
+/**
+ * Hash leaves of 'job' until none are left.
+ **/
+static void *leafWorker(void *arg) {
+
+    merkle_job_t *job = (merkle_job_t *) arg;
+    static const unsigned char leafPrefix = 0x00;
+    unsigned char *buf;
+    EVP_MD_CTX *md;
+    uint64_t i, start;
+    off_t at;
+    size_t len, got;
+    ssize_t n;
+
+    buf = malloc(MERKLE_LEAF);
+    md = EVP_MD_CTX_new();
+    if (buf == NULL || md == NULL)
+	goto FAIL;
+
+    while ( (i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nLeaves ) {
+	if (__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+	    break;
+	at = (off_t) i * MERKLE_LEAF;
+	len = (job->count - at < MERKLE_LEAF) ? (size_t) (job->count - at) : MERKLE_LEAF;
+	for (got = 0; got < len; got += n) {
+	    start = statsStart();
+	    n = pread(job->fd, buf + got, len - got, job->offset + at + got);
+	    statsIo(STATS_DISK, start, len - got, n);
+	    if (n < 0 && errno == EINTR)
+		n = 0;
+	    else if (n <= 0)			// error, or the file is shorter than the range
+		goto FAIL;
+	}
+	if (!EVP_DigestInit_ex(md, EVP_sha256(), NULL) || !EVP_DigestUpdate(md, &leafPrefix, 1)
+	    || !EVP_DigestUpdate(md, buf, len) || !EVP_DigestFinal_ex(md, job->leaves + i * MERKLE_HASH_LEN, NULL))
+	    goto FAIL;
+    }
+
+    free(buf);
+    EVP_MD_CTX_free(md);
+    return NULL;
+
+    FAIL:
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    free(buf);
+    EVP_MD_CTX_free(md);
+    return NULL;
+}
+
+int merkleBegin(merkle_job_t *job, int fd, off_t offset, off_t count) {
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    memset(job, 0, sizeof(merkle_job_t));
+    job->fd = fd;
+    job->offset = offset;
+    job->count = count;
+    job->nLeaves = (count + MERKLE_LEAF - 1) / MERKLE_LEAF;
+    if ( (job->leaves = malloc(job->nLeaves * MERKLE_HASH_LEN + 1)) == NULL )
+	return -1;
+
+    if (cores < 1)
+	cores = 1;
+    if (cores > MERKLE_MAX_THREADS)
+	cores = MERKLE_MAX_THREADS;
+    if ((uint64_t) cores > job->nLeaves)
+	cores = job->nLeaves;
+
+    for (job->nThreads = 0; job->nThreads < cores; job->nThreads++)
+	if (pthread_create(&job->threads[job->nThreads], NULL, leafWorker, job) != 0)
+	    break;
+    if (job->nThreads == 0 && job->nLeaves > 0)
+	leafWorker(job);			// no threads to be had, hash right here
+    return 0;
+}
+
+int merkleEnd(merkle_job_t *job) {
+
+    int i;
+
+    for (i = 0; i < job->nThreads; i++)
+	pthread_join(job->threads[i], NULL);
+    job->nThreads = 0;
+    if (job->failed) {
+	errno = EIO;
+	return -1;
+    }
+    return 0;
+}
+
+void merkleFree(merkle_job_t *job) {
+    free(job->leaves);
+    job->leaves = NULL;
+}
+
+/**
+ * Fold 'nLeaves' leaf hashes into the tree's root; no leaves give the hash of the empty string.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int merkleRoot(const unsigned char *leaves, uint64_t nLeaves, unsigned char *root) {
+
+    static const unsigned char nodePrefix = 0x01;
+    unsigned char *level;
+    EVP_MD_CTX *md;
+    uint64_t i, n = nLeaves;
+    int status = 0;
+
+    if (n == 0)
+	return EVP_Digest("", 0, root, NULL, EVP_sha256(), NULL) ? 0 : -1;
+    if ( (level = malloc(n * MERKLE_HASH_LEN)) == NULL )
+	return -1;
+    if ( (md = EVP_MD_CTX_new()) == NULL ) {
+	free(level);
+	return -1;
+    }
+    memcpy(level, leaves, n * MERKLE_HASH_LEN);
+
+    // each level is written over the one below it, pairs first, an odd last node moved up as it is
+    while (n > 1 && status == 0) {
+	for (i = 0; i + 1 < n; i += 2)
+	    if (!EVP_DigestInit_ex(md, EVP_sha256(), NULL) || !EVP_DigestUpdate(md, &nodePrefix, 1)
+		|| !EVP_DigestUpdate(md, level + i * MERKLE_HASH_LEN, 2 * MERKLE_HASH_LEN)
+		|| !EVP_DigestFinal_ex(md, level + (i / 2) * MERKLE_HASH_LEN, NULL)) {
+		status = -1;
+		break;
+	    }
+	if (n % 2 == 1)
+	    memmove(level + (n / 2) * MERKLE_HASH_LEN, level + (n - 1) * MERKLE_HASH_LEN, MERKLE_HASH_LEN);
+	n = (n + 1) / 2;
+    }
+    memcpy(root, level, MERKLE_HASH_LEN);
+
+    EVP_MD_CTX_free(md);
+    free(level);
+    return status;
+}
+
+/**
+ * HMAC of the root of 'nLeaves' leaf hashes over a range of 'count' bytes.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int rootMac(const unsigned char *leaves, uint64_t nLeaves, off_t count, unsigned char *mac) {
+
+    unsigned char msg[MERKLE_HASH_LEN + 12];	// root, range length, leaf size
+    size_t macLen;
+
+    if (merkleRoot(leaves, nLeaves, msg) < 0)
+	return -1;
+    put64(msg + MERKLE_HASH_LEN, count);
+    put32(msg + MERKLE_HASH_LEN + 8, MERKLE_LEAF);
+    if (EVP_Q_mac(NULL, "HMAC", NULL, "SHA256", NULL, key, sizeof(key), msg, sizeof(msg), mac, MERKLE_HASH_LEN, &macLen) == NULL)
+	return -1;
+    return 0;
+}
+
+/**
+ * Print one differing byte range, or only count it once MERKLE_MAX_REPORT have been printed.
+ **/
+static void reportRange(const char *who, unsigned long index, off_t from, off_t len) {
+    if (index < MERKLE_MAX_REPORT)
+	printf("%s says: bytes %lld-%lld differ\n", who, (long long) from, (long long) (from + len - 1));
+    else if (index == MERKLE_MAX_REPORT)
+	printf("%s says: ... more differing ranges not shown\n", who);
+}
+
+int merkleVerifySend(int sockfd, merkle_job_t *job) {
+
+    unsigned char hdr[MERKLE_HDR_LEN], mac[MERKLE_HASH_LEN], range[16];
+    uint64_t nRanges, i;
+
+    if (merkleEnd(job) < 0 || rootMac(job->leaves, job->nLeaves, job->count, mac) < 0)
+	return -1;
+
+    put32(hdr, MERKLE_LEAF);
+    put32(hdr + 4, 0);
+    put64(hdr + 8, job->nLeaves);
+    if (writeAll(sockfd, hdr, sizeof(hdr)) < 0 || writeAll(sockfd, job->leaves, job->nLeaves * MERKLE_HASH_LEN) < 0
+	|| writeAll(sockfd, mac, sizeof(mac)) < 0)
+	return -1;
+
+    if (readAll(sockfd, range, 8) != 8)
+	goto TRUNCATED;
+    if ( (nRanges = get64(range)) == MERKLE_REJECTED ) {
+	fprintf(stderr, "Client says: server rejected the Merkle digest\n");
+	errno = EBADMSG;
+	return -1;
+    }
+    if (nRanges == 0) {
+	printf("Client says: Merkle digest verified, %llu leaves\n", (unsigned long long) job->nLeaves);
+	return 0;
+    }
+
+    printf("Client says: server's copy differs in %llu ranges\n", (unsigned long long) nRanges);
+    for (i = 0; i < nRanges; i++) {
+	if (readAll(sockfd, range, sizeof(range)) != sizeof(range))
+	    goto TRUNCATED;
+	reportRange("Client", i, job->offset + get64(range), get64(range + 8));	// in terms of the input file
+    }
+    errno = EBADMSG;
+    return -1;
+
+    TRUNCATED:
+    errno = EPROTO;
+    return -1;
+}
+
+int merkleVerifyReceive(int sockfd, int outfd, off_t count) {
+
+    unsigned char hdr[MERKLE_HDR_LEN], mac[MERKLE_HASH_LEN], expected[MERKLE_HASH_LEN], word[16];
+    unsigned char *theirs = NULL;
+    merkle_job_t job;
+    uint64_t nLeaves, i, first, nRanges = 0;
+    int status = -1, haveJob = 0;
+
+    if (readAll(sockfd, hdr, sizeof(hdr)) != sizeof(hdr))
+	goto TRUNCATED;
+    nLeaves = get64(hdr + 8);
+    if (get32(hdr) != MERKLE_LEAF || nLeaves != (uint64_t) (count + MERKLE_LEAF - 1) / MERKLE_LEAF)
+	goto REJECT;
+    if ( (theirs = malloc(nLeaves * MERKLE_HASH_LEN + 1)) == NULL )
+	goto DONE;
+    if (readAll(sockfd, theirs, nLeaves * MERKLE_HASH_LEN) != (ssize_t) (nLeaves * MERKLE_HASH_LEN)
+	|| readAll(sockfd, mac, sizeof(mac)) != sizeof(mac))
+	goto TRUNCATED;
+
+    // one HMAC check on the root authenticates every leaf hash below it
+    if (rootMac(theirs, nLeaves, count, expected) < 0)
+	goto DONE;
+    if (CRYPTO_memcmp(mac, expected, MERKLE_HASH_LEN) != 0)
+	goto REJECT;
+
+    if (merkleBegin(&job, outfd, 0, count) < 0)
+	goto DONE;
+    haveJob = 1;
+    if (merkleEnd(&job) < 0)
+	goto DONE;
+
+    for (i = 0; i < nLeaves; i++)
+	if (memcmp(job.leaves + i * MERKLE_HASH_LEN, theirs + i * MERKLE_HASH_LEN, MERKLE_HASH_LEN) != 0)
+	    if (i == 0 || memcmp(job.leaves + (i - 1) * MERKLE_HASH_LEN, theirs + (i - 1) * MERKLE_HASH_LEN, MERKLE_HASH_LEN) == 0)
+		nRanges++;			// first leaf of a run of differing ones
+    put64(word, nRanges);
+    if (writeAll(sockfd, word, 8) < 0)
+	goto DONE;
+    if (nRanges == 0) {
+	printf("Server says: Merkle digest verified, %llu leaves\n", (unsigned long long) nLeaves);
+	status = 0;
+	goto DONE;
+    }
+
+    printf("Server says: output differs from the client's file in %llu ranges\n", (unsigned long long) nRanges);
+    for (i = 0, nRanges = 0; i < nLeaves; i++) {
+	if (memcmp(job.leaves + i * MERKLE_HASH_LEN, theirs + i * MERKLE_HASH_LEN, MERKLE_HASH_LEN) == 0)
+	    continue;
+	for (first = i; i + 1 < nLeaves && memcmp(job.leaves + (i + 1) * MERKLE_HASH_LEN, theirs + (i + 1) * MERKLE_HASH_LEN, MERKLE_HASH_LEN) != 0; i++)
+	    ;
+	put64(word, first * MERKLE_LEAF);
+	put64(word + 8, ((i + 1) * MERKLE_LEAF < (uint64_t) count ? (i + 1) * MERKLE_LEAF : (uint64_t) count) - first * MERKLE_LEAF);
+	reportRange("Server", nRanges++, get64(word), get64(word + 8));
+	if (writeAll(sockfd, word, sizeof(word)) < 0)
+	    goto DONE;
+    }
+    errno = EBADMSG;
+    goto DONE;
+
+    REJECT:
+    fprintf(stderr, "Server says: Merkle digest rejected, its root failed authentication\n");
+    put64(word, MERKLE_REJECTED);
+    writeAll(sockfd, word, 8);
+    errno = EBADMSG;
+    goto DONE;
+
+    TRUNCATED:
+    errno = EPROTO;
+
+    DONE:
+    if (haveJob)
+	merkleFree(&job);
+    free(theirs);
+    return status;
+}
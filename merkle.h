@@ -0,0 +1,73 @@
+/*
+ * header file for Merkle-tree integrity digests (-M)
+ */
+
+#ifndef MERKLE_H_
+#define MERKLE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define MERKLE_LEAF (1024 * 1024)		// bytes of the file under one leaf
+#define MERKLE_HASH_LEN 32			// SHA-256 for leaves and inner nodes
+#define MERKLE_MAX_THREADS 64			// upper bound for the hashing threads
+#define MERKLE_MAX_REPORT 16			// differing ranges printed before the rest are only counted
+
+/**
+ * Leaf hashes of one byte range of a file, computed by a pool of threads
+ **/
+typedef struct merkle_job {
+    int fd;					// file being hashed
+    off_t offset;				// first byte of the range
+    off_t count;				// bytes in the range
+    uint64_t nLeaves;
+    unsigned char *leaves;			// nLeaves * MERKLE_HASH_LEN bytes, in file order
+    uint64_t next;				// next leaf a worker picks up
+    int failed;					// some leaf could not be read
+    int nThreads;
+    pthread_t threads[MERKLE_MAX_THREADS];
+} merkle_job_t;
+
+/**
+ * Start hashing the leaves of 'count' bytes of 'fd' from 'offset' on one thread per core. The
+ * caller can go on with other work, e.g. sending the file, until merkleEnd().
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int merkleBegin(merkle_job_t *job, int fd, off_t offset, off_t count);
+
+/**
+ * Wait for the hashing threads of 'job'.
+ *
+ * Return:
+ * 	0 if every leaf was hashed, -1 on error
+ **/
+int merkleEnd(merkle_job_t *job);
+
+/**
+ * Release the leaf hashes of 'job'.
+ **/
+void merkleFree(merkle_job_t *job);
+
+/**
+ * Client side: once the payload is out, send the leaf hashes of 'job' and the root authenticated
+ * with the shared key, then read the server's verdict and print every byte range that differs.
+ *
+ * Return:
+ * 	0 if the server's copy matches, -1 otherwise (errno EBADMSG on a mismatch)
+ **/
+int merkleVerifySend(int sockfd, merkle_job_t *job);
+
+/**
+ * Server side: read the client's digest of the 'count' bytes just written to 'outfd' from
+ * offset 0, check its root, hash 'outfd' in parallel and compare leaf by leaf. The differing
+ * byte ranges are printed and sent back to the client.
+ *
+ * Return:
+ * 	0 if the output matches, -1 otherwise (errno EBADMSG on a mismatch or a forged digest)
+ **/
+int merkleVerifyReceive(int sockfd, int outfd, off_t count);
+
+#endif
@@ -2,22 +2,51 @@
 #ifndef NC_ARGS_T_H_
 #define NC_ARGS_T_H_
 
+#define MAX_SERV_ADDRS 16			// addresses of the server kept for connecting
+
 /**
  * Structure to hold all relevant state
  **/
 typedef struct nc_args {
-    struct sockaddr_in servAddr;		// server address information
+    struct sockaddr_storage servAddrs[MAX_SERV_ADDRS];	// server addresses in the order they are tried, see resolve.h
+    int nServAddrs;
+    int connectTimeout;				// milliseconds name resolution and each connect may take
+    int attemptDelay;				// milliseconds a connection attempt runs before the next address is tried
     unsigned short port;			// server's listening port
     unsigned short listen;			// listen flag
-    int n_bytes;				// number of bytes to send
-    int offset;					// file offset
-    int verbose;				// verbose output info
+    off_t n_bytes;				// number of bytes to send
+    off_t offset;				// file offset
+    int verbose;				// verbose output info: per-transfer telemetry on stderr
+    int json;					// telemetry as JSON lines instead of text
+    int stripes;				// number of parallel connections a file is split over
+    int authenticate;				// client: HMAC every chunk; server: refuse unauthenticated transfers
+    int encrypt;				// client: AES-GCM every chunk; server: refuse unencrypted transfers
+    int resume;					// continue a transfer from what the server already holds
+    int uring;					// move file data through the io_uring backend when the kernel has it
+    int persistent;				// server keeps accepting clients, one output file each
+    int batch;					// client sends many files and directories over one connection
+    char **batchPaths;				// files, directories and @lists of a batch
+    int nBatchPaths;
+    int compress;				// zlib level for data chunks, COMPRESS_OFF for none
+    int direct;					// server writes its output with O_DIRECT, past the page cache
+    int sparse;					// client sends the holes of its file as lengths instead of zeros
+    int merkle;					// verify the output against a Merkle-tree digest of the input
+    int delta;					// client sends only what differs from the server's copy of the output file
+    int dedup;					// client sends content-defined chunks, only those the server's store lacks
+    char *storeDir;				// server keeps received files as recipes over this chunk store, NULL for none
+    int udp;					// datagrams over UDP instead of a TCP stream
+    int local;					// LOCAL_UNIX or LOCAL_SHM for a unix: or shm: address, else LOCAL_NONE
+    char *localName;				// socket path or ring name of a same-host address
+    int relay;					// relay standard input and output over the connection instead of a file
+    long chunk;					// transfer buffer size in bytes, TUNE_AUTO to adapt it
+    int sockBuf;				// SO_SNDBUF/SO_RCVBUF in bytes, TUNE_AUTO to adapt it
+    int tcpMode;				// TUNE_TCP_* Nagle/cork setting of data sockets
+    long long paceRate;				// -P bytes per second of all sends together, PACE_OFF for no pacing
+    long long paceCap;				// bytes per second of each connection, PACE_OFF for no cap of its own
     int message_mode;				// to indicate message is being sent by client
     char *message;				// if message_mode is activated, this will store the message
     char *serverFilename;			// output file's name
     char *clientFilename;			// input file's name
 } nc_args_t;
 
-#define BUF_LEN 1024				// data buffer length
-
 #endif
\ No newline at end of file
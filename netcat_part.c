@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <unistd.h>				// for getopt(), optarg, optind, etc.
 #include <string.h>				// for memmove()
+#include <errno.h>				// for strtoll() range errors
  
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -19,6 +20,14 @@
 #include <arpa/inet.h>
 
 #include "nc_args_t.h"				// header file for nc_args_t structure; this structure comprises of all command line arguments
+#include "proto.h"					// for MAX_STRIPES
+#include "stats.h"					// telemetry for -v/-j
+#include "tune.h"					// buffer sizes and socket options (-b, -w, -t)
+#include "compress.h"				// compression level (-z)
+#include "output.h"				// O_DIRECT output (-O)
+#include "local.h"					// unix: and shm: addresses
+#include "resolve.h"				// getaddrinfo and happy-eyeballs connect (-T)
+#include "pace.h"					// send pacing (-P)
 
 /**
  * usage(FILE * file)
@@ -32,14 +41,59 @@ void usage(FILE *file){
     fprintf(file,
 	    "netcat_part [OPTIONS]dest_ip [file] \n"
 	    "\t -h           \t\t Print this help screen\n"
-	    "\t -v           \t\t Verbose output\n"
+	    "\t -v           \t\t Verbose output: live and final transfer telemetry on stderr\n"
+	    "\t -j           \t\t Like -v, but telemetry is printed as JSON lines\n"
 	    "\t -m \"MSG\"   \t\t Send the message specified on the command line. \n"
 	    "                \t\t Warning: if you specify this option, you do not specify a file. \n"
+	    "\t -R           \t\t Relay: send standard input and write what the peer sends to standard\n"
+	    "                \t\t output, both at once, instead of a file; with -l for the first client.\n"
+	    "                \t\t The end of standard input half-closes the connection\n"
 	    "\t -p port      \t\t Set the port to connect on (dflt: 6767)\n"
+	    "\t -T ms[,delay]\t\t Give up on name resolution and on each connection after ms milliseconds;\n"
+	    "                \t\t the addresses of dest_ip (IPv6 and IPv4) are raced, a new one every delay\n"
+	    "                \t\t milliseconds (dflt: 10000,250)\n"
 	    "\t -n bytes     \t\t Number of bytes to send, defaults whole file\n"
 	    "\t -o offset    \t\t Offset into file to start sending\n"
+	    "\t -s streams   \t\t Split the file over this many parallel connections (dflt: 1)\n"
+	    "\t -a           \t\t Send data as HMAC-authenticated chunks; with -l, refuse data that is not\n"
+	    "\t -e           \t\t Send data encrypted with AES-128-GCM under the shared key, which also\n"
+	    "                \t\t authenticates it; with -l, refuse data that is not encrypted\n"
+	    "\t -d           \t\t Batch: send every file and directory given over one connection;\n"
+	    "                \t\t @list reads paths from list, one per line. The server needs no\n"
+	    "                \t\t option, its file is then taken as the output directory\n"
+	    "\t -D           \t\t Delta: only send the parts of file the server's copy does not already have\n"
+	    "\t -c           \t\t Dedup: cut file into content-defined chunks and only send the ones the\n"
+	    "                \t\t server's chunk store does not already have\n"
+	    "\t -z level     \t\t Compress data chunks with zlib at level 1-9; chunks that do not shrink go raw,\n"
+	    "                \t\t levels 6 and up compress on every core\n"
+	    "\t -S           \t\t Sparse: send the holes of file as their lengths instead of zeros; the\n"
+	    "                \t\t server leaves them holes\n"
+	    "\t -M           \t\t Verify the server's copy with a Merkle-tree digest hashed on every core,\n"
+	    "                \t\t reporting the byte ranges that differ\n"
+	    "\t -r           \t\t Resume: skip the bytes the server already holds of its output file\n"
+	    "\t -U           \t\t Send over UDP: numbered datagrams batched with sendmmsg; the server\n"
+	    "                \t\t (-l -U) appends them as they come and reports lost and reordered ones.\n"
+	    "                \t\t Nothing is resent, -a, -e, -z, -D, -M, -r, -s, -d and -S need TCP\n"
+	    "\t -u           \t\t Use the io_uring backend for file data (falls back on older kernels)\n"
+	    "\t -b size      \t\t Transfer buffer size, e.g. 256K, or auto to grow it with the link (dflt: auto)\n"
+	    "\t -w size      \t\t Socket send/receive buffer size, or auto to size it from throughput and RTT (dflt: auto)\n"
+	    "\t -t mode      \t\t TCP sending: nodelay, cork, none, or auto (nodelay for messages, cork for files)\n"
+	    "\t -P rate[,cap]\t\t Pace sends to rate bytes per second, e.g. 50M, in even slices instead of\n"
+	    "                \t\t bursts; parallel connections (-s) share it by length, each at most cap\n"
 	    "\t -l           \t\t Listen on port instead of connecting and write output to file\n"
-	    "                \t\t and dest_ip refers to which ip to bind to (dflt: localhost)\n"
+	    "                \t\t and dest_ip refers to which ip to bind to (dflt: localhost); a name with\n"
+	    "                \t\t IPv4 and IPv6 addresses is bound on IPv4, \"::\" takes both families\n"
+	    "\t -O           \t\t With -l, write the output with O_DIRECT so a large receive does not\n"
+	    "                \t\t evict other data from the page cache; with -k on a shm: ring only\n"
+	    "\t -C dir       \t\t With -l, keep each distinct chunk once in the store dir and write file as\n"
+	    "                \t\t the recipe of its chunks; \"(cd dir && xargs cat) < file\" restores it.\n"
+	    "                \t\t Takes plain and -c transfers\n"
+	    "\t -k           \t\t With -l, keep serving clients concurrently; file is a name template,\n"
+	    "                \t\t \"%%d\" in it is replaced by the connection number (dflt: file.N).\n"
+	    "                \t\t Plain transfers only, a client that asks for more is refused\n"
+	    "\t dest_ip may also be unix:PATH, a Unix domain socket, or shm:NAME, a shared-memory\n"
+	    "\t ring, when both ends run on the same host. A ring carries plain data one way only:\n"
+	    "\t -a, -e, -z, -D, -M, -r, -s, -d, -S, -U, -R, -c, -C and -P need a socket\n"
 	    );
 }
 
@@ -54,6 +108,25 @@ int checkport(unsigned short p) {
     return ((p >= 0 && p < 65535) ? 1 : 0);			// 1: all OK; 0: all NOT OK
 }
 
+/**
+ * Parse the byte offset or count 's' (-o, -n) into '*value', over the full 64-bit file range.
+ *
+ * Return:
+ * 	1 if 's' is a non-negative number that fits, 0 otherwise
+ **/
+static int parseBytes(const char *s, off_t *value) {
+
+    char *end;
+    long long v;
+
+    errno = 0;
+    v = strtoll(s, &end, 10);
+    if (end == s || *end != '\0' || errno == ERANGE || v < 0)
+	return 0;
+    *value = v;
+    return 1;
+}
+
 /**
  * Given a pointer to a nc_args struct and the command line argument
  * info, set all the arguments for nc_args to function use getopt()
@@ -65,18 +138,46 @@ int checkport(unsigned short p) {
 void parse_args(nc_args_t *nc_args, int argc, char *argv[]){
     
     int ch;
-    struct hostent *hostinfo;			/* to store all relevant information regarding the server or destination host and 
-						 * then use it to populate our nc_args structure */
+    long size;					// -w value before range checking
+    int local;					// 1 for a unix: or shm: address
+    int status;					// getaddrinfo() result
+    char *end;					// end of a number in an option
 
     //set defaults
     nc_args->n_bytes = 0;
     nc_args->offset = 0;
     nc_args->listen = 0;
     nc_args->port = 6767;
+    nc_args->connectTimeout = RESOLVE_TIMEOUT_MS;
+    nc_args->attemptDelay = RESOLVE_ATTEMPT_DELAY_MS;
     nc_args->verbose = 0;
+    nc_args->json = 0;
     nc_args->message_mode = 0;
+    nc_args->persistent = 0;
+    nc_args->batch = 0;
+    nc_args->delta = 0;
+    nc_args->dedup = 0;
+    nc_args->storeDir = NULL;
+    nc_args->udp = 0;
+    nc_args->local = LOCAL_NONE;
+    nc_args->localName = NULL;
+    nc_args->relay = 0;
+    nc_args->merkle = 0;
+    nc_args->sparse = 0;
+    nc_args->direct = 0;
+    nc_args->compress = COMPRESS_OFF;
+    nc_args->stripes = 1;
+    nc_args->authenticate = 0;
+    nc_args->encrypt = 0;
+    nc_args->resume = 0;
+    nc_args->uring = 0;
+    nc_args->chunk = TUNE_AUTO;
+    nc_args->sockBuf = TUNE_AUTO;
+    nc_args->tcpMode = TUNE_TCP_AUTO;
+    nc_args->paceRate = PACE_OFF;
+    nc_args->paceCap = PACE_OFF;
  
-    while ((ch = getopt(argc, argv, "lm:hvp:n:o:")) != -1) {			/* third argument to getopt() is the string of recognized option characters
+    while ((ch = getopt(argc, argv, "ab:cC:dDejlkMm:hOvp:n:o:P:Rrs:St:T:uUw:z:")) != -1) {			/* third argument to getopt() is the string of recognized option characters
 										 * called 'optstring'
 										 */
 										 
@@ -97,20 +198,139 @@ void parse_args(nc_args_t *nc_args, int argc, char *argv[]){
 	    case 'l':					// direct server to listen for incoming client connections
 		nc_args->listen = 1;
 		break;
+	    case 'a':					// authenticate every chunk with the shared key
+		nc_args->authenticate = 1;
+		break;
+	    case 'e':					// encrypt every chunk with a key derived from the shared key
+		nc_args->encrypt = 1;
+		break;
+	    case 'b':					// transfer buffer size
+		nc_args->chunk = tuneParseSize(optarg);
+		if (nc_args->chunk < 0 || (nc_args->chunk != TUNE_AUTO && (nc_args->chunk < TUNE_MIN_CHUNK || nc_args->chunk > TUNE_MAX_CHUNK))) {
+		    fprintf(stderr, "ERROR: Buffer size must be auto or between %d and %d bytes\n", TUNE_MIN_CHUNK, TUNE_MAX_CHUNK);
+		    usage(stdout);
+		    exit(1);
+		}
+		break;
+	    case 'w':					// socket buffer size
+		size = tuneParseSize(optarg);
+		if (size < 0 || size > TUNE_MAX_SOCKBUF) {
+		    fprintf(stderr, "ERROR: Socket buffer size must be auto or at most %d bytes\n", TUNE_MAX_SOCKBUF);
+		    usage(stdout);
+		    exit(1);
+		}
+		nc_args->sockBuf = size;
+		break;
+	    case 't':					// Nagle/cork behaviour of data sockets
+		if (strcmp(optarg, "auto") == 0)
+		    nc_args->tcpMode = TUNE_TCP_AUTO;
+		else if (strcmp(optarg, "nodelay") == 0)
+		    nc_args->tcpMode = TUNE_TCP_NODELAY;
+		else if (strcmp(optarg, "cork") == 0)
+		    nc_args->tcpMode = TUNE_TCP_CORK;
+		else if (strcmp(optarg, "none") == 0)
+		    nc_args->tcpMode = TUNE_TCP_NONE;
+		else {
+		    fprintf(stderr, "ERROR: Unknown TCP mode '%s'\n", optarg);
+		    usage(stdout);
+		    exit(1);
+		}
+		break;
+	    case 'd':					// batch of files over one connection
+		nc_args->batch = 1;
+		break;
+	    case 'D':					// delta against the server's existing copy
+		nc_args->delta = 1;
+		break;
+	    case 'c':					// content-defined chunks, only the ones the server lacks
+		nc_args->dedup = 1;
+		break;
+	    case 'C':					// chunk store of the server
+		nc_args->storeDir = optarg;
+		break;
+	    case 'z':					// compress data chunks at this level
+		nc_args->compress = atoi(optarg);
+		if (nc_args->compress < 1 || nc_args->compress > 9) {
+		    fprintf(stderr, "ERROR: Compression level must be between 1 and 9\n");
+		    usage(stdout);
+		    exit(1);
+		}
+		break;
+	    case 'P':					// send pacing rate and per-connection cap
+		if ( (end = strchr(optarg, ',')) != NULL )
+		    *end++ = '\0';
+		nc_args->paceRate = paceParseRate(optarg);
+		if (end != NULL)
+		    nc_args->paceCap = paceParseRate(end);
+		if (nc_args->paceRate < 0 || nc_args->paceCap < 0) {
+		    fprintf(stderr, "ERROR: -P takes a rate in bytes per second with an optional K/M/G suffix, optionally followed by ,cap\n");
+		    usage(stdout);
+		    exit(1);
+		}
+		break;
+	    case 'T':					// resolve/connect timeout and attempt delay
+		nc_args->connectTimeout = strtol(optarg, &end, 10);
+		if (*end == ',')
+		    nc_args->attemptDelay = strtol(end + 1, &end, 10);
+		if (*end != '\0' || nc_args->connectTimeout <= 0 || nc_args->attemptDelay < RESOLVE_MIN_DELAY_MS) {
+		    fprintf(stderr, "ERROR: -T takes a timeout in milliseconds, optionally followed by ,delay of at least %d\n", RESOLVE_MIN_DELAY_MS);
+		    usage(stdout);
+		    exit(1);
+		}
+		break;
+	    case 'S':					// send holes as lengths
+		nc_args->sparse = 1;
+		break;
+	    case 'U':					// datagrams instead of a stream
+		nc_args->udp = 1;
+		break;
+	    case 'M':					// Merkle-tree digest of the whole transfer
+		nc_args->merkle = 1;
+		break;
+	    case 'O':					// write the output past the page cache
+		nc_args->direct = 1;
+		break;
+	    case 'k':					// keep serving clients instead of exiting after the first one
+		nc_args->persistent = 1;
+		break;
 	    case 'o':					// offset into file
-		nc_args->offset = atoi(optarg);
+		if (!parseBytes(optarg, &nc_args->offset)) {
+		    fprintf(stderr, "ERROR: Offset must be a number of bytes from 0 on\n");
+		    usage(stdout);
+		    exit(1);
+		}
 		break;
 	    case 'n':					// number of bytes to be sent
-		nc_args->n_bytes = atoi(optarg);
-		if (nc_args->n_bytes == 0) {
+		if (!parseBytes(optarg, &nc_args->n_bytes) || nc_args->n_bytes == 0) {
 		    fprintf(stderr, "Absurd value entered for number of bytes to read from file. Try again.");
 		    usage(stdout);
 		    exit(1);
 		}
 		break;
+	    case 'R':					// standard input and output instead of a file
+		nc_args->relay = 1;
+		break;
+	    case 'r':					// resume an interrupted transfer
+		nc_args->resume = 1;
+		break;
+	    case 's':					// number of parallel connections to split the file over
+		nc_args->stripes = atoi(optarg);
+		if (nc_args->stripes < 1 || nc_args->stripes > MAX_STRIPES) {
+		    fprintf(stderr, "ERROR: Number of streams must be between 1 and %d\n", MAX_STRIPES);
+		    usage(stdout);
+		    exit(1);
+		}
+		break;
+	    case 'u':					// io_uring backend
+		nc_args->uring = 1;
+		break;
 	    case 'v':
 		nc_args->verbose = 1;			// set verbose mode on
 		break;
+	    case 'j':					// verbose, machine-readable
+		nc_args->verbose = 1;
+		nc_args->json = 1;
+		break;
 	    case 'm':
 		nc_args->message_mode = 1;		// imply that there will be a message passed to server by client instead of a file
 		nc_args->message = (char *) malloc(strlen(optarg) + 1);		// allocate memory for string message, one extra than message length for '\0'
@@ -126,7 +346,70 @@ void parse_args(nc_args_t *nc_args, int argc, char *argv[]){
     argc -= optind;
     argv += optind;
     
-    if (argc < 2 && nc_args->message_mode == 0) {
+    if (nc_args->resume && nc_args->stripes > 1) {
+	fprintf(stderr, "ERROR: A striped transfer cannot be resumed, use a single stream\n");
+	usage(stderr);
+	exit(1);
+    }
+    
+    if (nc_args->batch && !nc_args->listen
+	&& (nc_args->message_mode || nc_args->stripes > 1 || nc_args->resume || nc_args->offset != 0 || nc_args->n_bytes != 0)) {
+	fprintf(stderr, "ERROR: A batch sends whole files over one stream, it cannot be combined with -m, -s, -r, -o or -n\n");
+	usage(stderr);
+	exit(1);
+    }
+    
+    if (nc_args->udp
+	&& (nc_args->authenticate || nc_args->encrypt || nc_args->compress != COMPRESS_OFF || nc_args->delta
+	    || nc_args->merkle || nc_args->resume || nc_args->stripes > 1 || nc_args->batch || nc_args->sparse)) {
+	fprintf(stderr, "ERROR: UDP datagrams are neither framed nor acknowledged, -U cannot be combined with -a, -e, -z, -D, -M, -r, -s, -d or -S\n");
+	usage(stderr);
+	exit(1);
+    }
+    
+    if (nc_args->delta && !nc_args->listen
+	&& (nc_args->message_mode || nc_args->stripes > 1 || nc_args->resume || nc_args->batch)) {
+	fprintf(stderr, "ERROR: A delta transfer needs a single stream and a file, it cannot be combined with -m, -s, -r or -d\n");
+	usage(stderr);
+	exit(1);
+    }
+    
+    if (nc_args->dedup && !nc_args->listen
+	&& (nc_args->message_mode || nc_args->stripes > 1 || nc_args->resume || nc_args->batch || nc_args->delta
+	    || nc_args->sparse || nc_args->merkle || nc_args->udp || nc_args->relay)) {
+	fprintf(stderr, "ERROR: A dedup transfer needs a single stream and a file, it cannot be combined with -m, -s, -r, -d, -D, -S, -M, -U or -R\n");
+	usage(stderr);
+	exit(1);
+    }
+    
+    if (nc_args->storeDir != NULL && (!nc_args->listen || nc_args->persistent || nc_args->udp || nc_args->relay)) {
+	fprintf(stderr, "ERROR: -C gives a server (-l) its chunk store, and cannot be combined with -k, -U or -R\n");
+	usage(stderr);
+	exit(1);
+    }
+    
+    if (nc_args->persistent && (nc_args->authenticate || nc_args->encrypt)) {
+	fprintf(stderr, "ERROR: -k serves plain transfers only, it cannot be combined with -a or -e\n");
+	usage(stderr);
+	exit(1);
+    }
+    
+    if (nc_args->merkle && !nc_args->listen && (nc_args->stripes > 1 || nc_args->batch || nc_args->delta)) {
+	fprintf(stderr, "ERROR: A Merkle digest covers one single-stream file, it cannot be combined with -s, -d or -D\n");
+	usage(stderr);
+	exit(1);
+    }
+    
+    if (nc_args->relay
+	&& (nc_args->message_mode || nc_args->persistent || nc_args->udp || nc_args->authenticate || nc_args->encrypt
+	    || nc_args->compress != COMPRESS_OFF || nc_args->delta || nc_args->merkle || nc_args->resume || nc_args->stripes > 1
+	    || nc_args->batch || nc_args->sparse || nc_args->direct || nc_args->offset != 0 || nc_args->n_bytes != 0)) {
+	fprintf(stderr, "ERROR: A relay is one plain stream to one peer, -R cannot be combined with -m, -k, -U, -a, -e, -z, -D, -M, -r, -s, -d, -S, -O, -o or -n\n");
+	usage(stderr);
+	exit(1);
+    }
+    
+    if (argc < 2 && nc_args->message_mode == 0 && nc_args->relay == 0) {
 	fprintf(stderr, "ERROR: Require IP and file\n");
 	usage(stderr);
 	exit(1);
@@ -134,23 +417,46 @@ void parse_args(nc_args_t *nc_args, int argc, char *argv[]){
 	fprintf(stderr, "ERROR: Require IP to send/recv from when in message mode\n");
 	usage(stderr);
 	exit(1);
+    } else if (argc != 1 && nc_args->relay == 1) {
+	fprintf(stderr, "ERROR: Require only IP when relaying standard input and output\n");
+	usage(stderr);
+	exit(1);
     }
  
-    if( !(hostinfo = gethostbyname(argv[0])) ){				// gethostbyname() returns the hostent structure or NULL on failure
-	fprintf(stderr,"ERROR: Invalid host name '%s' specified\n", argv[0]);
+    // unix:PATH and shm:NAME stay on this host and need no name lookup
+    if ( (local = localParse(argv[0], nc_args)) < 0 ) {
+	fprintf(stderr,"ERROR: Invalid same-host address '%s' specified\n", argv[0]);
+	usage(stderr);
+	exit(1);
+    }
+    
+    if (!local && (status = resolveHost(argv[0], nc_args)) != 0) {
+	fprintf(stderr,"ERROR: Invalid host name '%s' specified: %s\n", argv[0], gai_strerror(status));
+	usage(stderr);
+	exit(1);
+    }
+    
+    if (nc_args->local == LOCAL_SHM
+	&& (nc_args->authenticate || nc_args->encrypt || nc_args->compress != COMPRESS_OFF || nc_args->delta || nc_args->merkle
+	    || nc_args->resume || nc_args->stripes > 1 || nc_args->batch || nc_args->sparse || nc_args->udp || nc_args->relay
+	    || nc_args->dedup || nc_args->storeDir != NULL || nc_args->paceRate != PACE_OFF)) {
+	fprintf(stderr, "ERROR: A shared-memory ring carries plain data one way only, shm: cannot be combined with -a, -e, -z, -D, -M, -r, -s, -d, -S, -U, -R, -c, -C or -P\n");
+	usage(stderr);
+	exit(1);
+    }
+    if (nc_args->persistent && nc_args->direct && nc_args->local != LOCAL_SHM) {
+	fprintf(stderr, "ERROR: -k splices each socket into a page-cached file, -O goes with -k on a shm: ring only\n");
+	usage(stderr);
+	exit(1);
+    }
+    if (nc_args->local == LOCAL_UNIX && nc_args->udp) {
+	fprintf(stderr, "ERROR: -U sends datagrams to an IP address, not to a Unix socket\n");
 	usage(stderr);
 	exit(1);
     }
-
-    nc_args->servAddr.sin_family = hostinfo->h_addrtype;
-    memmove( (char *) &(nc_args->servAddr.sin_addr.s_addr), (char *) hostinfo->h_addr, hostinfo->h_length );	/* fill the server's IP address info
-														 * received from struct hostent *hostinfo */
-    //bcopy((char *) hostinfo->h_addr, (char *) &(nc_args->servAddr.sin_addr.s_addr), hostinfo->h_length);	// deprecated
- 
-    nc_args->servAddr.sin_port = htons(nc_args->port);					// fill the server's port number in network-byte order
  
-    /* Save file names if not in message mode */
-    if (nc_args->message_mode != 1) {			// if not in message mode, then
+    /* Save file names if not in message mode; a relay has no file either */
+    if (nc_args->message_mode != 1 && nc_args->relay != 1) {	// if not in message mode, then
 	
 	// either server with listen mode is being called
 	if (nc_args->listen == 1) {
@@ -163,6 +469,10 @@ void parse_args(nc_args_t *nc_args, int argc, char *argv[]){
 	    // store client's input file name
 	    nc_args->clientFilename = (char *) malloc(strlen(argv[1]) + 1);
 	    strncpy( nc_args->clientFilename, argv[1], (strlen(argv[1]) + 1) );
+	    
+	    // a batch takes every remaining argument
+	    nc_args->batchPaths = argv + 1;
+	    nc_args->nBatchPaths = argc - 1;
 	}
     }
     
@@ -180,6 +490,13 @@ int main(int argc, char *argv[]) {
     //initializes the arguments struct for your use
     parse_args(&nc_args, argc, argv);
 
+    if (nc_args.verbose)
+	statsInit(nc_args.listen ? "server" : "client", nc_args.json);
+    tuneInit(nc_args.chunk, nc_args.sockBuf, nc_args.tcpMode);
+    paceInit(nc_args.paceRate, nc_args.paceCap);
+    compressInit(nc_args.compress);
+    outputInit(nc_args.direct);
+
     // set up a client or server based on user input
     if ((&nc_args)->listen == 1) {				// check to see if server is being asked to run or client
 	
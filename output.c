@@ -0,0 +1,278 @@
+/*
+ * Output file writer of the server.
+ *
+ * When the size of a transfer is known from its header, the server reserves the whole range
+ * with fallocate() before the first byte arrives, so the file system can hand out one extent
+ * instead of growing the file a chunk at a time and interleaving it with everything else
+ * being written. A resumable output keeps its length (FALLOC_FL_KEEP_SIZE): the length of the
+ * file still says how much of it was received.
+ *
+ * Received data is staged in an aligned buffer and written in blocks of OUTPUT_BLOCK bytes,
+ * whatever size the chunks arrive in. With -O those blocks go to a second descriptor of the
+ * file opened with O_DIRECT, so a bulk receive does not push the server's working set out of
+ * the page cache. The buffer is laid out so that its memory and the file offsets it covers
+ * share their alignment, and only the unaligned bytes at either end of a range go through the
+ * page cache. Where the file system refuses O_DIRECT the blocks are written through the page
+ * cache, written back right away with sync_file_range() and dropped with posix_fadvise() once
+ * the next block is out, which keeps the cache footprint at two blocks.
+ *
+ * A hole of a sparse transfer is skipped: the staged data is written out, the range is punched
+ * and the writer carries on after it, so the hole costs no writes and no blocks.
+ *
+ * A memory-mapped output was not taken: mapping the range needs the file at its full length
+ * up front, and that length is what a resumed transfer relies on.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. man 2 fallocate
+ * 	       2. man 2 open, "O_DIRECT"
+ * 	       3. man 2 sync_file_range
+ */
+
+#define _GNU_SOURCE				// for O_DIRECT, fallocate() and sync_file_range()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>			// for fstat()
+
+#include "output.h"
+#include "stats.h"			// telemetry for -v
+
+#define ALIGN_DOWN(x) ((x) & ~((off_t) OUTPUT_ALIGN - 1))
+#define ALIGN_UP(x) ALIGN_DOWN((x) + OUTPUT_ALIGN - 1)
+
+static int direct = 0;				// -O
+
+void outputInit(int outputDirect) {
+    direct = outputDirect;
+}
+
+int outputDirect(void) {
+    return direct;
+}
+
+int outputReserve(int fd, off_t offset, off_t length, int keepSize) {
+
+    if (length <= 0)
+	return 0;
+    if (fallocate(fd, keepSize ? FALLOC_FL_KEEP_SIZE : 0, offset, length) == 0)
+	return 0;
+    if (errno != EOPNOTSUPP && errno != ENOSYS)
+	return -1;
+    // no preallocation here, the blocks are allocated as they are written
+    return (keepSize || ftruncate(fd, offset + length) == 0) ? 0 : -1;
+}
+
+int outputOpen(output_t *out, int fd, off_t offset) {
+
+    char path[64];
+
+    memset(out, 0, sizeof(output_t));
+    out->fd = fd;
+    out->directFd = -1;
+    if (posix_memalign((void **) &out->buf, OUTPUT_ALIGN, OUTPUT_BLOCK) != 0) {
+	errno = ENOMEM;
+	return -1;
+    }
+    out->base = ALIGN_DOWN(offset);
+    out->lo = out->fill = offset - out->base;
+
+    // a descriptor of its own, so the unaligned ends can still be written through the page cache
+    if (direct) {
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	out->directFd = open(path, O_WRONLY | O_DIRECT | O_CLOEXEC);
+    }
+    return 0;
+}
+
+/**
+ * Write 'len' bytes of 'buf' at 'offset' of 'fd'.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int writeAt(int fd, const unsigned char *buf, size_t len, off_t offset) {
+
+    uint64_t start;
+    ssize_t n;
+
+    while (len > 0) {
+	start = statsStart();
+	n = pwrite(fd, buf, len, offset);
+	statsIo(STATS_DISK, start, len, n);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += n;
+	len -= n;
+	offset += n;
+    }
+    return 0;
+}
+
+/**
+ * Write the staged bytes buf[from, to) to their place in the file: the aligned middle with
+ * O_DIRECT when it is available, the rest through the page cache.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int writeRange(output_t *out, size_t from, size_t to) {
+
+    size_t head, mid;
+
+    if (from >= to)
+	return 0;
+
+    if (out->directFd >= 0) {
+	head = ALIGN_UP(from);
+	if (head > to)
+	    head = to;
+	mid = ALIGN_DOWN(to);
+	if (mid > head) {
+	    if (writeAt(out->fd, out->buf + from, head - from, out->base + from) < 0)
+		return -1;
+	    if (writeAt(out->directFd, out->buf + head, mid - head, out->base + head) == 0)
+		return writeAt(out->fd, out->buf + mid, to - mid, out->base + mid);
+	    if (errno != EINVAL)
+		return -1;
+	    // the file system takes O_DIRECT at open() but not for writes, use the page cache from now on
+	    close(out->directFd);
+	    out->directFd = -1;
+	    from = head;
+	}
+    }
+
+    if (writeAt(out->fd, out->buf + from, to - from, out->base + from) < 0)
+	return -1;
+
+    if (direct && out->directFd < 0) {
+	// start writing this range back now, and drop the previous one once it is on disk
+	sync_file_range(out->fd, out->base + from, to - from, SYNC_FILE_RANGE_WRITE);
+	if (out->dropLen > 0) {
+	    sync_file_range(out->fd, out->dropOffset, out->dropLen,
+			    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	    posix_fadvise(out->fd, out->dropOffset, out->dropLen, POSIX_FADV_DONTNEED);
+	}
+	out->dropOffset = out->base + from;
+	out->dropLen = to - from;
+    }
+    return 0;
+}
+
+/**
+ * Write out the staged data. Unless 'all' is set, an unaligned tail is kept in the buffer for
+ * the next block, moved to its front.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int flush(output_t *out, int all) {
+
+    size_t cut = ALIGN_DOWN(out->fill);
+    size_t tail = out->fill - cut;
+
+    if (writeRange(out, out->lo, (all || out->directFd < 0) ? out->fill : cut) < 0)
+	return -1;
+    if (all || out->directFd < 0)
+	out->lo = tail;				// tail already written, only kept for alignment
+    else
+	out->lo = (out->lo > cut) ? out->lo - cut : 0;
+    memmove(out->buf, out->buf + cut, tail);
+    out->base += cut;
+    out->fill = tail;
+    return 0;
+}
+
+void *outputBuffer(output_t *out, size_t len) {
+
+    if (len > OUTPUT_BLOCK - OUTPUT_ALIGN) {
+	errno = EINVAL;
+	return NULL;
+    }
+    if (OUTPUT_BLOCK - out->fill < len && flush(out, 0) < 0)
+	return NULL;
+    return out->buf + out->fill;
+}
+
+void outputCommit(output_t *out, size_t len) {
+    out->fill += len;
+}
+
+int outputSkip(output_t *out, off_t len) {
+
+    struct stat outStat;
+    off_t from, to;
+
+    if (len <= 0)
+	return 0;
+    if (flush(out, 1) < 0)
+	return -1;
+    from = out->base + out->fill;
+    to = from + len;
+
+    // a preallocated or rewritten file may have blocks there; file systems without punching keep them
+    if (fallocate(out->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, len) < 0
+	&& errno != EOPNOTSUPP && errno != ENOSYS)
+	return -1;
+    if (fstat(out->fd, &outStat) < 0 || (outStat.st_size < to && ftruncate(out->fd, to) < 0))
+	return -1;
+
+    out->base = ALIGN_DOWN(to);
+    out->lo = out->fill = to - out->base;
+    return 0;
+}
+
+ssize_t outputReceive(output_t *out, int sockfd, size_t count) {
+
+    size_t total = 0, want;
+    uint64_t start;
+    ssize_t n;
+
+    while (total < count) {
+	if (out->fill == OUTPUT_BLOCK && flush(out, 0) < 0)
+	    return -1;
+	want = OUTPUT_BLOCK - out->fill;
+	if (want > count - total)
+	    want = count - total;
+	start = statsStart();
+	n = read(sockfd, out->buf + out->fill, want);
+	statsIo(STATS_NET, start, want, n);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (n == 0)				// client went away early
+	    break;
+	out->fill += n;
+	total += n;
+    }
+    return total;
+}
+
+int outputClose(output_t *out) {
+
+    int status = flush(out, 1);
+    int savedErrno = errno;
+
+    // the last range written is no use in the cache either
+    if (status == 0 && out->dropLen > 0) {
+	fdatasync(out->fd);
+	posix_fadvise(out->fd, out->dropOffset, out->dropLen, POSIX_FADV_DONTNEED);
+    }
+    if (out->directFd >= 0)
+	close(out->directFd);
+    free(out->buf);
+    out->buf = NULL;
+    out->directFd = -1;
+    errno = savedErrno;
+    return status;
+}
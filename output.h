@@ -0,0 +1,102 @@
+/*
+ * header file for the server's output file writer: preallocation and large aligned writes (-O)
+ */
+
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define OUTPUT_ALIGN 4096			// O_DIRECT alignment of file offsets, lengths and memory
+#define OUTPUT_BLOCK (4 * 1024 * 1024)		// staging buffer, written out in one go
+
+/**
+ * Sequential writer of one byte range of an output file
+ **/
+typedef struct output {
+    int fd;					// the output file, opened without O_DIRECT
+    int directFd;				// same file opened with O_DIRECT, -1 if not used or not supported
+    unsigned char *buf;				// OUTPUT_BLOCK bytes, aligned to OUTPUT_ALIGN
+    off_t base;					// file offset of buf[0], a multiple of OUTPUT_ALIGN
+    size_t lo;					// first byte of buf not yet written out
+    size_t fill;				// bytes of buf in use
+    off_t dropOffset;				// -O without O_DIRECT: range written last, dropped from the
+    off_t dropLen;				// page cache once the next one is written
+} output_t;
+
+/**
+ * Set whether output files are written with O_DIRECT, keeping received data out of the page
+ * cache (-O).
+ *
+ * Return:
+ * 	void
+ **/
+void outputInit(int direct);
+
+/**
+ * Return:
+ * 	non-zero if output files are written with O_DIRECT (-O)
+ **/
+int outputDirect(void);
+
+/**
+ * Allocate the 'length' bytes of 'fd' from 'offset' on up front, so the file system can lay
+ * them out in one piece. With 'keepSize' the file's length is left alone and only grows as
+ * data is written; otherwise it is extended to the end of the range. File systems without
+ * fallocate() are left to allocate as usual.
+ *
+ * Return:
+ * 	0 on success, -1 on error (e.g. ENOSPC, the data would not fit)
+ **/
+int outputReserve(int fd, off_t offset, off_t length, int keepSize);
+
+/**
+ * Start writing 'fd' sequentially from 'offset' on.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int outputOpen(output_t *out, int fd, off_t offset);
+
+/**
+ * Return room for at least 'len' bytes (at most OUTPUT_BLOCK - OUTPUT_ALIGN) right after the
+ * data written so far, writing out the staged data first if needed. The caller fills it and
+ * hands it over with outputCommit().
+ *
+ * Return:
+ * 	pointer into the staging buffer, or NULL on error
+ **/
+void *outputBuffer(output_t *out, size_t len);
+
+/**
+ * Hand over 'len' bytes placed at outputBuffer().
+ **/
+void outputCommit(output_t *out, size_t len);
+
+/**
+ * Leave the next 'len' bytes of the file a hole: write out what is staged, punch the range in
+ * case the file held data there, and make sure the file reaches past it.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int outputSkip(output_t *out, off_t len);
+
+/**
+ * Read 'count' bytes from socket 'sockfd' straight into the staging buffer and write them.
+ *
+ * Return:
+ * 	number of bytes received, or -1 on error
+ **/
+ssize_t outputReceive(output_t *out, int sockfd, size_t count);
+
+/**
+ * Write out everything staged and release 'out'. 'fd' stays open.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int outputClose(output_t *out);
+
+#endif
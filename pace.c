@@ -0,0 +1,277 @@
+/*
+ * Send pacing (-P): a token bucket that lets the data out at a set rate, in small and evenly
+ * spaced sends, instead of in bursts as fast as the socket buffer takes them. A bulk transfer
+ * then leaves room on a shared uplink for traffic that cares about latency.
+ *
+ * The bucket fills at the -P rate and holds one slice at most, so time spent idle is not saved
+ * up for a burst later. A send waits until the bucket is out of debt, then takes its bytes out
+ * of it, which may put it into debt again for the next send to wait off. A TCP socket is also
+ * handed the rate with SO_MAX_PACING_RATE, which the kernel's own TCP pacing honours: the
+ * packets of one send leave spaced out, so the sends can be PACE_KERNEL_SLICE_US long. Where
+ * the kernel does not pace (unix: sockets, UDP without the fq qdisc, old kernels) the timer
+ * here is all there is, and a send is kept to PACE_SLICE_US worth of data.
+ *
+ * Every socket that sends is a flow of its own. Flows that wait at the same time are served by
+ * start-time fair queuing: a flow's virtual start time advances by the bytes it sent divided
+ * by its weight, and the waiting flow furthest behind goes next. A flow coming back from idle
+ * starts at the current virtual time, so having been quiet earns it nothing. With ",cap" every
+ * flow also has a bucket of its own at that rate; a flow held back by its cap lets the others
+ * go first, so the total rate is used whenever any flow can take it.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. man 7 socket (SO_MAX_PACING_RATE), man 8 tc-fq
+ * 	       2. P. Goyal, H. M. Vin, H. Cheng, "Start-time Fair Queuing: A Scheduling Algorithm
+ * 		  for Integrated Services Packet Switching Networks", SIGCOMM 1996
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "pace.h"
+
+/**
+ * One socket that sends
+ **/
+typedef struct pace_flow {
+    int fd;
+    int kernel;					// the kernel spreads its packets (SO_MAX_PACING_RATE)
+    int waiting;				// inside paceWait()
+    double weight;
+    double vstart;				// virtual start time of its next send
+    double tokens;				// its own bucket under a cap, bytes; negative while in debt
+    uint64_t filled;				// when 'tokens' was last filled
+    size_t slice;				// largest send
+} pace_flow_t;
+
+static uint64_t paceRate = PACE_OFF;		// -P, bytes per second of all flows together
+static uint64_t flowRate = PACE_OFF;		// -P ,cap, bytes per second of each flow
+static double tokens;				// the shared bucket, bytes; negative while in debt
+static double burst;				// the most the shared bucket holds
+static uint64_t filled;				// when 'tokens' was last filled
+static double vclock;				// virtual start time of the last send let out
+static pace_flow_t flows[PACE_MAX_FLOWS];
+static int nFlows;
+static pthread_mutex_t paceLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t paceTurn;			// a send was let out, or a weight changed
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Return:
+ * 	bytes 'rate' moves in 'us' microseconds, within the slice bounds
+ **/
+static size_t sliceOf(uint64_t rate, long us) {
+
+    double bytes = (double) rate * us / 1000000;
+
+    if (bytes < PACE_MIN_SLICE)
+	return PACE_MIN_SLICE;
+    if (bytes > PACE_MAX_SLICE)
+	return PACE_MAX_SLICE;
+    return (size_t) bytes;
+}
+
+/**
+ * Ask the kernel to pace IP socket 'fd' at 'rate' as well.
+ *
+ * Return:
+ * 	non-zero if the kernel paces 'fd' whatever the qdisc, i.e. it is TCP
+ **/
+static int kernelPacing(int fd, uint64_t rate) {
+
+    unsigned int r = (rate > UINT_MAX) ? UINT_MAX : rate;	// the 32-bit form is the one every kernel takes
+    int domain, type;
+    socklen_t len = sizeof(int);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0 || (domain != AF_INET && domain != AF_INET6))
+	return 0;
+    len = sizeof(int);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0)
+	return 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &r, sizeof(r)) < 0)
+	return 0;
+    return type == SOCK_STREAM;			// UDP is only paced by fq, which may not be the qdisc
+}
+
+/**
+ * Find the flow of socket 'fd', setting up a new one the first time; paceLock must be held.
+ *
+ * Return:
+ * 	the flow
+ **/
+static pace_flow_t *flowFor(int fd) {
+
+    pace_flow_t *f = NULL;
+    uint64_t rate = (flowRate != PACE_OFF) ? flowRate : paceRate;
+    int i;
+
+    for (i = 0; i < nFlows; i++)
+	if (flows[i].fd == fd)
+	    return &flows[i];
+
+    if (nFlows < PACE_MAX_FLOWS)
+	f = &flows[nFlows++];
+    else {
+	// a full table has more flows than threads to wait in them: take over the one furthest behind
+	for (i = 0; i < nFlows; i++)
+	    if (!flows[i].waiting && (f == NULL || flows[i].vstart < f->vstart))
+		f = &flows[i];
+    }
+
+    f->fd = fd;
+    f->kernel = kernelPacing(fd, rate);
+    f->waiting = 0;
+    f->weight = 1;
+    f->vstart = vclock;
+    f->slice = sliceOf(rate, f->kernel ? PACE_KERNEL_SLICE_US : PACE_SLICE_US);
+    f->tokens = f->slice;
+    f->filled = nowNs();
+    return f;
+}
+
+/**
+ * Return:
+ * 	bytes in the bucket of flow 'f' at time 'now'; 0 without a cap
+ **/
+static double flowTokens(const pace_flow_t *f, uint64_t now) {
+
+    double t;
+
+    if (flowRate == PACE_OFF)
+	return 0;
+    t = f->tokens + (double) flowRate * (now - f->filled) / 1e9;
+    return (t > f->slice) ? f->slice : t;
+}
+
+void paceInit(uint64_t rate, uint64_t flowCap) {
+
+    pthread_condattr_t condAttr;
+
+    paceRate = rate;
+    flowRate = (flowCap < rate) ? flowCap : PACE_OFF;	// a cap above the total changes nothing
+    if (paceRate == PACE_OFF)
+	return;
+
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&paceTurn, &condAttr);
+    pthread_condattr_destroy(&condAttr);
+
+    burst = sliceOf(paceRate, PACE_SLICE_US);
+    tokens = burst;
+    filled = nowNs();
+}
+
+long long paceParseRate(const char *text) {
+
+    char *end;
+    long long rate;
+
+    errno = 0;
+    rate = strtoll(text, &end, 10);
+    if (end == text || rate <= 0 || errno == ERANGE || rate > LLONG_MAX / (1024 * 1024 * 1024))
+	return -1;
+    if (*end == 'k' || *end == 'K')
+	rate *= 1024, end++;
+    else if (*end == 'm' || *end == 'M')
+	rate *= 1024 * 1024, end++;
+    else if (*end == 'g' || *end == 'G')
+	rate *= 1024 * 1024 * 1024, end++;
+
+    return (*end == '\0') ? rate : -1;
+}
+
+size_t paceSlice(int fd, size_t want) {
+
+    size_t slice;
+
+    if (paceRate == PACE_OFF)
+	return want;
+
+    pthread_mutex_lock(&paceLock);
+    slice = flowFor(fd)->slice;
+    pthread_mutex_unlock(&paceLock);
+    return (want < slice) ? want : slice;
+}
+
+void paceWait(int fd, size_t bytes) {
+
+    pace_flow_t *f, *next;
+    struct timespec until;
+    uint64_t now, due;
+    double own;
+    int i;
+
+    if (paceRate == PACE_OFF || bytes == 0)
+	return;
+
+    pthread_mutex_lock(&paceLock);
+    f = flowFor(fd);
+    if (f->vstart < vclock)			// back from idle
+	f->vstart = vclock;
+    f->waiting = 1;
+
+    while (1) {
+	now = nowNs();
+	tokens += (double) paceRate * (now - filled) / 1e9;
+	if (tokens > burst)
+	    tokens = burst;
+	filled = now;
+
+	// the waiting flow furthest behind among those their cap lets send
+	next = NULL;
+	for (i = 0; i < nFlows; i++)
+	    if (flows[i].waiting && flowTokens(&flows[i], now) >= 0 && (next == NULL || flows[i].vstart < next->vstart))
+		next = &flows[i];
+
+	if ( (own = flowTokens(f, now)) < 0 )
+	    due = now + (uint64_t) (-own * 1e9 / flowRate) + 1;
+	else if (next != f)
+	    due = 0;				// wait for the flows ahead to have their turn
+	else if (tokens < 0)
+	    due = now + (uint64_t) (-tokens * 1e9 / paceRate) + 1;
+	else
+	    break;
+
+	if (due == 0)
+	    pthread_cond_wait(&paceTurn, &paceLock);
+	else {
+	    until.tv_sec = due / 1000000000;
+	    until.tv_nsec = due % 1000000000;
+	    pthread_cond_timedwait(&paceTurn, &paceLock, &until);
+	}
+    }
+
+    f->waiting = 0;
+    tokens -= bytes;
+    if (flowRate != PACE_OFF) {
+	f->tokens = own - bytes;
+	f->filled = now;
+    }
+    vclock = f->vstart;
+    f->vstart += bytes / f->weight;
+    pthread_cond_broadcast(&paceTurn);
+    pthread_mutex_unlock(&paceLock);
+}
+
+void paceWeight(int fd, double weight) {
+
+    if (paceRate == PACE_OFF || weight <= 0)
+	return;
+
+    pthread_mutex_lock(&paceLock);
+    flowFor(fd)->weight = weight;
+    pthread_cond_broadcast(&paceTurn);
+    pthread_mutex_unlock(&paceLock);
+}
@@ -0,0 +1,62 @@
+/*
+ * header file for send pacing and the bandwidth share of concurrent connections (-P)
+ */
+
+#ifndef PACE_H_
+#define PACE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PACE_OFF 0				// -P rate meaning "send as fast as the socket takes it"
+
+#define PACE_SLICE_US 2000			// a send covers this much time at the paced rate when only we pace
+#define PACE_KERNEL_SLICE_US 20000		// and this much when the kernel spreads the packets (SO_MAX_PACING_RATE)
+#define PACE_MIN_SLICE 4096			// smallest send while pacing, however low the rate
+#define PACE_MAX_SLICE (1024 * 1024)		// largest send while pacing, however high the rate
+#define PACE_MAX_FLOWS 128			// connections sharing the rate at one time, stripes and all
+
+/**
+ * Set the process-wide pacing: all connections together send at most 'rate' bytes per second,
+ * each one at most 'flowCap' of them (PACE_OFF for no cap of its own). A 'rate' of PACE_OFF
+ * turns pacing off.
+ *
+ * Return:
+ * 	void
+ **/
+void paceInit(uint64_t rate, uint64_t flowCap);
+
+/**
+ * Parse a rate given on the command line: bytes per second with an optional K/M/G suffix.
+ *
+ * Return:
+ * 	the rate in bytes per second, or -1 if 'text' is not a rate
+ **/
+long long paceParseRate(const char *text);
+
+/**
+ * Bytes to hand to one send on socket 'fd' out of the 'want' that are ready.
+ *
+ * Return:
+ * 	'want', or less while pacing
+ **/
+size_t paceSlice(int fd, size_t want);
+
+/**
+ * Wait until 'bytes' more may go out on socket 'fd', then charge them to it. Connections that
+ * wait at the same time take their turns in proportion to their weights.
+ *
+ * Return:
+ * 	void
+ **/
+void paceWait(int fd, size_t bytes);
+
+/**
+ * Give socket 'fd' 'weight' times the share of a connection with weight 1, the default.
+ *
+ * Return:
+ * 	void
+ **/
+void paceWeight(int fd, double weight);
+
+#endif
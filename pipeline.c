@@ -0,0 +1,378 @@
+/*
+ * Pipelined framed send path for large files.
+ *
+ * frameSendData() reads a chunk, MACs it, writes it and only then reads the next one, so the
+ * disk, the CPU and the network take turns. Here each of them gets its own thread:
+ *
+ * 	reader (pread) --> [packers (compress)] --> hasher (frameSeal: frame header, HMAC or AES-GCM) --> sender (writev)
+ *
+ * The stages share a ring of PIPELINE_SLOTS pooled chunk buffers. Every slot passes through
+ * the stages in ring order, so each hand-off is a single-producer/single-consumer queue and
+ * needs nothing more than one counter per stage: the number of slots it has handed on. Only
+ * the owning thread writes its counter; the next stage reads it, and the reader also reads
+ * the sender's counter to know which slots are free again. A stage that runs dry spins for a
+ * moment and then sleeps in futex() on the counter it waits for, so an idle stage costs no
+ * CPU while the socket is the bottleneck.
+ *
+ * With NCP_F_COMPRESS the chunks are compressed between reading and sealing, at high levels
+ * by several packer threads (see compress.c). Packer i of n takes the slots i, i + n, i + 2n,
+ * ... and counts them in its own counter, so each packer still has a single consumer: the
+ * hasher, which picks the slots up in ring order from the packer that owns them. The reader
+ * ends the file with one end marker per packer.
+ *
+ * With NCP_F_GCM the hasher encrypts each chunk in its slot, so encryption overlaps reading
+ * and the socket just as the MACs do, and the sending thread only ever writes.
+ *
+ * Without NCP_F_HMAC, NCP_F_GCM and compression sealing a chunk only writes its 8-byte header,
+ * so the reader does it itself and no hashing thread is started.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. man 2 futex
+ * 	       2. M. Thompson et al., "Disruptor: High performance alternative to bounded queues", 2011
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>			// for INT_MAX
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>			// for struct iovec
+#include <sys/syscall.h>		// for SYS_futex
+#include <linux/futex.h>
+
+#include "proto.h"
+#include "frame.h"
+#include "pipeline.h"
+#include "transfer.h"
+#include "stats.h"			// telemetry for -v
+#include "tune.h"			// chunk sizing
+#include "compress.h"			// packer stage for -z
+
+#define PIPELINE_SPINS 256			// polls of an empty queue before sleeping on it
+#define PIPELINE_NAP_NS 10000000		// upper bound of one sleep, so a failed stage is noticed
+
+/**
+ * One chunk buffer of the ring, with the frame header and MAC that go out around it
+ **/
+typedef struct slot {
+    unsigned char chdr[NCP_CHUNK_HDR_LEN];
+    unsigned char mac[NCP_MAC_LEN];		// MAC, or the shorter AES-GCM tag
+    unsigned char *data;			// NCP_MAX_CHUNK bytes of the pool
+    uint32_t len;				// payload bytes; 0 marks the end of the file
+    unsigned char *zdata;			// NCP_MAX_CHUNK bytes for the compressed payload, with -z
+    uint32_t zlen;				// compressed payload bytes, 0 if the chunk goes out raw
+    unsigned char *out;				// payload as sent: 'data' or 'zdata'
+    uint32_t outLen;
+} slot_t;
+
+/**
+ * Progress of one stage: the slots it has handed on to the next one
+ **/
+typedef struct stage {
+    uint32_t done;				// written by the stage's own thread only
+    uint32_t sleeping;				// set while a later stage sleeps on 'done'
+} stage_t;
+
+struct pipeline;
+
+/**
+ * One compressing thread
+ **/
+typedef struct packer {
+    struct pipeline *p;
+    uint32_t first;				// its first slot; it takes every nPackers-th from there
+    compress_state_t c;
+    stage_t packed;
+    pthread_t thread;
+} packer_t;
+
+typedef struct pipeline {
+    frame_ctx_t *ctx;
+    int filefd;
+    off_t offset, count;
+    size_t chunk;				// payload bytes read per slot
+    int hashStage;				// a separate thread seals the chunks
+    int nPackers;				// compressing threads, 0 without -z
+    slot_t slots[PIPELINE_SLOTS];
+    stage_t read, sealed, sent;
+    packer_t packers[COMPRESS_MAX_THREADS];
+    int failed;					// some stage gave up, everyone stops
+    int error;					// errno of the first failure
+} pipeline_t;
+
+/**
+ * Hand one more slot on from stage 's', waking the stages that sleep on it.
+ **/
+static void advance(stage_t *s) {
+    __atomic_store_n(&s->done, s->done + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&s->sleeping, 0, __ATOMIC_SEQ_CST))
+	syscall(SYS_futex, &s->done, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Stop every stage, remembering the first error.
+ **/
+static void fail(pipeline_t *p, int error) {
+
+    int expected = 0;
+
+    if (__atomic_compare_exchange_n(&p->failed, &expected, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	p->error = error;
+    // sleepers also wake up on their own after PIPELINE_NAP_NS, this only makes it quicker
+    syscall(SYS_futex, &p->read.done, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    syscall(SYS_futex, &p->sealed.done, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    syscall(SYS_futex, &p->sent.done, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Wait until stage 's' has handed on more than 'value' slots.
+ *
+ * Return:
+ * 	0 once it has, -1 if the pipeline failed meanwhile
+ **/
+static int waitPast(pipeline_t *p, stage_t *s, uint32_t value) {
+
+    struct timespec nap = { 0, PIPELINE_NAP_NS };
+    uint32_t now;
+    int spins = 0;
+
+    // the counters wrap around, so "more than" is decided on their difference
+    while ( (int32_t) ((now = __atomic_load_n(&s->done, __ATOMIC_ACQUIRE)) - value) <= 0 ) {
+	if (__atomic_load_n(&p->failed, __ATOMIC_ACQUIRE))
+	    return -1;
+	if (++spins < PIPELINE_SPINS)
+	    continue;
+	// announce the sleep before checking once more, so a hand-off in between is not missed
+	__atomic_store_n(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->done, __ATOMIC_SEQ_CST) == now)
+	    syscall(SYS_futex, &s->done, FUTEX_WAIT_PRIVATE, now, &nap, NULL, 0);
+    }
+    return __atomic_load_n(&p->failed, __ATOMIC_ACQUIRE) ? -1 : 0;
+}
+
+/**
+ * Build the frame of 'slot' from its compressed payload if it has one, its raw one otherwise.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int sealSlot(pipeline_t *p, slot_t *slot) {
+
+    uint8_t type = (slot->zlen > 0) ? NCP_CHUNK_ZDATA : NCP_CHUNK_DATA;
+
+    slot->out = (slot->zlen > 0) ? slot->zdata : slot->data;
+    slot->outLen = (slot->zlen > 0) ? slot->zlen : slot->len;
+    return frameSeal(p->ctx, type, slot->out, slot->outLen, slot->chdr, slot->mac);
+}
+
+static void *readerThread(void *arg) {
+
+    pipeline_t *p = (pipeline_t *) arg;
+    slot_t *slot;
+    off_t total = 0;
+    size_t want;
+    uint64_t start;
+    ssize_t n;
+    int ends = 0;				// end markers written, one for each packer (or the hasher)
+    int needEnds = (p->nPackers > 0) ? p->nPackers : 1;
+
+    while (ends < needEnds) {
+	// a slot is free again once the sender is done with it
+	if (waitPast(p, &p->sent, p->read.done - PIPELINE_SLOTS) < 0)
+	    return NULL;
+	slot = &p->slots[p->read.done % PIPELINE_SLOTS];
+
+	want = (p->chunk < (size_t) (p->count - total)) ? p->chunk : (size_t) (p->count - total);
+	n = 0;
+	if (want > 0 && ends == 0) {
+	    start = statsStart();
+	    n = pread(p->filefd, slot->data, want, p->offset + total);
+	    statsIo(STATS_DISK, start, want, n);
+	    if (n < 0) {
+		if (errno == EINTR)
+		    continue;
+		fail(p, errno);
+		return NULL;
+	    }
+	}
+	slot->len = n;				// 0 once the range is done or the file shrank
+	slot->zlen = 0;
+	if (!p->hashStage && n > 0 && sealSlot(p, slot) < 0) {
+	    fail(p, EIO);
+	    return NULL;
+	}
+
+	advance(&p->read);
+	if (!p->hashStage)
+	    advance(&p->sealed);
+	if (n == 0)
+	    ends++;
+	total += n;
+    }
+    return NULL;
+}
+
+static void *packerThread(void *arg) {
+
+    packer_t *w = (packer_t *) arg;
+    pipeline_t *p = w->p;
+    slot_t *slot;
+    uint32_t k, len;
+
+    for (k = w->first; ; k += p->nPackers) {
+	if (waitPast(p, &p->read, k) < 0)
+	    return NULL;
+	slot = &p->slots[k % PIPELINE_SLOTS];
+	len = slot->len;			// once handed on, the slot may be sent and refilled at any moment
+	if (len > 0)
+	    slot->zlen = compressChunk(&w->c, slot->data, len, slot->zdata);
+	advance(&w->packed);
+	if (len == 0)
+	    return NULL;
+    }
+}
+
+static void *hasherThread(void *arg) {
+
+    pipeline_t *p = (pipeline_t *) arg;
+    slot_t *slot;
+    stage_t *from;
+    uint32_t k, len;
+
+    for (k = 0; ; k++) {
+	// slot k comes from the reader, or from the packer that owns it
+	if (p->nPackers > 0) {
+	    from = &p->packers[k % p->nPackers].packed;
+	    if (waitPast(p, from, k / p->nPackers) < 0)
+		return NULL;
+	} else if (waitPast(p, &p->read, k) < 0)
+	    return NULL;
+	slot = &p->slots[k % PIPELINE_SLOTS];
+	len = slot->len;			// once handed on, the slot may be sent and refilled at any moment
+	if (len > 0 && sealSlot(p, slot) < 0) {
+	    fail(p, EIO);
+	    return NULL;
+	}
+	advance(&p->sealed);
+	if (len == 0)
+	    return NULL;
+    }
+}
+
+off_t pipelineSendData(frame_ctx_t *ctx, int filefd, off_t offset, off_t count) {
+
+    pipeline_t *p;
+    unsigned char *pool;
+    pthread_t reader, hasher;
+    struct iovec iov[3];
+    slot_t *slot;
+    tune_state_t tune;
+    off_t total = 0;
+    size_t tagLen = frameTagLen(ctx);
+    int i, iovcnt = (tagLen > 0) ? 3 : 2, joinHasher = 0, nPackers, buffers;
+
+    // an encrypted stream sends its salt before any chunk is sealed
+    if (frameStart(ctx) < 0)
+	return -1;
+
+    nPackers = (ctx->flags & NCP_F_COMPRESS) ? compressThreads() : 0;
+    buffers = (nPackers > 0) ? 2 : 1;		// raw and compressed payload
+    p = calloc(1, sizeof(pipeline_t));
+    pool = malloc((size_t) buffers * PIPELINE_SLOTS * NCP_MAX_CHUNK);
+    if (p == NULL || pool == NULL) {
+	free(p);
+	free(pool);
+	return -1;
+    }
+
+    tuneBegin(&tune, ctx->fd, 1);
+    p->ctx = ctx;
+    p->filefd = filefd;
+    p->offset = offset;
+    p->count = count;
+    p->chunk = (tune.chunk < NCP_MAX_CHUNK) ? tune.chunk : NCP_MAX_CHUNK;	// a chunk frame holds NCP_MAX_CHUNK at most
+    p->hashStage = (ctx->flags & (NCP_F_HMAC | NCP_F_GCM)) || nPackers > 0;
+    for (i = 0; i < PIPELINE_SLOTS; i++) {
+	p->slots[i].data = pool + (size_t) i * NCP_MAX_CHUNK;
+	if (nPackers > 0)
+	    p->slots[i].zdata = pool + (size_t) (PIPELINE_SLOTS + i) * NCP_MAX_CHUNK;
+    }
+    for (i = 0; i < nPackers; i++) {
+	p->packers[i].p = p;
+	p->packers[i].first = i;
+	if (compressBegin(&p->packers[i].c) < 0)
+	    break;
+    }
+    if (i < nPackers) {
+	while (--i >= 0)
+	    compressEnd(&p->packers[i].c);
+	free(pool);
+	free(p);
+	return -1;
+    }
+    p->nPackers = nPackers;
+
+    if (pthread_create(&reader, NULL, readerThread, p) != 0) {
+	for (i = 0; i < nPackers; i++)
+	    compressEnd(&p->packers[i].c);
+	free(pool);
+	free(p);
+	return -1;
+    }
+    for (i = 0; i < nPackers; i++)
+	if (pthread_create(&p->packers[i].thread, NULL, packerThread, &p->packers[i]) != 0)
+	    break;
+    if (i < nPackers) {
+	fail(p, EAGAIN);
+	nPackers = i;				// only those are joined
+    }
+    if (p->hashStage) {
+	if (pthread_create(&hasher, NULL, hasherThread, p) == 0)
+	    joinHasher = 1;
+	else
+	    fail(p, EAGAIN);
+    }
+
+    // this thread is the sender
+    while (1) {
+	if (waitPast(p, &p->sealed, p->sent.done) < 0)
+	    break;
+	slot = &p->slots[p->sent.done % PIPELINE_SLOTS];
+	if (slot->len == 0)
+	    break;
+	iov[0].iov_base = slot->chdr;
+	iov[0].iov_len = NCP_CHUNK_HDR_LEN;
+	iov[1].iov_base = slot->out;
+	iov[1].iov_len = slot->outLen;
+	iov[2].iov_base = slot->mac;
+	iov[2].iov_len = tagLen;
+	if (writevAll(ctx->fd, iov, iovcnt) < 0) {
+	    fail(p, errno);
+	    break;
+	}
+	total += slot->len;
+	tuneUpdate(&tune, slot->len);
+	advance(&p->sent);
+    }
+
+    pthread_join(reader, NULL);
+    for (i = 0; i < nPackers; i++)
+	pthread_join(p->packers[i].thread, NULL);
+    if (joinHasher)
+	pthread_join(hasher, NULL);
+    for (i = 0; i < p->nPackers; i++)
+	compressEnd(&p->packers[i].c);
+
+    if (p->failed) {
+	errno = p->error;
+	total = -1;
+    }
+    free(pool);
+    free(p);
+    return total;
+}
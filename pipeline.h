@@ -0,0 +1,26 @@
+/*
+ * header file for the pipelined (reader / hasher / sender threads) framed send path
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <sys/types.h>
+
+#include "frame.h"
+
+#define PIPELINE_SLOTS 16			// chunk buffers in the ring shared by the stages
+#define PIPELINE_MIN_BYTES (1024 * 1024)	// smaller files are not worth starting threads for
+
+/**
+ * Send 'count' bytes of file 'filefd' starting at 'offset' as data chunks on 'ctx', without a
+ * trailer, like frameSendData(). A reader thread fills the chunk buffers from the file, a
+ * hashing thread seals them (MACs with NCP_F_HMAC) and the calling thread writes them to the
+ * socket, so the disk, a core for the MACs and the network all work at the same time.
+ *
+ * Return:
+ * 	number of payload bytes sent (less than 'count' if the file is shorter), or -1 on error
+ **/
+off_t pipelineSendData(frame_ctx_t *ctx, int filefd, off_t offset, off_t count);
+
+#endif
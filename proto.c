@@ -0,0 +1,103 @@
+/*
+ * Encoding and decoding of the netcat_part transfer header (see proto.h).
+ *
+ * The header is serialized field by field into a byte buffer rather than written as a
+ * struct, so padding and host byte order never leak onto the wire.
+ *
+ * username: abdpatel@indiana.edu
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "proto.h"
+#include "transfer.h"			// for readAll(), writeAll()
+
+/**
+ * Encode 'hdr' into its NCP_HDR_LEN-byte wire form.
+ *
+ * Return:
+ * 	void, but 'wire' will have the result
+ **/
+void encodeHeader(const ncp_hdr_t *hdr, unsigned char *wire) {
+
+    put32(wire, NCP_MAGIC);
+    put32(wire + 4, hdr->flags);
+    put32(wire + 8, hdr->stripe);
+    put32(wire + 12, hdr->nstripes);
+    put64(wire + 16, hdr->offset);
+    put64(wire + 24, hdr->length);
+    put64(wire + 32, hdr->total);
+}
+
+/**
+ * Encode 'hdr' and write it to 'fd'.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int sendHeader(int fd, const ncp_hdr_t *hdr) {
+
+    unsigned char wire[NCP_HDR_LEN];
+
+    encodeHeader(hdr, wire);
+    return (writeAll(fd, wire, NCP_HDR_LEN) == NCP_HDR_LEN) ? 0 : -1;
+}
+
+int decodeHeader(const unsigned char *wire, ncp_hdr_t *hdr) {
+
+    hdr->magic = get32(wire);
+    hdr->flags = get32(wire + 4);
+    hdr->stripe = get32(wire + 8);
+    hdr->nstripes = get32(wire + 12);
+    hdr->offset = get64(wire + 16);
+    hdr->length = get64(wire + 24);
+    hdr->total = get64(wire + 32);
+
+    if (hdr->magic != NCP_MAGIC) {
+	errno = EPROTO;
+	return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read and decode a header from 'fd', checking its magic number.
+ *
+ * Return:
+ * 	0 on success, -1 on error or bad magic
+ **/
+int recvHeader(int fd, ncp_hdr_t *hdr) {
+
+    unsigned char wire[NCP_HDR_LEN];
+
+    if (readAll(fd, wire, NCP_HDR_LEN) != NCP_HDR_LEN)
+	return -1;
+    return decodeHeader(wire, hdr);
+}
+
+/**
+ * Send / receive a single 64-bit offset in network byte order.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int sendOffset(int fd, uint64_t offset) {
+
+    unsigned char wire[8];
+
+    put64(wire, offset);
+    return (writeAll(fd, wire, sizeof(wire)) == sizeof(wire)) ? 0 : -1;
+}
+
+int recvOffset(int fd, uint64_t *offset) {
+
+    unsigned char wire[8];
+
+    if (readAll(fd, wire, sizeof(wire)) != sizeof(wire))
+	return -1;
+    *offset = get64(wire);
+    return 0;
+}
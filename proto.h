@@ -0,0 +1,117 @@
+/*
+ * header file for the netcat_part wire protocol
+ *
+ * Every transfer starts with a fixed-size header so the server knows what follows; a plain
+ * transfer announces itself with no NCP_F_* bits set and its raw payload follows. The server
+ * never guesses the mode from the payload, so a file that happens to start with NCP_MAGIC is
+ * just data. (Only the stdin/stdout relay, -R, is headerless on both ends.)
+ */
+
+#ifndef PROTO_H_
+#define PROTO_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <arpa/inet.h>			// for htonl(), ntohl()
+
+#define NCP_MAGIC 0x4e435031			// "NCP1"
+#define NCP_HDR_LEN 40				// encoded header size on the wire
+
+#define NCP_F_STRIPE 0x0001			// payload is one stripe of a file sent over several connections
+#define NCP_F_FRAMED 0x0002			// payload travels as chunk frames (see frame.h) instead of raw bytes
+#define NCP_F_HMAC 0x0004			// every chunk frame and the trailer carry an HMAC
+#define NCP_F_RESUME 0x0008			// server answers with the bytes it already holds, payload starts there
+#define NCP_F_BATCH 0x0010			// many files over one connection, each framed by an NCP_CHUNK_FILE chunk
+#define NCP_F_DELTA 0x0020			// server first answers with block signatures of its copy, payload is a delta against it
+#define NCP_F_MERKLE 0x0040			// a Merkle-tree digest follows the payload, server answers with differing ranges
+#define NCP_F_COMPRESS 0x0080			// data chunks may travel compressed as NCP_CHUNK_ZDATA (see compress.c)
+#define NCP_F_GCM 0x0100			// chunk frames are encrypted and authenticated with AES-128-GCM
+#define NCP_F_SPARSE 0x0200			// holes of the file travel as NCP_CHUNK_HOLE instead of zeros
+#define NCP_F_DEDUP 0x0400			// chunk hashes first, server answers which it lacks, only those chunks follow
+
+#define MAX_STRIPES 64				// upper bound for -s
+
+/**
+ * Transfer header; all fields travel in network byte order
+ **/
+typedef struct ncp_hdr {
+    uint32_t magic;				// NCP_MAGIC
+    uint32_t flags;				// NCP_F_* bits describing the transfer
+    uint32_t stripe;				// index of this stripe, 0 .. nstripes-1
+    uint32_t nstripes;				// number of connections carrying the file
+    uint64_t offset;				// where the payload goes in the output file
+    uint64_t length;				// number of payload bytes that follow the header
+    uint64_t total;				// size of the complete output file
+} ncp_hdr_t;
+
+/**
+ * Store a 32-bit / 64-bit value at 'p' in network byte order; every wire format of
+ * netcat_part (header, chunk frames, batch records, signatures, digests, datagrams) uses these
+ **/
+static inline void put32(unsigned char *p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static inline void put64(unsigned char *p, uint64_t v) {
+    put32(p, (uint32_t) (v >> 32));
+    put32(p + 4, (uint32_t) v);
+}
+
+/**
+ * Load a 32-bit / 64-bit value in network byte order from 'p'
+ **/
+static inline uint32_t get32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+static inline uint64_t get64(const unsigned char *p) {
+    return ((uint64_t) get32(p) << 32) | get32(p + 4);
+}
+
+/**
+ * Encode 'hdr' into its NCP_HDR_LEN-byte wire form.
+ *
+ * Return:
+ * 	void, but 'wire' will have the result
+ **/
+void encodeHeader(const ncp_hdr_t *hdr, unsigned char *wire);
+
+/**
+ * Encode 'hdr' and write it to 'fd'.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int sendHeader(int fd, const ncp_hdr_t *hdr);
+
+/**
+ * Read and decode a header from 'fd', checking its magic number.
+ *
+ * Return:
+ * 	0 on success, -1 on error or bad magic
+ **/
+int recvHeader(int fd, ncp_hdr_t *hdr);
+
+/**
+ * Send / receive a single 64-bit offset in network byte order, e.g. the server's answer to
+ * a resumable transfer.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int sendOffset(int fd, uint64_t offset);
+int recvOffset(int fd, uint64_t *offset);
+
+/**
+ * Decode the NCP_HDR_LEN bytes of 'wire' into 'hdr', checking its magic number.
+ *
+ * Return:
+ * 	0 on success, -1 with errno EPROTO on bad magic
+ **/
+int decodeHeader(const unsigned char *wire, ncp_hdr_t *hdr);
+
+#endif
@@ -0,0 +1,257 @@
+/*
+ * Full-duplex relay between standard input/output and a connection (-R), so that netcat_part
+ * can sit in a shell pipeline like netcat does: "tar c dir | netcat_part -R host" on one end,
+ * "netcat_part -l -R host | tar x" on the other, and no temporary file on either side.
+ *
+ * Each direction has a thread of its own, standard input -> socket a helper thread and socket
+ * -> standard output the caller's, so a peer that is busy sending never keeps the other
+ * direction from draining. The bytes are moved with splice(): straight out of a pipe on
+ * standard input into the socket, or out of the socket into a pipe on standard output, and
+ * through a pipe of the relay's own when neither end of a direction is one (a file, a
+ * terminal). Either way the data stays in the kernel. An end that cannot be spliced is served
+ * through a buffer from then on, and bytes already in the relay's pipe are not lost doing so.
+ *
+ * The end of standard input is passed on as a half-close, shutdown(SHUT_WR), and the peer's
+ * half-close closes standard output: the reader downstream sees its EOF while the other
+ * direction goes on, e.g. for a reply to a request that has been sent in full.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. man 2 splice, man 7 pipe ("Pipe capacity")
+ * 	       2. man 2 shutdown
+ */
+
+#define _GNU_SOURCE			// for splice(), pipe2(), F_SETPIPE_SZ
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "relay.h"
+#include "transfer.h"			// writeAll() for the buffered fallback
+#include "stats.h"			// telemetry for -v
+#include "tune.h"			// chunk sizes and socket options
+#include "pace.h"			// -P send pacing
+
+/**
+ * One direction of the relay
+ **/
+typedef struct relay_dir {
+    int infd;
+    int outfd;
+    int inWhere;				// STATS_NET or STATS_DISK side of 'infd' for -v
+    int outWhere;				// the same for 'outfd'
+    int sockfd;					// the connection, whose throughput tunes the chunk size
+    int sending;				// 1 for standard input -> socket
+    int error;					// errno that ended the direction, 0 at EOF
+} relay_dir_t;
+
+/**
+ * Return:
+ * 	non-zero if 'fd' is a pipe or FIFO
+ **/
+static int isPipe(int fd) {
+
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/**
+ * Make room in pipe 'fd' for the largest chunk tuning may pick.
+ *
+ * Return:
+ * 	capacity of the pipe in bytes
+ **/
+static size_t growPipe(int fd) {
+
+    int n;
+
+    fcntl(fd, F_SETPIPE_SZ, (int) tuneBufferSize());	// refused above /proc/sys/fs/pipe-max-size
+    n = fcntl(fd, F_GETPIPE_SZ);
+    return (n > 0) ? (size_t) n : RELAY_PIPE_DEFAULT;
+}
+
+/**
+ * Finish direction 'd' through a user-space buffer once splice() has turned out not to work on
+ * one of its ends. The 'inPipe' bytes stranded in pipe 'pipeRead' go out first.
+ *
+ * Return:
+ * 	0 at the end of the input, -1 on error
+ **/
+static int copyRest(relay_dir_t *d, int pipeRead, size_t inPipe) {
+
+    char *buffer;
+    tune_state_t tune;
+    uint64_t start;
+    size_t want;
+    ssize_t n;
+    int from;
+
+    if ( (buffer = malloc(tuneBufferSize())) == NULL )
+	return -1;
+    tuneBegin(&tune, d->sockfd, d->sending);
+
+    while (1) {
+	from = (inPipe > 0) ? pipeRead : d->infd;
+	want = (inPipe > 0 && inPipe < tune.chunk) ? inPipe : tune.chunk;
+	start = statsStart();
+	n = read(from, buffer, want);
+	if (from == d->infd)
+	    statsIo(d->inWhere, start, want, n);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	if (from == pipeRead)
+	    inPipe -= n;
+
+	if ( (d->outWhere == STATS_NET ? writeAll(d->outfd, buffer, n) : writeFileAll(d->outfd, buffer, n)) < 0 ) {
+	    n = -1;
+	    break;
+	}
+	tuneUpdate(&tune, n);
+    }
+
+    free(buffer);
+    return (n < 0) ? -1 : 0;
+}
+
+/**
+ * Move direction 'd' until the end of its input, with splice() for as long as both of its ends
+ * take it. Sets d->error when it ends on an error.
+ *
+ * Return:
+ * 	void
+ **/
+static void pump(relay_dir_t *d) {
+
+    int pipefd[2] = { -1, -1 };			// the relay's own pipe when neither end is one
+    int direct = isPipe(d->infd) || isPipe(d->outfd);
+    size_t pipeSize, want, inPipe;
+    tune_state_t tune;
+    uint64_t start;
+    ssize_t n;
+
+    d->error = 0;
+    if (direct)
+	pipeSize = growPipe(isPipe(d->infd) ? d->infd : d->outfd);
+    else if (pipe2(pipefd, O_CLOEXEC) == 0)
+	pipeSize = growPipe(pipefd[1]);
+    else {
+	if (copyRest(d, -1, 0) < 0)
+	    d->error = errno;
+	return;
+    }
+    tuneBegin(&tune, d->sockfd, d->sending);
+
+    while (1) {
+	// input -> output when one of them is a pipe, otherwise input -> own pipe
+	want = (tune.chunk < pipeSize) ? tune.chunk : pipeSize;
+	if (direct && d->sending) {
+	    want = paceSlice(d->outfd, want);
+	    paceWait(d->outfd, want);
+	}
+	start = statsStart();
+	n = splice(d->infd, NULL, direct ? d->outfd : pipefd[1], NULL, want, SPLICE_F_MOVE);
+	statsIo(direct ? STATS_NET : d->inWhere, start, want, n);	// a direct splice always has the socket on one end
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if ((errno == EINVAL || errno == ENOSYS) && copyRest(d, -1, 0) == 0)
+		break;				// one of the ends cannot be spliced, the buffer has taken over
+	    d->error = errno;
+	    break;
+	}
+	if (n == 0)				// end of the input
+	    break;
+	tuneUpdate(&tune, n);
+	if (direct)
+	    continue;
+
+	// own pipe -> output, until the pipe is empty again
+	inPipe = n;
+	while (inPipe > 0) {
+	    want = inPipe;
+	    if (d->sending) {
+		want = paceSlice(d->outfd, want);
+		paceWait(d->outfd, want);
+	    }
+	    start = statsStart();
+	    n = splice(pipefd[0], NULL, d->outfd, NULL, want, SPLICE_F_MOVE);
+	    statsIo(d->outWhere, start, want, n);
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n < 0) {
+		if ((errno != EINVAL && errno != ENOSYS) || copyRest(d, pipefd[0], inPipe) < 0)
+		    d->error = errno;
+		goto DONE;
+	    }
+	    inPipe -= n;
+	}
+    }
+
+    DONE:
+    if (pipefd[0] >= 0) {
+	close(pipefd[0]);
+	close(pipefd[1]);
+    }
+}
+
+/**
+ * Standard input -> socket, then pass the end of the input on to the peer.
+ **/
+static void *sendThread(void *arg) {
+
+    relay_dir_t *d = (relay_dir_t *) arg;
+
+    pump(d);
+    shutdown(d->outfd, SHUT_WR);
+    return NULL;
+}
+
+int relayStdio(int sockfd) {
+
+    relay_dir_t out = { STDIN_FILENO, sockfd, STATS_DISK, STATS_NET, sockfd, 1, 0 };
+    relay_dir_t in = { sockfd, STDOUT_FILENO, STATS_NET, STATS_DISK, sockfd, 0, 0 };
+    pthread_t sender;
+
+    // a reader downstream that goes away, or a peer that resets, ends its direction with EPIPE
+    signal(SIGPIPE, SIG_IGN);
+    // whatever the input hands over goes out at once, it may be someone typing
+    tuneLatency(sockfd, 0);
+
+    if (pthread_create(&sender, NULL, sendThread, &out) != 0) {
+	sendThread(&out);			// no thread to spare, one direction after the other
+	pump(&in);
+	close(STDOUT_FILENO);
+	if (in.error == EPIPE)
+	    in.error = 0;
+    } else {
+	pump(&in);
+	close(STDOUT_FILENO);			// the peer is done, the reader downstream gets its EOF now
+	if (in.error == EPIPE)			// or the reader has stopped reading, like "| head" would
+	    in.error = 0;
+
+	/* nothing will come back to a terminal that is still typing, so it is not waited for; a
+	 * pipe or file is sent to its end, the peer only closed its half of the connection */
+	if (in.error != 0 || isatty(STDIN_FILENO)) {
+	    errno = in.error;
+	    return (in.error != 0) ? -1 : 0;
+	}
+	pthread_join(sender, NULL);
+    }
+
+    if (in.error != 0 || out.error != 0) {
+	errno = (in.error != 0) ? in.error : out.error;
+	return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+/*
+ * header file for the stdin/stdout relay (-R)
+ */
+
+#ifndef RELAY_H_
+#define RELAY_H_
+
+#define RELAY_PIPE_DEFAULT 65536		// capacity of a pipe that cannot be resized
+
+/**
+ * Relay standard input to connected socket 'sockfd' and 'sockfd' to standard output at the same
+ * time, moving the bytes with splice() wherever the kernel allows it. The end of standard input
+ * is passed on as a half-close (shutdown(SHUT_WR)) and the peer's half-close closes standard
+ * output, so either side of a pipeline sees its EOF as soon as it is due. Returns once both
+ * directions have ended; a terminal on standard input is not waited for after the peer has
+ * finished sending.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int relayStdio(int sockfd);
+
+#endif
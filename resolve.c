@@ -0,0 +1,293 @@
+/*
+ * Name resolution and connection racing, after RFC 8305 ("Happy Eyeballs Version 2").
+ *
+ * gethostbyname() only knows IPv4, blocks for as long as the resolver takes, and left us with
+ * the first address alone. Here the AAAA and A lookups each get a getaddrinfo() in a thread of
+ * their own, so they run side by side, and the program waits for them against a deadline.
+ * Once one family has answered, the other gets RESOLVE_ANSWER_DELAY_MS more before connecting
+ * starts without it. A lookup still running when the wait ends is left to finish unheeded.
+ * getaddrinfo_a() would do the same, but its helper threads run the resolver on a minimal
+ * stack, which a lookup that goes on to DNS can overflow.
+ *
+ * The addresses are interleaved by family and tried in turn with non-blocking connects: each
+ * attempt has a head start of the attempt delay (-T) before the next one begins, an attempt
+ * that fails hands over at once, and the first connection to come up wins. A dead first
+ * address then costs the attempt delay instead of a full TCP connect timeout, and nothing
+ * waits longer than the -T timeout.
+ *
+ * A server (-l) listens on one address of the name, so its lookups are passive and IPv4 comes
+ * first: a name with both families is served on its IPv4 address, as it was when the name went
+ * through gethostbyname(), and an IPv6-only name or literal on IPv6. "::" takes both families.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. RFC 8305, "Happy Eyeballs Version 2: Better Connectivity Using Concurrency"
+ * 	       2. man 3 getaddrinfo
+ * 	       3. man 2 connect, "EINPROGRESS"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "nc_args_t.h"
+#include "resolve.h"
+#include "tune.h"			// -w socket buffers
+
+#define LOOKUP_RUNNING 1			// 'status' of a lookup without an answer yet; EAI_* codes are negative
+
+/**
+ * One getaddrinfo() of one address family
+ **/
+typedef struct lookup {
+    const char *host;
+    char port[8];
+    int family;
+    int flags;					// AI_PASSIVE for an address to listen on
+    int status;					// LOOKUP_RUNNING, then the getaddrinfo() result
+    struct addrinfo *result;
+} lookup_t;
+
+// never freed: a lookup that is still running when the wait ends writes its answer here later
+static lookup_t lookups[2];			// IPv6 first, then IPv4
+static pthread_mutex_t lookupLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lookupDone;
+
+/**
+ * Return:
+ * 	milliseconds of the monotonic clock
+ **/
+static long long nowMs(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *lookupThread(void *arg) {
+
+    lookup_t *l = (lookup_t *) arg;
+    struct addrinfo hints, *result = NULL;
+    int status;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = l->family;
+    hints.ai_flags = l->flags;
+    hints.ai_socktype = SOCK_STREAM;		// one entry per address; UDP uses the same ones
+    status = getaddrinfo(l->host, l->port, &hints, &result);
+
+    pthread_mutex_lock(&lookupLock);
+    l->result = result;
+    l->status = status;
+    pthread_cond_broadcast(&lookupDone);
+    pthread_mutex_unlock(&lookupLock);
+    return NULL;
+}
+
+/**
+ * Return:
+ * 	non-zero if lookup 'l' has addresses
+ **/
+static int answered(const lookup_t *l) {
+    return l->status == 0;
+}
+
+int resolveHost(const char *host, nc_args_t *nc_args) {
+
+    pthread_condattr_t condAttr;
+    pthread_attr_t attr;
+    pthread_t thread;
+    struct addrinfo *next[2];
+    struct timespec until;
+    long long deadline, first = 0, limit;
+    int i, j, running = 0, status;
+    int order[2] = { 0, 1 };			// lookups in the order their addresses are used
+
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&lookupDone, &condAttr);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (i = 0; i < 2; i++) {
+	lookups[i].host = host;
+	snprintf(lookups[i].port, sizeof(lookups[i].port), "%u", nc_args->port);
+	lookups[i].family = (i == 0) ? AF_INET6 : AF_INET;
+	lookups[i].flags = nc_args->listen ? AI_PASSIVE : 0;
+	lookups[i].status = LOOKUP_RUNNING;
+	if (pthread_create(&thread, &attr, lookupThread, &lookups[i]) != 0)
+	    lookupThread(&lookups[i]);		// no thread to spare, look it up here
+    }
+    pthread_attr_destroy(&attr);
+
+    deadline = nowMs() + nc_args->connectTimeout;
+    pthread_mutex_lock(&lookupLock);
+    while (lookups[0].status == LOOKUP_RUNNING || lookups[1].status == LOOKUP_RUNNING) {
+	// once one family has addresses, the other only gets a short while to catch up
+	if (first == 0 && (answered(&lookups[0]) || answered(&lookups[1])))
+	    first = nowMs();
+	limit = (first > 0 && first + RESOLVE_ANSWER_DELAY_MS < deadline) ? first + RESOLVE_ANSWER_DELAY_MS : deadline;
+	if (nowMs() >= limit)
+	    break;
+	until.tv_sec = limit / 1000;
+	until.tv_nsec = limit % 1000 * 1000000;
+	pthread_cond_timedwait(&lookupDone, &lookupLock, &until);
+    }
+
+    for (i = 0; i < 2; i++) {
+	if (lookups[i].status == LOOKUP_RUNNING)
+	    running = 1;
+	next[i] = answered(&lookups[i]) ? lookups[i].result : NULL;
+    }
+
+    // interleave the families, IPv6 first; a server binds the first address, which is IPv4 when there is one
+    if (nc_args->listen) {
+	order[0] = 1;
+	order[1] = 0;
+    }
+    nc_args->nServAddrs = 0;
+    while (nc_args->nServAddrs < MAX_SERV_ADDRS && (next[0] != NULL || next[1] != NULL)) {
+	for (j = 0; j < 2 && nc_args->nServAddrs < MAX_SERV_ADDRS; j++) {
+	    i = order[j];
+	    if (next[i] == NULL)
+		continue;
+	    memcpy(&nc_args->servAddrs[nc_args->nServAddrs++], next[i]->ai_addr, next[i]->ai_addrlen);
+	    next[i] = next[i]->ai_next;
+	}
+    }
+
+    // an IPv4 error says more than the IPv6 one, which is mostly "no such address"
+    if (nc_args->nServAddrs > 0)
+	status = 0;
+    else if (running)
+	status = EAI_AGAIN;
+    else
+	status = (lookups[1].status != 0) ? lookups[1].status : lookups[0].status;
+
+    for (i = 0; i < 2; i++)
+	if (answered(&lookups[i]))
+	    freeaddrinfo(lookups[i].result);
+    pthread_mutex_unlock(&lookupLock);
+    return status;
+}
+
+int resolveConnect(nc_args_t *nc_args) {
+
+    struct pollfd attempts[MAX_SERV_ADDRS];
+    struct sockaddr_storage *addr;
+    long long now, deadline, nextStart = 0, wait;
+    int nAttempts = 0, next = 0, winner = -1, error = ECONNREFUSED, soError, fd, i;
+    socklen_t len;
+
+    deadline = nowMs() + nc_args->connectTimeout;
+    while (winner < 0) {
+	if ( (now = nowMs()) >= deadline ) {
+	    error = ETIMEDOUT;
+	    break;
+	}
+
+	// the next address gets its turn once the last attempt had its head start, or when none is left running
+	if (next < nc_args->nServAddrs && (now >= nextStart || nAttempts == 0)) {
+	    addr = &nc_args->servAddrs[next++];
+	    if ( (fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP)) < 0 ) {
+		error = errno;
+		continue;
+	    }
+	    // -w socket buffers must be in place before the handshake negotiates the window scale
+	    tuneSocketBuffers(fd);
+	    if (connect(fd, (struct sockaddr *) addr, resolveAddrLen(addr)) == 0) {
+		winner = fd;
+		break;
+	    }
+	    if (errno != EINPROGRESS) {
+		error = errno;
+		close(fd);
+		continue;
+	    }
+	    attempts[nAttempts].fd = fd;
+	    attempts[nAttempts].events = POLLOUT;
+	    nAttempts++;
+	    nextStart = now + nc_args->attemptDelay;
+	    continue;
+	}
+	if (nAttempts == 0)				// every address has failed
+	    break;
+
+	wait = deadline - now;
+	if (next < nc_args->nServAddrs && nextStart - now < wait)
+	    wait = nextStart - now;
+	if (poll(attempts, nAttempts, (int) wait) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    error = errno;
+	    break;
+	}
+	for (i = 0; i < nAttempts; ) {
+	    if (attempts[i].revents == 0) {
+		i++;
+		continue;
+	    }
+	    len = sizeof(soError);
+	    if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &soError, &len) < 0)
+		soError = errno;
+	    if (soError == 0) {
+		winner = attempts[i].fd;
+		attempts[i] = attempts[--nAttempts];
+		break;
+	    }
+	    error = soError;
+	    close(attempts[i].fd);
+	    attempts[i] = attempts[--nAttempts];
+	    nextStart = now;				// a failed attempt hands over right away
+	}
+    }
+
+    for (i = 0; i < nAttempts; i++)
+	close(attempts[i].fd);
+    if (winner < 0) {
+	errno = error;
+	return -1;
+    }
+    // the transfer code expects a blocking socket
+    fcntl(winner, F_SETFL, fcntl(winner, F_GETFL) & ~O_NONBLOCK);
+    return winner;
+}
+
+int resolveBind(int sockfd, const struct sockaddr_storage *addr) {
+
+    int off = 0;
+
+    // the IPv6 wildcard takes IPv4 clients as well, as v4-mapped addresses
+    if (addr->ss_family == AF_INET6 && IN6_IS_ADDR_UNSPECIFIED(&((const struct sockaddr_in6 *) addr)->sin6_addr))
+	setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    return bind(sockfd, (const struct sockaddr *) addr, resolveAddrLen(addr));
+}
+
+socklen_t resolveAddrLen(const struct sockaddr_storage *addr) {
+    return (addr->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+char *resolveFormat(const struct sockaddr_storage *addr, char *buf, size_t len) {
+
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+
+    if (getnameinfo((const struct sockaddr *) addr, resolveAddrLen(addr), host, sizeof(host), port, sizeof(port),
+		    NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+	snprintf(buf, len, "?");
+    else if (addr->ss_family == AF_INET6)
+	snprintf(buf, len, "[%s]:%s", host, port);
+    else
+	snprintf(buf, len, "%s:%s", host, port);
+    return buf;
+}
@@ -0,0 +1,67 @@
+/*
+ * header file for name resolution and the happy-eyeballs connect (-T)
+ */
+
+#ifndef RESOLVE_H_
+#define RESOLVE_H_
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+#include "nc_args_t.h"
+
+#define RESOLVE_TIMEOUT_MS 10000		// -T default: limit of name resolution and of each connect
+#define RESOLVE_ATTEMPT_DELAY_MS 250		// -T default: head start of a connection attempt over the next one
+#define RESOLVE_MIN_DELAY_MS 10			// shortest attempt delay accepted (RFC 8305, section 5)
+#define RESOLVE_ANSWER_DELAY_MS 50		// wait for the other family once one has answered (RFC 8305, section 3)
+#define RESOLVE_ADDR_STRLEN 64			// "[IPv6 address]:port" with its '\0'
+
+/**
+ * Resolve 'host' into nc_args->servAddrs for port nc_args->port. The IPv6 and IPv4 lookups run
+ * side by side in the background, and neither a slow answer nor a dead name server holds the
+ * program past nc_args->connectTimeout. The addresses are ordered for connecting: IPv6 and
+ * IPv4 alternate, starting with IPv6. For a server (nc_args->listen) the lookups are passive
+ * and IPv4 comes first, so servAddrs[0], the address it binds, keeps the family gethostbyname()
+ * used to give. Called once per run.
+ *
+ * Return:
+ * 	0 on success, or the EAI_* error (EAI_AGAIN on a timeout)
+ **/
+int resolveHost(const char *host, nc_args_t *nc_args);
+
+/**
+ * Connect a TCP socket to the server, racing the addresses of nc_args->servAddrs: a new
+ * attempt starts every nc_args->attemptDelay milliseconds, or at once when one fails, and the
+ * first connection to complete wins; the others are closed. -w socket buffers are set before
+ * each handshake.
+ *
+ * Return:
+ * 	connected, blocking socket descriptor, or -1 on error (ETIMEDOUT after nc_args->connectTimeout,
+ * 	otherwise the error of the last attempt)
+ **/
+int resolveConnect(nc_args_t *nc_args);
+
+/**
+ * Bind 'sockfd' to 'addr'. The IPv6 wildcard "::" is bound dual-stack (IPV6_V6ONLY off), so it
+ * takes IPv4 clients too.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+int resolveBind(int sockfd, const struct sockaddr_storage *addr);
+
+/**
+ * Return:
+ * 	length of the sockaddr_in or sockaddr_in6 held by 'addr'
+ **/
+socklen_t resolveAddrLen(const struct sockaddr_storage *addr);
+
+/**
+ * Write 'addr' as "address:port", or "[address]:port" for IPv6, into 'buf' of 'len' bytes.
+ *
+ * Return:
+ * 	'buf'
+ **/
+char *resolveFormat(const struct sockaddr_storage *addr, char *buf, size_t len);
+
+#endif
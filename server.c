@@ -5,7 +5,8 @@
  * 2. Bind this socket to a port number using bind()
  * 3. Allow the server to listen to incoming client connection request through this TCP welcoming socket using listen()
  * 4. Accept a client connection using accept() on a new socket and do this for as many client requests as needed
- * 5. Read or write data from & to the client via this new socket
+ * 5. Read or write data from & to the client via this new socket (spliced into the output file, see transfer.c;
+ *    with -R relayed to and from standard output and input instead, see relay.c)
  * 6. Close the client connection using close()
  * 
  * username: abdpatel@indiana.edu
@@ -22,16 +23,180 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>			// for open()
+#include <sys/stat.h>			// for fstat()
 
 #include "nc_args_t.h"
-
-#include <openssl/hmac.h>		// need to add -lssl to compile
-#include "shared_key.h"			// make server aware of the shared key
+#include "transfer.h"			// splice receive path
+#include "event_loop.h"			// concurrent server for -k
+#include "proto.h"			// transfer header for non-plain transfers
+#include "stripe.h"			// parallel multi-stream receive
+#include "frame.h"			// chunk frames with streaming HMAC (key from shared_key.h)
+#include "uring.h"			// io_uring backend for -u
+#include "stats.h"			// telemetry for -v
+#include "tune.h"			// buffer sizes and socket options
+#include "batch.h"			// many files over one connection
+#include "delta.h"			// rsync-style delta against the output file
+#include "merkle.h"			// parallel Merkle-tree digest for -M
+#include "output.h"			// preallocated, aligned output writes
+#include "udp.h"			// datagram mode for -U
+#include "local.h"			// unix: and shm: addresses
+#include "resolve.h"			// address lengths of IPv4 and IPv6
+#include "relay.h"			// stdin/stdout relay for -R
+#include "dedup.h"			// content-addressed chunk store for -C
 
 void promptError(char *);		/* written like this here instead of importing header in order to avoid 'multiple
 					 * definition' error */
 
-#define MAXQUEUE 5			// maximum number of pending client connections 
+#define MAXQUEUE MAX_STRIPES		// maximum number of pending client connections; a striped transfer connects all its stripes at once
+#define MAXQUEUE_PERSISTENT SOMAXCONN	// pending connections allowed when serving many clients at once (-k)
+
+/**
+ * Receive a transfer that starts with a protocol header on connection 'sockfd' (accepted on
+ * 'listenfd') and write it to the server's output file.
+ *
+ * Return:
+ * 	number of bytes written to the output file, or -1 on error
+ **/
+static off_t receiveFramed(int listenfd, int sockfd, nc_args_t *nc_args) {
+
+    ncp_hdr_t hdr;
+    frame_ctx_t ctx;
+    output_t out;
+    struct stat outStat;
+    int outfd;
+    off_t total, committed = 0;			// bytes of the output kept from an earlier, interrupted transfer
+    unsigned long files;			// files received by a batch
+
+    if (recvHeader(sockfd, &hdr) < 0)
+	promptError((char *) "ERROR: Server received no valid transfer header (a raw stream is taken with -R)");
+
+    // checked before the output is opened, so a rejected transfer leaves it untouched
+    if (nc_args->authenticate && !(hdr.flags & (NCP_F_HMAC | NCP_F_GCM))) {
+	fprintf(stderr, "Server says: transfer rejected, client did not authenticate its data\n");
+	close(sockfd);
+	errno = EACCES;
+	return -1;
+    }
+    if (nc_args->encrypt && !(hdr.flags & NCP_F_GCM)) {
+	fprintf(stderr, "Server says: transfer rejected, client did not encrypt its data\n");
+	close(sockfd);
+	errno = EACCES;
+	return -1;
+    }
+
+    // with a chunk store the output file is a recipe, which only a dedup transfer knows how to fill
+    if (nc_args->storeDir != NULL && hdr.flags != 0 && !(hdr.flags & NCP_F_DEDUP)) {
+	fprintf(stderr, "Server says: transfer rejected, the chunk store takes plain and dedup (-c) transfers only\n");
+	close(sockfd);
+	errno = EACCES;
+	return -1;
+    }
+    // -C: a plain stream is cut into chunks here, the new ones are stored and the output file gets the recipe
+    if (nc_args->storeDir != NULL && hdr.flags == 0) {
+	total = storeStream(sockfd, nc_args->storeDir, nc_args->serverFilename);
+	statsTcpInfo(sockfd);
+	close(sockfd);
+	return total;
+    }
+    if (hdr.flags & NCP_F_DEDUP) {
+	total = receiveDedup(sockfd, &hdr, nc_args->storeDir, nc_args->serverFilename);
+	if (total < 0 && errno == EBADMSG)
+	    fprintf(stderr, "Server says: dedup transfer rejected, a chunk failed verification\n");
+	statsTcpInfo(sockfd);
+	close(sockfd);
+	return total;
+    }
+    
+    // a batch writes many files, the output file name is taken as their directory
+    if (hdr.flags & NCP_F_BATCH) {
+	total = receiveBatch(sockfd, &hdr, nc_args->serverFilename, &files);
+	if (total < 0 && errno == EBADMSG)
+	    fprintf(stderr, "Server says: batch rejected, a chunk failed verification\n");
+	else if (total >= 0)
+	    printf("Server says: %lu files written to directory '%s'\n", files, nc_args->serverFilename);
+	statsTcpInfo(sockfd);
+	close(sockfd);
+	return total;
+    }
+
+    // a delta is rebuilt from the current output file and replaces it only once it is complete
+    if (hdr.flags & NCP_F_DELTA) {
+	total = receiveDelta(sockfd, &hdr, nc_args->serverFilename);
+	if (total < 0 && errno == EBADMSG)
+	    fprintf(stderr, "Server says: delta rejected, a chunk failed verification\n");
+	statsTcpInfo(sockfd);
+	close(sockfd);
+	return total;
+    }
+
+    // a resumable transfer keeps what is already in the output file, everything else starts afresh
+    if ( (outfd = open(nc_args->serverFilename, O_RDWR | O_CREAT | ((hdr.flags & NCP_F_RESUME) ? 0 : O_TRUNC), 0644)) < 0 )
+	promptError((char *) "ERROR: Could not open output file at server");
+
+    if (hdr.flags & NCP_F_STRIPE) {
+	total = receiveStripes(listenfd, sockfd, &hdr, outfd);	// closes the stripe sockets itself
+	close(outfd);
+	return total;
+    }
+
+    if (hdr.flags & NCP_F_RESUME) {
+	/* only verified chunks are ever written by a framed transfer, so the length of the output is
+	 * the number of bytes the client does not have to send again; a longer file is not ours */
+	if (fstat(outfd, &outStat) < 0)
+	    promptError((char *) "ERROR: Could not stat output file at server");
+	committed = (outStat.st_size <= (off_t) hdr.total) ? outStat.st_size : 0;
+	if (ftruncate(outfd, committed) < 0 || sendOffset(sockfd, committed) < 0)
+	    promptError((char *) "ERROR: Server could not answer the resume request");
+	if (committed > 0)
+	    printf("Server says: resuming '%s' at byte %lld\n", nc_args->serverFilename, (long long) committed);
+    }
+
+    // the size is known now: reserve the rest of the file in one piece, the length grows only with the data;
+    // a sparse file is left to allocate its data extents only
+    if (!(hdr.flags & NCP_F_SPARSE) && hdr.length > (uint64_t) committed
+	&& outputReserve(outfd, committed, hdr.length - committed, 1) < 0)
+	promptError((char *) "ERROR: Server has no room for the output file");
+
+    if (hdr.flags & NCP_F_FRAMED) {
+	if (frameInit(&ctx, sockfd, &hdr) < 0)
+	    promptError((char *) "ERROR: Server could not set up frame verification");
+	total = frameReceiveFile(&ctx, outfd, committed, hdr.length - committed);	// only verified chunks reach the file
+	if (total < 0 && errno == EBADMSG)
+	    fprintf(stderr, "Server says: transfer rejected, chunk %llu failed verification\n", (unsigned long long) ctx.seq);
+	frameFree(&ctx);
+    } else {
+	// raw payload after the header, placed right after the bytes already held; nothing is read
+	// when nothing is left, a count of 0 would mean "up to EOF" to the receive paths
+	total = 0;
+	if (hdr.length > (uint64_t) committed && outputDirect()) {
+	    // -O: through the aligned staging buffer to O_DIRECT, splice() would go through the page cache
+	    if (outputOpen(&out, outfd, committed) == 0) {
+		total = outputReceive(&out, sockfd, hdr.length - committed);
+		if (outputClose(&out) < 0)
+		    total = -1;
+	    } else
+		total = -1;
+	} else if (hdr.length > (uint64_t) committed) {
+	    if (nc_args->uring)
+		total = uringReceive(outfd, sockfd, committed, hdr.length - committed);
+	    if (!nc_args->uring || (total < 0 && (errno == ENOSYS || errno == EINVAL || errno == EPERM || errno == EOPNOTSUPP)))
+		total = spliceReceive(outfd, sockfd, hdr.length - committed, &committed);
+	    if (total < 0 && (errno == EINVAL || errno == ENOSYS))
+		total = bufferedReceive(outfd, sockfd, hdr.length - committed, &committed);
+	}
+    }
+    
+    // the client's digest follows the payload; the whole output is checked, resumed bytes included
+    if ((hdr.flags & NCP_F_MERKLE) && total >= 0 && merkleVerifyReceive(sockfd, outfd, hdr.length) < 0)
+	total = -1;
+
+    statsTcpInfo(sockfd);
+    close(sockfd);
+    close(outfd);
+    return total;
+}
 
 /**
  * This function creates a server to accept communication from client. The server keeps listening for incoming client connections 
@@ -46,27 +211,58 @@ void createServer(nc_args_t *nc_args) {
     int serverSockfd;				// server's client connection-welcoming socket
     int listenStatus;				// variable to indicate whether server is listening on its socket or no
     int newSocketfd;				// new socket on which server may exchange data with client
-    char buffer[BUF_LEN];			// a buffer of size 2048 bytes at max to read or write data
-    ssize_t bytesRead, totalBytesRead = 0;	// bytes read at a time; total number of bytes read by server
-    FILE *fp;					// pointer to file where data will be written into
-    //int i;					// loop iterator variable
-    
-    //unsigned char serverDigest[20];		// buffer that will have the computed message digest at server-side (20 bytes with sha1)
-    //unsigned int serverDigestLen;		// integer that will receive number of bytes of server digest that were filled
+    ssize_t totalBytesRead = 0;			// total number of bytes read by server
+    int reuse = 1;				// SO_REUSEADDR
 
-    struct sockaddr_in clientAddr;		// to fill in all relevant client information
+    struct sockaddr_storage clientAddr;		// to fill in all relevant client information, IPv4 or IPv6
     
-    // create the server's listening TCP stream socket
-    if ( (serverSockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0 )
-	promptError((char *) "Server was unable set up a listening socket");
+    // -U: there is no connection to accept, datagrams from any number of clients go to one file
+    if (nc_args->udp) {
+	if ( (totalBytesRead = udpServe(nc_args)) < 0 )
+	    promptError((char *) "Server encountered error while receiving datagrams");
+	printf("Server says: %lld bytes written to file\n", (long long) totalBytesRead);
+	return;
+    }
     
-    // bind the welcoming socket to a port number
-    if ( bind(serverSockfd, (struct sockaddr *) &nc_args->servAddr, sizeof(nc_args->servAddr) ) < 0 )
-	promptError((char *) "Server encountered error in binding its listening socket");
+    // shm: has no connections either, clients take turns at the server's shared-memory ring
+    if (nc_args->local == LOCAL_SHM) {
+	if ( (totalBytesRead = localServe(nc_args)) < 0 )
+	    promptError((char *) "Server encountered error while draining its shared-memory ring");
+	if (!nc_args->persistent)
+	    printf("Server says: %lld bytes written to file '%s'\n", (long long) totalBytesRead, nc_args->serverFilename);
+	return;
+    }
+    
+    if (nc_args->local == LOCAL_UNIX) {
+	// a Unix domain socket at the given path; everything after accept() is the same as for TCP
+	if ( (serverSockfd = localListen(nc_args, nc_args->persistent ? MAXQUEUE_PERSISTENT : MAXQUEUE)) < 0 )
+	    promptError((char *) "Server was unable to listen on its Unix domain socket");
+    } else {
+	// create the server's listening TCP stream socket
+	if ( (serverSockfd = socket(nc_args->servAddrs[0].ss_family, SOCK_STREAM, IPPROTO_TCP)) < 0 )
+	    promptError((char *) "Server was unable set up a listening socket");
+	
+	// transfers that answer the client (-r, -D, -M) leave the server's end in TIME_WAIT, which must not block a restart
+	setsockopt(serverSockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	
+	// bind the welcoming socket to the first address of the host name (IPv4 if it has one) and the port number
+	if ( resolveBind(serverSockfd, &nc_args->servAddrs[0]) < 0 )
+	    promptError((char *) "Server encountered error in binding its listening socket");
+	
+	// -w socket buffers are inherited by the accepted sockets, and have to be set before listen() to affect the window scale
+	tuneSocketBuffers(serverSockfd);
+	
+	// on successful server socket binding, server should listen to incoming client connections
+	if ( ( listenStatus = listen(serverSockfd, nc_args->persistent ? MAXQUEUE_PERSISTENT : MAXQUEUE) ) < 0 )	// listen to handle a maximum of MAXQUEUE incoming client connections
+	    promptError((char *) "Server encountered error while trying to listen to incoming client connections");
+    }
     
-    // on successful server socket binding, server should listen to incoming client connections
-    if ( ( listenStatus = listen(serverSockfd, MAXQUEUE) ) < 0 )		// listen to handle a maximum of 5 incoming client connections
-	promptError((char *) "Server encountered error while trying to listen to incoming client connections");
+    // in persistent mode, hand the listening socket to the epoll event loop and serve clients concurrently
+    if (nc_args->persistent) {
+	runEventLoop(serverSockfd, nc_args);
+	close(serverSockfd);
+	return;
+    }
     
     // we need to pass a pointer to address length of client, so store client address length first
     unsigned int clientAddrLength = sizeof(clientAddr);
@@ -75,85 +271,23 @@ void createServer(nc_args_t *nc_args) {
     if ( ( newSocketfd = accept( serverSockfd, (struct sockaddr *) &clientAddr, &clientAddrLength ) ) < 0 )
 	promptError((char *) "Server could not set up a new socket to communicate with client");
     
-    /* now, read or write data from or to the new socket for as long as the server can */
-        
-    // the idea is to redirect everything that the server gets, into a file
-    //fp = fopen("tempFile.txt", "w+");			// open a temporary file in read/write mode; file is created if does not exist
-    fp = fopen(nc_args->serverFilename, "w+");
-    //if (fp == NULL)
-	//promptError( (char *) "ERROR: Could not open temporary file");
-    
-    memset(buffer, 0, BUF_LEN);		// flush out buffer by zero-ing it out, before reading or writing data
-    
-    while ( (bytesRead = read(newSocketfd, buffer, BUF_LEN)) != 0 ) {	/* read data from new socket and copy up to BUF_LEN bytes into file at a time;
-									 * read until the amount to be read is 0 i.e. no more data to is available to read */
-		
-	totalBytesRead += bytesRead;		// track number of bytes being written to file
-	
-	fwrite(buffer, sizeof(char), bytesRead, fp);	// pour buffer contents into the temporary file
-	
-	memset(buffer, 0, BUF_LEN);	// flush out buffer after storing buffer contents
+    // -R: the client talks to standard input and output, not to a file; no one else is let in meanwhile
+    if (nc_args->relay) {
+	close(serverSockfd);
+	if (relayStdio(newSocketfd) < 0)
+	    promptError((char *) "ERROR: Relay between client and standard input/output failed");
+	statsTcpInfo(newSocketfd);
+	close(newSocketfd);
+	return;
     }
-        
-    // read everything from temporary file and store it into a string -------------------------------------------------------------
-    /*
-    long fileSize = ftell(fp);		// current last position of fp in the file indicates the file size
-    char *fileContentsStr = (char *) malloc(fileSize * sizeof(char) + 1);	// to read contents of file into a string
-    fileContentsStr[fileSize] = '\0';	// set last character in string as NULL pointer to allow nothing more than the file contents to be written in string
-    rewind(fp);				// set file pointer to the beginning of file
-    fread(fileContentsStr, sizeof(char), fileSize, fp);
-    printf("0. testing: fileContentsStr after file fp read: '%s'\n", fileContentsStr);
-    rewind(fp);				// reset file pointer again to the beginning of file
-    fclose(fp);				// close "tempFile.txt" after reading its contents into a string
-    */
-    // ------------------------------------------------------------------------------------------------------------------
-    
-    /*
-    // split client's message and client's digest into separate strings at the server-side
-    char *delim = ":";			// because ":" was used as delimiter between message and client's digest
-    char *dataStr = strtok(fileContentsStr, delim);
-    printf("testing: dataStr: '%s'\n", dataStr);
-    char *clDigest = strtok(NULL, delim);
-    printf("testing: clDigest: '%s'\n", clDigest);
-    
-    dataStr[strlen(dataStr)] = '\0';
-    clDigest[strlen(clDigest)] = '\0';			// null termination of string
-        
-    // create a server digest using the message retrieved ---------------------------------------------------------------
-    HMAC(EVP_sha1(), key, strlen(key), (unsigned char *) dataStr, strlen(dataStr), serverDigest, &serverDigestLen);
-    
-    // render MAC as 40 characters
-    char mdString[41];			// store final server digest
-    for (i = 0; i < 20; i++)
-	sprintf(&mdString[i*2], "%02x", (unsigned int) serverDigest[i]);
-    mdString[strlen(mdString)] = '\0';	// null termination of string
-    printf("testing: server digest: '%s'\n", mdString);
-    // ------------------------------------------------------------------------------------------------------------------
-    
-    // write client's message received by server to file specified by user
-    fp = fopen(nc_args->serverFilename, "w+");
-    if (fp == NULL)
-	promptError( (char *) "ERROR: Could not write to file at server");
-    fwrite(dataStr, sizeof(char), strlen(dataStr), fp);
-    rewind(fp);			// set file pointer to beginning of file
-    fclose(fp);			// close output file after writing to it
-    
-    // compare server's digest with client's digest to infer message integrity
-    printf("testing: client message: '%s'\n", dataStr);
-    printf("testing: client digest: '%s'\n", clDigest);
-    if (strcmp(mdString, clDigest) == 0)
-	printf("Server Digest matches with Client Digest!\n");
-    else 
-	printf("Server Digest does not match with Client Digest!\n");
-    */  
-    
-    printf("Server says: %ld bytes written to file '%s'\n", totalBytesRead, nc_args->serverFilename);
     
-    rewind(fp);			// set file pointer to beginning of file, else file will not close
-    fclose(fp);			// close file
+    // every client announces its transfer with a header, a plain one included; the payload is never guessed at
+    if ( (totalBytesRead = receiveFramed(serverSockfd, newSocketfd, nc_args)) < 0 )
+	promptError((char *) "ERROR: Server failed to receive data from client");
+    if (nc_args->storeDir == NULL)		// a recipe has been reported already
+	printf("Server says: %ld bytes written to file '%s'\n", totalBytesRead, nc_args->serverFilename);
     
-    // close the two sockets
-    close(newSocketfd);
+    // close the welcoming socket; receiveFramed() has closed the client's
     close(serverSockfd);
         
     // free any other allocated memory during the client-server communication; NEED FIX !!
@@ -0,0 +1,285 @@
+/*
+ * Per-transfer telemetry, switched on with -v (text) or -j (JSON lines) and written to stderr.
+ *
+ * The transfer paths report every I/O syscall through statsIo(), split into the network side
+ * (socket reads/writes, sendfile(), splice() from a socket) and the disk side (file reads/writes,
+ * splice() into a file, copy_file_range()). For each side the number of syscalls, short reads or
+ * writes, bytes and time spent blocked in the call are kept, plus a power-of-two histogram of
+ * the chunk sizes actually moved. Data sockets contribute their TCP_INFO before they are closed.
+ *
+ * A reporter thread prints the live throughput once a second; the final report is printed from
+ * an atexit() handler so that failed transfers are reported too. Counters are updated with
+ * atomic adds because striped transfers move data from several threads at once.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. man 7 tcp (TCP_INFO)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>		// for TCP_INFO
+
+#include "stats.h"
+
+#define STATS_INTERVAL 1		// seconds between live throughput reports
+
+typedef struct stats_side {
+    uint64_t syscalls;				// I/O calls made
+    uint64_t shorts;				// calls that moved fewer bytes than asked for
+    uint64_t errors;				// calls that failed (not counting EINTR/EAGAIN)
+    uint64_t bytes;				// bytes moved
+    uint64_t ns;				// time spent blocked in the calls
+} stats_side_t;
+
+typedef struct stats_tcp {
+    uint64_t sockets;				// sockets that reported TCP_INFO
+    uint64_t rttSum;				// sum of smoothed RTTs, microseconds
+    uint32_t rttMax;
+    uint32_t rttVar;				// RTT variance of the socket with the largest RTT
+    uint32_t cwnd;				// congestion window of the last socket, in segments
+    uint64_t retransmits;			// total retransmitted segments
+} stats_tcp_t;
+
+static int enabled = 0;
+static int json = 0;
+static const char *role = "";
+static stats_side_t sides[2];			// indexed by STATS_NET/STATS_DISK
+static uint64_t histogram[STATS_BUCKETS];
+static uint64_t firstNs = 0, lastNs = 0;	// first and latest time data moved
+static stats_tcp_t tcp;
+static pthread_mutex_t tcpLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *sideNames[2] = { "net", "disk" };
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t load(uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void add(uint64_t *counter, uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Histogram bucket of a chunk of 'n' (> 0) bytes: floor(log2(n)), capped at the last bucket.
+ **/
+static int bucketOf(uint64_t n) {
+    int b = 63 - __builtin_clzll(n);
+    return (b < STATS_BUCKETS) ? b : STATS_BUCKETS - 1;
+}
+
+/**
+ * Human readable lower bound of histogram bucket 'b' into 'label': "512", "4K", "1M".
+ **/
+static void bucketLabel(int b, char *label, size_t len) {
+    if (b >= 20)
+	snprintf(label, len, "%lluM", 1ull << (b - 20));
+    else if (b >= 10)
+	snprintf(label, len, "%lluK", 1ull << (b - 10));
+    else
+	snprintf(label, len, "%llu", 1ull << b);
+}
+
+static double seconds(uint64_t ns) {
+    return ns / 1e9;
+}
+
+static double mbPerSec(uint64_t bytes, uint64_t ns) {
+    return (ns > 0) ? bytes / (1024.0 * 1024.0) / seconds(ns) : 0.0;
+}
+
+uint64_t statsStart(void) {
+    return enabled ? nowNs() : 0;
+}
+
+void statsIo(int where, uint64_t start, size_t want, ssize_t got) {
+
+    stats_side_t *s = &sides[where];
+    uint64_t now, expected = 0;
+
+    if (!enabled)
+	return;
+
+    add(&s->syscalls, 1);
+    if (got < 0) {
+	if (errno != EINTR && errno != EAGAIN)
+	    add(&s->errors, 1);
+	return;
+    }
+    now = nowNs();
+    if (start != 0)
+	add(&s->ns, now - start);
+    if (got == 0)				// end of stream, not a short read
+	return;
+
+    add(&s->bytes, got);
+    if ((size_t) got < want)
+	add(&s->shorts, 1);
+    add(&histogram[bucketOf(got)], 1);
+
+    __atomic_compare_exchange_n(&firstNs, &expected, (start != 0) ? start : now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    __atomic_store_n(&lastNs, now, __ATOMIC_RELAXED);
+}
+
+/**
+ * Read TCP_INFO of 'sockfd' into 'info'.
+ *
+ * Return:
+ * 	0 on success, -1 if 'sockfd' is not a TCP socket
+ **/
+static int tcpInfo(int sockfd, struct tcp_info *info) {
+    socklen_t len = sizeof(*info);
+    memset(info, 0, sizeof(*info));
+    return getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, info, &len);
+}
+
+void statsTcpInfo(int sockfd) {
+
+    struct tcp_info info;
+
+    if (!enabled || tcpInfo(sockfd, &info) < 0)
+	return;
+
+    pthread_mutex_lock(&tcpLock);
+    tcp.sockets++;
+    tcp.rttSum += info.tcpi_rtt;
+    if (info.tcpi_rtt >= tcp.rttMax) {
+	tcp.rttMax = info.tcpi_rtt;
+	tcp.rttVar = info.tcpi_rttvar;
+    }
+    tcp.cwnd = info.tcpi_snd_cwnd;
+    tcp.retransmits += info.tcpi_total_retrans;
+    pthread_mutex_unlock(&tcpLock);
+}
+
+void statsConnection(int id, uint64_t bytes, uint64_t start, int sockfd) {
+
+    struct tcp_info info;
+    uint64_t ns;
+
+    if (!enabled)
+	return;
+
+    ns = nowNs() - start;
+    if (tcpInfo(sockfd, &info) < 0)
+	memset(&info, 0, sizeof(info));
+    statsTcpInfo(sockfd);
+
+    if (json)
+	fprintf(stderr, "{\"event\":\"connection\",\"role\":\"%s\",\"id\":%d,\"bytes\":%llu,\"seconds\":%.6f,\"mb_per_s\":%.2f,"
+		"\"rtt_us\":%u,\"rttvar_us\":%u,\"cwnd\":%u,\"retransmits\":%u}\n",
+		role, id, (unsigned long long) bytes, seconds(ns), mbPerSec(bytes, ns),
+		info.tcpi_rtt, info.tcpi_rttvar, info.tcpi_snd_cwnd, info.tcpi_total_retrans);
+    else
+	fprintf(stderr, "telemetry (%s): connection %d: %llu bytes in %.3f s, %.1f MB/s, rtt %.3f ms, cwnd %u, retransmits %u\n",
+		role, id, (unsigned long long) bytes, seconds(ns), mbPerSec(bytes, ns),
+		info.tcpi_rtt / 1000.0, info.tcpi_snd_cwnd, info.tcpi_total_retrans);
+}
+
+/**
+ * Print the live throughput of the last interval every STATS_INTERVAL seconds, while data moves.
+ **/
+static void *reporterThread(void *arg) {
+
+    uint64_t prevBytes = 0, prevNs = nowNs(), bytes, now;
+
+    for (;;) {
+	sleep(STATS_INTERVAL);
+	bytes = load(&sides[STATS_NET].bytes);
+	now = nowNs();
+	if (bytes != prevBytes) {
+	    if (json)
+		fprintf(stderr, "{\"event\":\"progress\",\"role\":\"%s\",\"bytes\":%llu,\"mb_per_s\":%.2f}\n",
+			role, (unsigned long long) bytes, mbPerSec(bytes - prevBytes, now - prevNs));
+	    else
+		fprintf(stderr, "telemetry (%s): %llu bytes so far, %.1f MB/s\n",
+			role, (unsigned long long) bytes, mbPerSec(bytes - prevBytes, now - prevNs));
+	}
+	prevBytes = bytes;
+	prevNs = now;
+    }
+
+    return NULL;
+}
+
+/**
+ * Print the final report; registered with atexit().
+ **/
+static void statsReport(void) {
+
+    uint64_t bytes = load(&sides[STATS_NET].bytes);
+    uint64_t ns = load(&lastNs) - load(&firstNs);
+    uint64_t rttAvg;
+    char label[16];
+    int i, first;
+
+    pthread_mutex_lock(&tcpLock);
+    rttAvg = (tcp.sockets > 0) ? tcp.rttSum / tcp.sockets : 0;
+
+    if (json) {
+	fprintf(stderr, "{\"event\":\"final\",\"role\":\"%s\",\"bytes\":%llu,\"seconds\":%.6f,\"mb_per_s\":%.2f",
+		role, (unsigned long long) bytes, seconds(ns), mbPerSec(bytes, ns));
+	for (i = 0; i < 2; i++)
+	    fprintf(stderr, ",\"%s\":{\"syscalls\":%llu,\"short\":%llu,\"errors\":%llu,\"bytes\":%llu,\"blocked_s\":%.6f}",
+		    sideNames[i], (unsigned long long) load(&sides[i].syscalls), (unsigned long long) load(&sides[i].shorts),
+		    (unsigned long long) load(&sides[i].errors), (unsigned long long) load(&sides[i].bytes),
+		    seconds(load(&sides[i].ns)));
+	fprintf(stderr, ",\"chunks\":{");
+	for (i = 0, first = 1; i < STATS_BUCKETS; i++) {
+	    if (load(&histogram[i]) == 0)
+		continue;
+	    fprintf(stderr, "%s\"%llu\":%llu", first ? "" : ",", 1ull << i, (unsigned long long) load(&histogram[i]));
+	    first = 0;
+	}
+	fprintf(stderr, "},\"tcp\":{\"sockets\":%llu,\"rtt_us\":%llu,\"rtt_max_us\":%u,\"rttvar_us\":%u,\"cwnd\":%u,\"retransmits\":%llu}}\n",
+		(unsigned long long) tcp.sockets, (unsigned long long) rttAvg, tcp.rttMax, tcp.rttVar, tcp.cwnd,
+		(unsigned long long) tcp.retransmits);
+    } else {
+	fprintf(stderr, "telemetry (%s): %llu bytes in %.3f s, %.1f MB/s\n",
+		role, (unsigned long long) bytes, seconds(ns), mbPerSec(bytes, ns));
+	for (i = 0; i < 2; i++)
+	    fprintf(stderr, "  %-5s %llu syscalls, %llu short, %llu errors, %llu bytes, %.3f s blocked\n",
+		    sideNames[i], (unsigned long long) load(&sides[i].syscalls), (unsigned long long) load(&sides[i].shorts),
+		    (unsigned long long) load(&sides[i].errors), (unsigned long long) load(&sides[i].bytes),
+		    seconds(load(&sides[i].ns)));
+	fprintf(stderr, "  chunks");
+	for (i = 0; i < STATS_BUCKETS; i++) {
+	    if (load(&histogram[i]) == 0)
+		continue;
+	    bucketLabel(i, label, sizeof(label));
+	    fprintf(stderr, " %s+:%llu", label, (unsigned long long) load(&histogram[i]));
+	}
+	fprintf(stderr, "\n");
+	if (tcp.sockets > 0)
+	    fprintf(stderr, "  tcp   %llu sockets, rtt %.3f ms (max %.3f, var %.3f), cwnd %u, %llu retransmits\n",
+		    (unsigned long long) tcp.sockets, rttAvg / 1000.0, tcp.rttMax / 1000.0, tcp.rttVar / 1000.0,
+		    tcp.cwnd, (unsigned long long) tcp.retransmits);
+    }
+    pthread_mutex_unlock(&tcpLock);
+}
+
+void statsInit(const char *who, int asJson) {
+
+    pthread_t reporter;
+
+    role = who;
+    json = asJson;
+    enabled = 1;
+    atexit(statsReport);
+
+    if (pthread_create(&reporter, NULL, reporterThread, NULL) == 0)
+	pthread_detach(reporter);
+}
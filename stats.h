@@ -0,0 +1,62 @@
+/*
+ * header file for the per-transfer telemetry printed with -v (and -j)
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define STATS_NET 0				// I/O on a socket
+#define STATS_DISK 1				// I/O on the file being sent or written
+
+#define STATS_BUCKETS 24			// chunk size histogram: power-of-two buckets from 1 byte to 8 MB and up
+
+/**
+ * Switch telemetry on for this process. 'role' ("client"/"server") labels every report; with
+ * 'json' set reports are JSON objects, one per line, instead of text. A reporter thread prints
+ * the live throughput every second and the final report is printed when the process exits.
+ *
+ * Return:
+ * 	void
+ **/
+void statsInit(const char *role, int json);
+
+/**
+ * Timestamp to hand to statsIo() once the I/O call it brackets has returned.
+ *
+ * Return:
+ * 	monotonic time in nanoseconds, or 0 when telemetry is off
+ **/
+uint64_t statsStart(void);
+
+/**
+ * Account for one I/O syscall on the STATS_NET or STATS_DISK side that asked for 'want' bytes
+ * and moved 'got' (negative on error). Time since 'start' counts as blocked on that side; a
+ * 'start' of 0 records no time, for calls that do not block the caller (io_uring completions).
+ *
+ * Return:
+ * 	void
+ **/
+void statsIo(int where, uint64_t start, size_t want, ssize_t got);
+
+/**
+ * Fold the kernel's TCP_INFO for 'sockfd' (RTT, congestion window, retransmits) into the
+ * report; to be called right before a data socket is closed.
+ *
+ * Return:
+ * 	void
+ **/
+void statsTcpInfo(int sockfd);
+
+/**
+ * Report one finished connection of the persistent server: 'bytes' received since 'start'
+ * (a statsStart() value) on 'sockfd', which is still open.
+ *
+ * Return:
+ * 	void
+ **/
+void statsConnection(int id, uint64_t bytes, uint64_t start, int sockfd);
+
+#endif
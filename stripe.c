@@ -0,0 +1,277 @@
+/*
+ * Striped transfers: one byte range of a file is split into N contiguous stripes which travel
+ * over N parallel TCP connections (-s N at the client). A single TCP stream cannot fill a long
+ * fat pipe, N streams together can.
+ *
+ * Every stripe connection starts with an ncp_hdr_t naming its index, the number of stripes and
+ * where its bytes belong in the output file. The server accepts all N connections, and one
+ * thread per stripe places the data at its offset with splice() (a pwrite() with an explicit
+ * offset in the fallback path), so no reassembly step is needed afterwards. Framed transfers
+ * (e.g. -a) frame and verify every stripe as a stream of its own.
+ *
+ * username: abdpatel@indiana.edu
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "nc_args_t.h"
+#include "proto.h"
+#include "transfer.h"
+#include "frame.h"
+#include "stripe.h"
+#include "stats.h"			// telemetry for -v
+#include "tune.h"			// socket options
+#include "output.h"			// preallocation and O_DIRECT writes
+#include "pace.h"			// -P share of each stripe
+
+int connectToServer(nc_args_t *);		// defined in client.c
+
+/**
+ * Work description for one stripe, shared by the sending and the receiving side
+ **/
+typedef struct stripe_job {
+    nc_args_t *nc_args;				// client: where to connect, which file to reopen for the fallback
+    int filefd;					// client: input file; server: output file
+    int sockfd;					// server: accepted connection carrying this stripe
+    off_t fileOffset;				// client: where the stripe starts in the input file
+    ncp_hdr_t hdr;				// header sent / received for this stripe
+    off_t done;					// bytes moved by the thread, -1 on failure
+} stripe_job_t;
+
+/**
+ * Thread body: connect, announce the stripe and send its bytes.
+ **/
+static void *sendStripeThread(void *arg) {
+
+    stripe_job_t *job = (stripe_job_t *) arg;
+    ssize_t n;
+    FILE *fp;
+    frame_ctx_t ctx;
+    int sockfd = connectToServer(job->nc_args);
+
+    job->done = -1;
+    paceWeight(sockfd, (double) job->hdr.length);	// -P: share by length, so the stripes finish together
+    tuneLatency(sockfd, !(job->hdr.flags & NCP_F_FRAMED));	// no answer is awaited, so the header may be corked with the data
+    if (sendHeader(sockfd, &job->hdr) < 0) {
+	close(sockfd);
+	return NULL;
+    }
+
+    if (job->hdr.flags & NCP_F_FRAMED) {
+	// every stripe is its own framed stream with its own MACs and trailer
+	n = -1;
+	if (frameInit(&ctx, sockfd, &job->hdr) == 0) {
+	    n = frameSendFile(&ctx, job->filefd, job->fileOffset, job->hdr.length);
+	    frameFree(&ctx);
+	}
+    } else
+	n = zeroCopySend(sockfd, job->filefd, job->fileOffset, job->hdr.length);
+    if (n < 0 && !(job->hdr.flags & NCP_F_FRAMED) && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EXDEV)) {
+	// each stripe needs its own stdio stream for the buffered fallback, they seek independently
+	if ( (fp = fopen(job->nc_args->clientFilename, "r")) != NULL ) {
+	    n = bufferedSend(sockfd, fp, job->fileOffset, job->hdr.length);
+	    fclose(fp);
+	}
+    }
+
+    if (n == (ssize_t) job->hdr.length)
+	job->done = n;
+    tuneFlush(sockfd);
+    statsTcpInfo(sockfd);
+    close(sockfd);
+    return NULL;
+}
+
+/**
+ * Split 'count' bytes of file 'filefd' starting at 'offset' into nc_args->stripes ranges and
+ * send each one over its own connection, all at the same time.
+ *
+ * Return:
+ * 	number of bytes sent, or -1 if any stripe failed
+ **/
+off_t sendStripes(nc_args_t *nc_args, int filefd, off_t offset, off_t count, uint32_t flags) {
+
+    stripe_job_t jobs[MAX_STRIPES];
+    pthread_t threads[MAX_STRIPES];
+    int nstripes = nc_args->stripes, i;
+    off_t start = 0, total = 0;
+
+    if (nstripes > count)			// never send empty stripes
+	nstripes = (count > 0) ? count : 1;
+
+    for (i = 0; i < nstripes; i++) {
+	memset(&jobs[i], 0, sizeof(stripe_job_t));
+	jobs[i].nc_args = nc_args;
+	jobs[i].filefd = filefd;
+	jobs[i].fileOffset = offset + start;
+	jobs[i].hdr.flags = NCP_F_STRIPE | flags;
+	jobs[i].hdr.stripe = i;
+	jobs[i].hdr.nstripes = nstripes;
+	jobs[i].hdr.offset = start;		// offsets in the output file are relative to the sent range
+	jobs[i].hdr.length = count / nstripes + ((i < count % nstripes) ? 1 : 0);
+	jobs[i].hdr.total = count;
+	start += jobs[i].hdr.length;
+
+	if (pthread_create(&threads[i], NULL, sendStripeThread, &jobs[i]) != 0) {
+	    nstripes = i;			// join the ones already running, then report failure
+	    total = -1;
+	    break;
+	}
+    }
+
+    for (i = 0; i < nstripes; i++) {
+	pthread_join(threads[i], NULL);
+	if (jobs[i].done < 0)
+	    total = -1;
+	else if (total >= 0)
+	    total += jobs[i].done;
+    }
+
+    return total;
+}
+
+/**
+ * Thread body: write the stripe's payload at its offset in the output file.
+ **/
+static void *receiveStripeThread(void *arg) {
+
+    stripe_job_t *job = (stripe_job_t *) arg;
+    off_t at = job->hdr.offset;
+    ssize_t n;
+    frame_ctx_t ctx;
+    output_t out;
+
+    if (job->hdr.flags & NCP_F_FRAMED) {
+	n = -1;
+	if (frameInit(&ctx, job->sockfd, &job->hdr) == 0) {
+	    n = frameReceiveFile(&ctx, job->filefd, at, job->hdr.length);
+	    frameFree(&ctx);
+	}
+    } else if (outputDirect()) {
+	n = -1;
+	if (outputOpen(&out, job->filefd, at) == 0) {
+	    n = outputReceive(&out, job->sockfd, job->hdr.length);
+	    if (outputClose(&out) < 0)
+		n = -1;
+	}
+    } else {
+	n = spliceReceive(job->filefd, job->sockfd, job->hdr.length, &at);
+	if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+	    n = bufferedReceive(job->filefd, job->sockfd, job->hdr.length, &at);
+    }
+
+    if (n < 0 && errno == EBADMSG)
+	fprintf(stderr, "Server says: stripe %u rejected, a chunk failed verification\n", job->hdr.stripe);
+    job->done = (n == (ssize_t) job->hdr.length) ? n : -1;
+    statsTcpInfo(job->sockfd);
+    close(job->sockfd);
+    return NULL;
+}
+
+/**
+ * Check that stripe header 'hdr' belongs to the transfer announced by 'first': the same flags,
+ * so no stripe is less authenticated or encrypted than the first one, and a range of the file
+ * that none of the 'nAccepted' stripes in 'accepted' holds already.
+ *
+ * Return:
+ * 	1 if valid, 0 otherwise
+ **/
+static int validStripe(const ncp_hdr_t *hdr, const ncp_hdr_t *first, const char *seen, const stripe_job_t *accepted, int nAccepted) {
+
+    int i;
+
+    if (!((hdr->flags & NCP_F_STRIPE) && hdr->flags == first->flags && hdr->nstripes == first->nstripes
+	  && hdr->total == first->total && hdr->stripe < hdr->nstripes && !seen[hdr->stripe]
+	  && hdr->offset <= hdr->total && hdr->length <= hdr->total - hdr->offset))
+	return 0;
+
+    for (i = 0; i < nAccepted; i++)
+	if (hdr->offset < accepted[i].hdr.offset + accepted[i].hdr.length && accepted[i].hdr.offset < hdr->offset + hdr->length)
+	    return 0;
+    return 1;
+}
+
+/**
+ * Receive a striped transfer whose first connection 'firstSockfd' was accepted on 'listenfd'.
+ *
+ * Return:
+ * 	number of bytes received, or -1 on error
+ **/
+off_t receiveStripes(int listenfd, int firstSockfd, const ncp_hdr_t *first, int outfd) {
+
+    stripe_job_t jobs[MAX_STRIPES];
+    pthread_t threads[MAX_STRIPES];
+    char seen[MAX_STRIPES];			// stripe indices already accepted
+    int started = 0, sockfd, i;
+    off_t total = 0;
+    uint64_t claimed = 0;			// bytes of the file the accepted stripes carry
+    ncp_hdr_t hdr = *first;
+
+    memset(seen, 0, sizeof(seen));
+    if (first->nstripes == 0 || first->nstripes > MAX_STRIPES || !validStripe(first, first, seen, NULL, 0)) {
+	fprintf(stderr, "ERROR: Invalid stripe header from client\n");
+	close(firstSockfd);
+	return -1;
+    }
+
+    // size and allocate the output file once up front (a sparse one is only sized); stripes then fill it in any order
+    if (((first->flags & NCP_F_SPARSE) ? ftruncate(outfd, first->total) : outputReserve(outfd, 0, first->total, 0)) < 0) {
+	close(firstSockfd);
+	return -1;
+    }
+
+    for (sockfd = firstSockfd; ; ) {
+	// the ranges do not overlap, so the last stripe completes the file exactly when the lengths add up
+	claimed += hdr.length;
+	if (started + 1 == (int) first->nstripes && claimed != first->total) {
+	    fprintf(stderr, "ERROR: Stripes from client do not cover the file\n");
+	    close(sockfd);
+	    total = -1;
+	    break;
+	}
+	seen[hdr.stripe] = 1;
+	jobs[started].filefd = outfd;
+	jobs[started].sockfd = sockfd;
+	jobs[started].hdr = hdr;
+	if (pthread_create(&threads[started], NULL, receiveStripeThread, &jobs[started]) != 0) {
+	    close(sockfd);
+	    total = -1;
+	    break;
+	}
+	if (++started == (int) first->nstripes)
+	    break;
+
+	// accept the next stripe connection and read its header
+	do
+	    sockfd = accept(listenfd, NULL, NULL);
+	while (sockfd < 0 && errno == EINTR);
+	if (sockfd < 0) {
+	    total = -1;
+	    break;
+	}
+	if (recvHeader(sockfd, &hdr) < 0 || !validStripe(&hdr, first, seen, jobs, started)) {
+	    fprintf(stderr, "ERROR: Invalid stripe header from client\n");
+	    close(sockfd);
+	    total = -1;
+	    break;
+	}
+    }
+
+    for (i = 0; i < started; i++) {
+	pthread_join(threads[i], NULL);
+	if (jobs[i].done < 0)
+	    total = -1;
+	else if (total >= 0)
+	    total += jobs[i].done;
+    }
+
+    return total;
+}
@@ -0,0 +1,33 @@
+/*
+ * header file for striped (parallel multi-stream) file transfers
+ */
+
+#ifndef STRIPE_H_
+#define STRIPE_H_
+
+#include <sys/types.h>
+
+#include "nc_args_t.h"
+#include "proto.h"
+
+/**
+ * Split 'count' bytes of file 'filefd' starting at 'offset' into nc_args->stripes ranges and
+ * send each one over its own connection, all at the same time. 'flags' are the NCP_F_* bits
+ * of the transfer, added to every stripe header.
+ *
+ * Return:
+ * 	number of bytes sent, or -1 if any stripe failed
+ **/
+off_t sendStripes(nc_args_t *nc_args, int filefd, off_t offset, off_t count, uint32_t flags);
+
+/**
+ * Receive a striped transfer whose first connection 'firstSockfd' (header already read into
+ * 'first') was accepted on 'listenfd'. The remaining stripes are accepted from 'listenfd' and
+ * every stripe is written at its own offset of the file 'outfd' in parallel.
+ *
+ * Return:
+ * 	number of bytes received, or -1 on error
+ **/
+off_t receiveStripes(int listenfd, int firstSockfd, const ncp_hdr_t *first, int outfd);
+
+#endif
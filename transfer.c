@@ -0,0 +1,444 @@
+/*
+ * The data transfer engine used by both client and server to move payload bytes between
+ * files and sockets.
+ *
+ * The preferred path is zero-copy: the kernel moves file pages straight into the socket
+ * with sendfile() (or into another file with copy_file_range()), so the payload never
+ * enters user space and large ranges go out in a handful of syscalls. The old buffered
+ * path (fread() into a user-space buffer, then write()) is kept for kernels or file types
+ * where zero-copy is not available.
+ *
+ * On the receiving side socket data is spliced into a pipe and from the pipe into the
+ * output file, again without a copy through user space.
+ *
+ * How much every call moves (the buffer size, the pipe size) comes from tune.c: fixed with -b,
+ * otherwise grown while it pays off.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. man 2 sendfile, man 2 copy_file_range, man 2 splice
+ */
+
+#define _GNU_SOURCE			// for copy_file_range()
+
+#include <stdio.h>
+#include <unistd.h>			// for write(), copy_file_range()
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>			// for fstat()
+#include <sys/sendfile.h>		// for sendfile()
+#include <fcntl.h>			// for splice()
+#include <arpa/inet.h>
+
+#include <stdlib.h>			// for malloc()
+
+#include "transfer.h"
+#include "stats.h"			// telemetry for -v
+#include "tune.h"			// transfer buffer sizing
+#include "pace.h"			// -P send pacing
+
+#define SEND_SLICE (8 * 1024 * 1024)		// largest sendfile() call, so that auto tuning can look at the link in between
+
+/**
+ * Write exactly 'count' bytes from 'buf' to 'fd', retrying on short writes and EINTR; the
+ * writes are accounted to the STATS_NET or STATS_DISK side given by 'where', and the ones to
+ * the network are paced with -P.
+ *
+ * Return:
+ * 	number of bytes written, or -1 on error
+ **/
+static ssize_t writeLoop(int fd, const void *buf, size_t count, int where) {
+
+    const char *p = (const char *) buf;
+    size_t total = 0;				// bytes written so far
+    size_t want;
+    uint64_t start;
+    ssize_t n;
+
+    while (total < count) {
+	want = count - total;
+	if (where == STATS_NET) {
+	    want = paceSlice(fd, want);
+	    paceWait(fd, want);
+	}
+	start = statsStart();
+	n = write(fd, p + total, want);
+	statsIo(where, start, want, n);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	total += n;
+    }
+
+    return total;
+}
+
+/**
+ * Write exactly 'count' bytes from 'buf' to socket 'fd', retrying on short writes and EINTR.
+ *
+ * Return:
+ * 	number of bytes written, or -1 on error
+ **/
+ssize_t writeAll(int fd, const void *buf, size_t count) {
+    return writeLoop(fd, buf, count, STATS_NET);
+}
+
+/**
+ * Write exactly 'count' bytes from 'buf' to file 'fd', like writeAll().
+ *
+ * Return:
+ * 	number of bytes written, or -1 on error
+ **/
+ssize_t writeFileAll(int fd, const void *buf, size_t count) {
+    return writeLoop(fd, buf, count, STATS_DISK);
+}
+
+/**
+ * Write all 'iovcnt' buffers of 'iov' to 'fd' as one gathered write, retrying on short writes;
+ * accounted to the side given by 'where' and paced like writeLoop(). A frame is not split for
+ * pacing, the bucket's debt spaces out the next write instead.
+ *
+ * Return:
+ * 	number of bytes written, or -1 on error
+ **/
+static ssize_t writevLoop(int fd, struct iovec *iov, int iovcnt, int where) {
+
+    size_t total = 0;				// bytes written so far
+    size_t want;
+    uint64_t start;
+    ssize_t n;
+    int i;
+
+    while (iovcnt > 0) {
+	for (i = 0, want = 0; i < iovcnt; i++)
+	    want += iov[i].iov_len;
+	if (where == STATS_NET)
+	    paceWait(fd, want);
+	start = statsStart();
+	n = writev(fd, iov, iovcnt);
+	statsIo(where, start, want, n);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	total += n;
+
+	// skip the buffers that went out completely, trim the one that went out partly
+	while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+	    n -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *) iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+
+    return total;
+}
+
+/**
+ * Write all 'iovcnt' buffers of 'iov' to socket 'fd' as one gathered write.
+ *
+ * Return:
+ * 	number of bytes written, or -1 on error
+ **/
+ssize_t writevAll(int fd, struct iovec *iov, int iovcnt) {
+    return writevLoop(fd, iov, iovcnt, STATS_NET);
+}
+
+/**
+ * Write all 'iovcnt' buffers of 'iov' to file 'fd', like writevAll().
+ *
+ * Return:
+ * 	number of bytes written, or -1 on error
+ **/
+ssize_t writevFileAll(int fd, struct iovec *iov, int iovcnt) {
+    return writevLoop(fd, iov, iovcnt, STATS_DISK);
+}
+
+/**
+ * Read exactly 'count' bytes from 'fd' into 'buf', retrying on short reads and EINTR.
+ *
+ * Return:
+ * 	number of bytes read (less than 'count' only at end of stream), or -1 on error
+ **/
+ssize_t readAll(int fd, void *buf, size_t count) {
+
+    char *p = (char *) buf;
+    size_t total = 0;				// bytes read so far
+    uint64_t start;
+    ssize_t n;
+
+    while (total < count) {
+	start = statsStart();
+	n = read(fd, p + total, count - total);
+	statsIo(STATS_NET, start, count - total, n);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (n == 0)				// peer closed the connection
+	    break;
+	total += n;
+    }
+
+    return total;
+}
+
+/**
+ * Send 'count' bytes of file 'infd' starting at 'offset' to 'outfd' without copying the
+ * data through user space.
+ *
+ * Return:
+ * 	number of bytes sent (less than 'count' only if the file is shorter than expected),
+ * 	or -1 on error
+ **/
+ssize_t zeroCopySend(int outfd, int infd, off_t offset, size_t count) {
+
+    struct stat outStat;
+    int useCopyRange;				// copy_file_range() only works between regular files
+    size_t total = 0, want;			// bytes sent so far
+    uint64_t start;
+    tune_state_t tune;
+    ssize_t n;
+
+    if (fstat(outfd, &outStat) < 0)
+	return -1;
+    useCopyRange = S_ISREG(outStat.st_mode);
+    tuneBegin(&tune, useCopyRange ? -1 : outfd, 1);
+
+    while (total < count) {
+	want = (count - total < SEND_SLICE) ? count - total : SEND_SLICE;
+	if (!useCopyRange) {
+	    want = paceSlice(outfd, want);
+	    paceWait(outfd, want);
+	}
+	start = statsStart();
+	if (useCopyRange)
+	    n = copy_file_range(infd, &offset, outfd, NULL, want, 0);
+	else
+	    n = sendfile(outfd, infd, &offset, want);	// sendfile() advances 'offset' for us
+	statsIo(useCopyRange ? STATS_DISK : STATS_NET, start, want, n);
+
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (total > 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EXDEV))
+		errno = EIO;			// part of the range already went out, a fallback would duplicate it
+	    return -1;
+	}
+	if (n == 0)				// end of file reached before 'count' bytes
+	    break;
+	total += n;
+	tuneUpdate(&tune, n);
+    }
+
+    return total;
+}
+
+/**
+ * Send 'count' bytes of 'fp' starting at 'offset' to 'outfd' through a user-space buffer.
+ *
+ * Return:
+ * 	number of bytes sent, or -1 on error
+ **/
+ssize_t bufferedSend(int outfd, FILE *fp, off_t offset, size_t count) {
+
+    char *input;				// read/write buffer
+    size_t total = 0, want, bytesRead;
+    uint64_t start;
+    tune_state_t tune;
+
+    if (fseeko(fp, offset, SEEK_SET) < 0)
+	return -1;
+    if ( (input = malloc(tuneBufferSize())) == NULL )
+	return -1;
+    tuneBegin(&tune, outfd, 1);
+
+    while (total < count) {
+	want = (count - total < tune.chunk) ? count - total : tune.chunk;
+	start = statsStart();
+	bytesRead = fread(input, sizeof(char), want, fp);
+	statsIo(STATS_DISK, start, want, bytesRead);
+	if (bytesRead == 0)
+	    break;
+	// write exactly what was read; the data may be binary, so strlen() cannot be used here
+	if (writeAll(outfd, input, bytesRead) < 0) {
+	    free(input);
+	    return -1;
+	}
+	total += bytesRead;
+	tuneUpdate(&tune, bytesRead);
+    }
+
+    free(input);
+    return total;
+}
+
+#define SPLICE_CHUNK 65536			// default pipe capacity, used when the pipe cannot be resized
+
+/**
+ * Copy the rest of the receive through a user-space buffer after splice() into 'outfd' turned
+ * out to be unsupported. Whatever is already sitting in the pipe goes out first.
+ *
+ * Return:
+ * 	number of bytes copied, or -1 on error
+ **/
+static ssize_t spliceTail(int outfd, int sockfd, int pipeRead, size_t inPipe, size_t left, off_t *outOffset) {
+
+    char *buffer;
+    size_t total = 0, want;
+    uint64_t start;
+    tune_state_t tune;
+    ssize_t n, written;
+
+    if ( (buffer = malloc(tuneBufferSize())) == NULL )
+	return -1;
+    tuneBegin(&tune, sockfd, 0);
+
+    while (inPipe > 0 || left > 0) {
+	want = (inPipe > 0) ? inPipe : left;
+	if (want > tune.chunk)
+	    want = tune.chunk;
+	if (inPipe > 0)
+	    n = read(pipeRead, buffer, want);	// drain bytes the socket side already spliced
+	else {
+	    start = statsStart();
+	    n = read(sockfd, buffer, want);
+	    statsIo(STATS_NET, start, want, n);
+	}
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    goto FAIL;
+	}
+	if (n == 0)
+	    break;
+
+	if (outOffset != NULL) {
+	    start = statsStart();
+	    written = pwrite(outfd, buffer, n, *outOffset);
+	    statsIo(STATS_DISK, start, n, written);
+	    if (written != n)
+		goto FAIL;
+	    *outOffset += n;
+	} else if (writeFileAll(outfd, buffer, n) < 0)
+	    goto FAIL;
+
+	if (inPipe > 0)
+	    inPipe -= n;
+	else {
+	    left -= n;
+	    tuneUpdate(&tune, n);
+	}
+	total += n;
+    }
+
+    free(buffer);
+    return total;
+
+    FAIL:
+    free(buffer);
+    return -1;
+}
+
+/**
+ * Move data arriving on socket 'sockfd' into file 'outfd' through a pipe with splice().
+ *
+ * Return:
+ * 	number of bytes received, or -1 on error
+ **/
+ssize_t spliceReceive(int outfd, int sockfd, size_t count, off_t *outOffset) {
+
+    int pipefd[2];				// pipe that carries the pages from socket to file
+    size_t total = 0;				// bytes received so far
+    size_t left = (count == 0) ? (size_t) -1 : count;	// 0 means read until EOF
+    size_t inPipe, pipeSize, want;
+    uint64_t start;
+    tune_state_t tune;
+    ssize_t n, tail;
+    int savedErrno;
+
+    if (pipe(pipefd) < 0)
+	return -1;
+
+    // a pipe holds SPLICE_CHUNK bytes by default; make room for the largest chunk tuning may pick
+    fcntl(pipefd[1], F_SETPIPE_SZ, (int) tuneBufferSize());	// refused above /proc/sys/fs/pipe-max-size
+    if ( (n = fcntl(pipefd[1], F_GETPIPE_SZ)) > 0 )
+	pipeSize = n;
+    else
+	pipeSize = SPLICE_CHUNK;
+    tuneBegin(&tune, sockfd, 0);
+
+    while (left > 0) {
+	// socket -> pipe
+	want = (tune.chunk < pipeSize) ? tune.chunk : pipeSize;
+	if (want > left)
+	    want = left;
+	start = statsStart();
+	n = splice(sockfd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+	statsIo(STATS_NET, start, want, n);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    goto FAIL;				// with nothing consumed yet, errno tells the caller to fall back
+	}
+	if (n == 0)				// client closed the connection
+	    break;
+	left -= n;
+	tuneUpdate(&tune, n);
+
+	// pipe -> file, until the pipe is empty again
+	inPipe = n;
+	while (inPipe > 0) {
+	    start = statsStart();
+	    n = splice(pipefd[0], NULL, outfd, (loff_t *) outOffset, inPipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+	    statsIo(STATS_DISK, start, inPipe, n);
+	    if (n < 0) {
+		if (errno == EINTR)
+		    continue;
+		if (errno == EINVAL || errno == ENOSYS) {
+		    // this output file cannot be spliced into; finish the receive through a buffer
+		    if ( (tail = spliceTail(outfd, sockfd, pipefd[0], inPipe, left, outOffset)) < 0 )
+			goto FAIL;
+		    total += tail;
+		    goto DONE;
+		}
+		goto FAIL;
+	    }
+	    inPipe -= n;
+	    total += n;
+	}
+    }
+
+    DONE:
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return total;
+
+    FAIL:
+    savedErrno = errno;
+    close(pipefd[0]);
+    close(pipefd[1]);
+    if (total > 0)
+	savedErrno = EIO;			// part of the stream is already on disk, no fallback possible
+    errno = savedErrno;
+    return -1;
+}
+
+/**
+ * Receive from socket 'sockfd' into file 'outfd' through a user-space buffer. Reads
+ * until EOF when 'count' is 0; writes at '*outOffset' (advanced) when it is not NULL.
+ *
+ * Return:
+ * 	number of bytes received, or -1 on error
+ **/
+ssize_t bufferedReceive(int outfd, int sockfd, size_t count, off_t *outOffset) {
+    return spliceTail(outfd, sockfd, -1, 0, (count == 0) ? (size_t) -1 : count, outOffset);
+}
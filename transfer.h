@@ -0,0 +1,94 @@
+/*
+ * header file for the data transfer engine shared by client and server
+ */
+
+#ifndef TRANSFER_H_
+#define TRANSFER_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>			// for struct iovec
+
+/**
+ * Write exactly 'count' bytes from 'buf' to socket 'fd', retrying on short writes and EINTR.
+ *
+ * Return:
+ * 	number of bytes written, or -1 on error
+ **/
+ssize_t writeAll(int fd, const void *buf, size_t count);
+
+/**
+ * Write exactly 'count' bytes from 'buf' to file 'fd' like writeAll(); only differs in being
+ * accounted as disk rather than network I/O by the -v telemetry.
+ *
+ * Return:
+ * 	number of bytes written, or -1 on error
+ **/
+ssize_t writeFileAll(int fd, const void *buf, size_t count);
+
+/**
+ * Write all 'iovcnt' buffers of 'iov' to 'fd' as one gathered write, retrying on short writes.
+ * The iovec array is modified.
+ *
+ * Return:
+ * 	number of bytes written, or -1 on error
+ **/
+ssize_t writevAll(int fd, struct iovec *iov, int iovcnt);
+
+/**
+ * Write all 'iovcnt' buffers of 'iov' to file 'fd' like writevAll(), accounted as disk I/O.
+ *
+ * Return:
+ * 	number of bytes written, or -1 on error
+ **/
+ssize_t writevFileAll(int fd, struct iovec *iov, int iovcnt);
+
+/**
+ * Read exactly 'count' bytes from 'fd' into 'buf', retrying on short reads and EINTR.
+ *
+ * Return:
+ * 	number of bytes read (less than 'count' only at end of stream), or -1 on error
+ **/
+ssize_t readAll(int fd, void *buf, size_t count);
+
+/**
+ * Send 'count' bytes of file 'infd' starting at 'offset' to 'outfd' without copying
+ * the data through user space. sendfile() is used for sockets, copy_file_range()
+ * when 'outfd' is a regular file.
+ *
+ * Return:
+ * 	number of bytes sent, or -1 on error; errno is ENOSYS/EINVAL/EOPNOTSUPP/EXDEV when
+ * 	the kernel cannot do the transfer and nothing has been sent yet, so the caller can fall back
+ **/
+ssize_t zeroCopySend(int outfd, int infd, off_t offset, size_t count);
+
+/**
+ * Send 'count' bytes of 'fp' starting at 'offset' to 'outfd' through a user-space buffer
+ * sized by tune.c.
+ *
+ * Return:
+ * 	number of bytes sent, or -1 on error
+ **/
+ssize_t bufferedSend(int outfd, FILE *fp, off_t offset, size_t count);
+
+/**
+ * Move data arriving on socket 'sockfd' into file 'outfd' through a pipe with splice(), so the
+ * payload never enters user space. Reads until EOF when 'count' is 0, otherwise 'count' bytes.
+ * Writes at '*outOffset' (advanced) when it is not NULL, else at the file's current position.
+ *
+ * Return:
+ * 	number of bytes received, or -1 on error; errno is EINVAL/ENOSYS when the kernel cannot
+ * 	splice from this socket and nothing has been consumed yet, so the caller can fall back
+ **/
+ssize_t spliceReceive(int outfd, int sockfd, size_t count, off_t *outOffset);
+
+/**
+ * Receive from socket 'sockfd' into file 'outfd' through a user-space buffer; the
+ * fallback for spliceReceive(), with the same 'count' and 'outOffset' conventions.
+ *
+ * Return:
+ * 	number of bytes received, or -1 on error
+ **/
+ssize_t bufferedReceive(int outfd, int sockfd, size_t count, off_t *outOffset);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * Run-time sizing of the transfer buffers and socket buffers, and the Nagle/cork setting of the
+ * data sockets.
+ *
+ * With -b/-w the sizes are fixed. In auto mode (the default) every transfer loop starts with a
+ * TUNE_START_CHUNK buffer and measures its throughput over windows of a few chunks: the chunk
+ * is doubled as long as that raises the throughput by more than TUNE_GAIN, then it stays put.
+ * At the same points the socket buffer is compared with the bandwidth-delay product (measured
+ * throughput times the RTT from TCP_INFO) and grown to twice that when it is smaller, so long
+ * fat links are not window-limited. Socket buffers are only ever grown: setting one turns off
+ * the kernel's own autotuning for that socket, which is fine once we ask for more than it gave.
+ *
+ * Small messages and framed data go out with TCP_NODELAY so the last segment is not held back
+ * by Nagle; bulk files are corked so that the header and the payload leave in full segments.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. man 7 tcp (TCP_NODELAY, TCP_CORK, TCP_INFO), man 7 socket (SO_SNDBUF, SO_RCVBUF)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>			// for strcasecmp()
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "tune.h"
+
+#define TUNE_WINDOW_CHUNKS 16			// chunks per measurement window
+#define TUNE_MIN_WINDOW (1024 * 1024)		// but at least this many bytes
+#define TUNE_GAIN 1.10				// a larger chunk must be this much faster to be kept
+
+static size_t fixedChunk = TUNE_AUTO;		// -b, TUNE_AUTO when adapting
+static int fixedSockBuf = TUNE_AUTO;		// -w, TUNE_AUTO when adapting
+static int tcpMode = TUNE_TCP_AUTO;		// -t
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void tuneInit(size_t chunk, int sockBuf, int mode) {
+    fixedChunk = chunk;
+    fixedSockBuf = sockBuf;
+    tcpMode = mode;
+}
+
+long tuneParseSize(const char *text) {
+
+    char *end;
+    long size;
+
+    if (strcasecmp(text, "auto") == 0)
+	return TUNE_AUTO;
+
+    size = strtol(text, &end, 10);
+    if (end == text || size <= 0)
+	return -1;
+    if (*end == 'k' || *end == 'K')
+	size *= 1024, end++;
+    else if (*end == 'm' || *end == 'M')
+	size *= 1024 * 1024, end++;
+
+    return (*end == '\0') ? size : -1;
+}
+
+size_t tuneBufferSize(void) {
+    return (fixedChunk != TUNE_AUTO) ? fixedChunk : TUNE_MAX_CHUNK;
+}
+
+void tuneBegin(tune_state_t *t, int sockfd, int sending) {
+
+    memset(t, 0, sizeof(tune_state_t));
+    t->sockfd = sockfd;
+    t->sockOpt = sending ? SO_SNDBUF : SO_RCVBUF;
+    t->chunk = (fixedChunk != TUNE_AUTO) ? fixedChunk : TUNE_START_CHUNK;
+    t->growing = (fixedChunk == TUNE_AUTO);
+    t->windowStart = nowNs();
+}
+
+/**
+ * Grow the socket buffer of 't' to twice the bandwidth-delay product at 'rate' bytes/ns, if it
+ * is smaller than that.
+ **/
+static void growSocketBuffer(tune_state_t *t, double rate) {
+
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    int current, target;
+    double bdp;
+
+    if (getsockopt(t->sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 || info.tcpi_rtt == 0)
+	return;
+
+    bdp = rate * info.tcpi_rtt * 1000.0;	// tcpi_rtt is in microseconds
+    target = (2 * bdp < TUNE_MAX_SOCKBUF) ? (int) (2 * bdp) : TUNE_MAX_SOCKBUF;
+
+    len = sizeof(current);
+    if (getsockopt(t->sockfd, SOL_SOCKET, t->sockOpt, &current, &len) < 0)
+	return;
+    // the kernel reports twice the size that was set, to account for its bookkeeping overhead
+    if (target > current / 2)
+	setsockopt(t->sockfd, SOL_SOCKET, t->sockOpt, &target, sizeof(target));
+}
+
+void tuneUpdate(tune_state_t *t, size_t moved) {
+
+    uint64_t now, window;
+    double rate;
+
+    if (fixedChunk != TUNE_AUTO && fixedSockBuf != TUNE_AUTO)
+	return;
+
+    t->windowBytes += moved;
+    window = (size_t) TUNE_WINDOW_CHUNKS * t->chunk;
+    if (t->windowBytes < window || t->windowBytes < TUNE_MIN_WINDOW)
+	return;
+
+    now = nowNs();
+    if (now == t->windowStart)
+	return;
+    rate = (double) t->windowBytes / (now - t->windowStart);
+
+    if (t->growing) {
+	if (rate > t->bestRate * TUNE_GAIN && t->chunk * 2 <= TUNE_MAX_CHUNK) {
+	    t->bestRate = rate;
+	    t->chunk *= 2;
+	} else
+	    t->growing = 0;			// the last doubling did not pay off, settle here
+    }
+
+    if (fixedSockBuf == TUNE_AUTO && t->sockfd >= 0)
+	growSocketBuffer(t, rate);
+
+    t->windowStart = now;
+    t->windowBytes = 0;
+}
+
+void tuneSocketBuffers(int sockfd) {
+
+    if (fixedSockBuf == TUNE_AUTO)
+	return;
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &fixedSockBuf, sizeof(fixedSockBuf));
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &fixedSockBuf, sizeof(fixedSockBuf));
+}
+
+void tuneLatency(int sockfd, int bulk) {
+
+    int on = 1;
+
+    if (tcpMode == TUNE_TCP_NODELAY || (tcpMode == TUNE_TCP_AUTO && !bulk))
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    else if (tcpMode == TUNE_TCP_CORK || (tcpMode == TUNE_TCP_AUTO && bulk))
+	setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+void tuneFlush(int sockfd) {
+
+    int off = 0;
+
+    if (tcpMode == TUNE_TCP_CORK || tcpMode == TUNE_TCP_AUTO)
+	setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));	// fails harmlessly on non-TCP sockets
+}
@@ -0,0 +1,107 @@
+/*
+ * header file for run-time I/O buffer sizing and socket options (-b, -w, -t)
+ */
+
+#ifndef TUNE_H_
+#define TUNE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define TUNE_AUTO 0				// -b/-w value meaning "adapt to the link"
+
+#define TUNE_MIN_CHUNK 512			// smallest transfer buffer accepted with -b
+#define TUNE_START_CHUNK 65536			// auto mode's first transfer buffer size
+#define TUNE_MAX_CHUNK (4 * 1024 * 1024)	// auto mode never grows the transfer buffer beyond this
+#define TUNE_MAX_SOCKBUF (64 * 1024 * 1024)	// upper bound for socket buffers, -w or auto (the kernel caps it further)
+
+#define TUNE_TCP_AUTO 0				// TCP_NODELAY for messages and framed data, TCP_CORK for bulk files
+#define TUNE_TCP_NODELAY 1
+#define TUNE_TCP_CORK 2
+#define TUNE_TCP_NONE 3				// kernel defaults (Nagle on, no cork)
+
+/**
+ * Adaptation state of one transfer loop; each thread of a striped transfer keeps its own
+ **/
+typedef struct tune_state {
+    int sockfd;					// socket whose buffer auto mode grows, -1 for none
+    int sockOpt;				// SO_SNDBUF when sending, SO_RCVBUF when receiving
+    size_t chunk;				// bytes to move per call right now
+    int growing;				// auto mode is still trying larger chunks
+    double bestRate;				// best throughput seen so far, bytes per nanosecond
+    uint64_t windowStart;			// start of the current measurement window
+    size_t windowBytes;				// bytes moved in the current measurement window
+} tune_state_t;
+
+/**
+ * Set the process-wide settings: transfer buffer size 'chunk' and socket buffer size 'sockBuf'
+ * in bytes (TUNE_AUTO to adapt them) and the TUNE_TCP_* mode 'tcpMode'.
+ *
+ * Return:
+ * 	void
+ **/
+void tuneInit(size_t chunk, int sockBuf, int tcpMode);
+
+/**
+ * Parse a size given on the command line: a number of bytes with an optional K/M suffix, or "auto".
+ *
+ * Return:
+ * 	the size in bytes, TUNE_AUTO for "auto", or -1 if 'text' is not a size
+ **/
+long tuneParseSize(const char *text);
+
+/**
+ * Bytes a transfer loop must allocate for its buffer: the fixed -b size, or the largest size
+ * auto mode may grow to.
+ *
+ * Return:
+ * 	buffer size in bytes
+ **/
+size_t tuneBufferSize(void);
+
+/**
+ * Start adapting a transfer loop that sends ('sending' set) or receives on 'sockfd' (-1 if the
+ * loop has no socket of its own, e.g. file to file).
+ *
+ * Return:
+ * 	void; t->chunk holds the first chunk size to use
+ **/
+void tuneBegin(tune_state_t *t, int sockfd, int sending);
+
+/**
+ * Account for 'moved' bytes. In auto mode, once per measurement window the chunk size is doubled
+ * while that keeps raising the throughput, and the socket buffer is grown to twice the
+ * bandwidth-delay product seen (throughput times TCP_INFO's RTT) when it is smaller.
+ *
+ * Return:
+ * 	void; t->chunk may have changed
+ **/
+void tuneUpdate(tune_state_t *t, size_t moved);
+
+/**
+ * Apply the -w socket buffer size to 'sockfd'; must happen before connect() or listen() so that
+ * the window scale is negotiated for it. Does nothing in auto mode.
+ *
+ * Return:
+ * 	void
+ **/
+void tuneSocketBuffers(int sockfd);
+
+/**
+ * Set Nagle/cork behaviour of 'sockfd' for what is about to be sent: a bulk file ('bulk' set)
+ * or small messages/frames. With TCP_CORK partial segments are held back until tuneFlush().
+ *
+ * Return:
+ * 	void
+ **/
+void tuneLatency(int sockfd, int bulk);
+
+/**
+ * Push out anything tuneLatency() held back on 'sockfd'.
+ *
+ * Return:
+ * 	void
+ **/
+void tuneFlush(int sockfd);
+
+#endif
@@ -0,0 +1,525 @@
+/*
+ * UDP datagram mode (-U): for fan-in of many small messages, where a TCP handshake per burst
+ * costs more than the data.
+ *
+ * Every datagram starts with a 12-byte header carrying a sequence number, so the server can
+ * tell loss and reordering apart per sender; lost datagrams are counted, not sent again, and
+ * payloads are appended to the output in the order they arrive. A sender ends with a few
+ * copies of an END datagram that carries the number of DATA datagrams it sent; a sender whose
+ * END was lost is given up after UDP_IDLE_MS of silence.
+ *
+ * Both ends move datagrams in batches: the client hands UDP_BATCH messages to one sendmmsg()
+ * and, with UDP GSO, each message is a train of up to UDP_GSO_SEGS datagrams the kernel cuts
+ * apart on its way down, so a syscall moves thousands of datagrams. Headers and payloads are
+ * gathered from separate buffers, the file data is read with one pread() per batch and never
+ * copied. The server takes UDP_BATCH messages per recvmmsg(), with UDP GRO merged back into
+ * trains of up to 64K, and appends all their payloads with a single writev().
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. man 2 sendmmsg, man 2 recvmmsg
+ * 	       2. man 7 udp, "UDP_SEGMENT" and "UDP_GRO"
+ */
+
+#define _GNU_SOURCE			// for sendmmsg() and recvmmsg()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>			// for fstat()
+#include <sys/socket.h>
+#include <sys/uio.h>			// for struct iovec
+#include <netinet/in.h>
+#include <netinet/udp.h>		// for UDP_SEGMENT, UDP_GRO
+#include <arpa/inet.h>
+
+#include "nc_args_t.h"
+#include "udp.h"
+#include "proto.h"			// put64(), get64()
+#include "transfer.h"
+#include "stats.h"			// telemetry for -v
+#include "tune.h"			// -w socket buffers
+#include "resolve.h"			// IPv4 and IPv6 addresses
+#include "pace.h"			// -P send pacing
+
+void promptError(char *);		// defined in netcat_part.c
+
+/**
+ * Sending side: one batch of datagrams, each a header and a payload gathered into one message
+ **/
+typedef struct udp_sender {
+    int sockfd;
+    int segs;					// datagrams per message: UDP_GSO_SEGS with GSO, 1 without
+    uint64_t seq;				// sequence number of the next DATA datagram
+    unsigned char *hdrs;			// UDP_HDR_LEN bytes per datagram of the batch
+    struct iovec *iov;				// header and payload of every datagram
+    size_t payload;				// data bytes per datagram, UDP_PAYLOAD or UDP_PAYLOAD6
+    struct mmsghdr msgs[UDP_BATCH];
+} udp_sender_t;
+
+/**
+ * Receiving side: counts of one sender
+ **/
+typedef struct udp_peer {
+    struct sockaddr_storage addr;		// IPv4 or IPv6
+    int used;
+    int ended;					// END seen
+    long long endedAt;				// nowMs() when it was
+    uint64_t next;				// one past the highest sequence number seen
+    uint64_t received;				// DATA datagrams received
+    uint64_t reordered;				// DATA datagrams that came after a later one
+} udp_peer_t;
+
+static void putHeader(unsigned char *p, uint8_t type, uint64_t seq) {
+    p[0] = UDP_MAGIC0;
+    p[1] = UDP_MAGIC1;
+    p[2] = type;
+    p[3] = 0;
+    put64(p + 4, seq);
+}
+
+/**
+ * Return:
+ * 	datagrams one batch of 's' holds
+ **/
+static size_t batchDatagrams(const udp_sender_t *s) {
+    return (size_t) UDP_BATCH * s->segs;
+}
+
+/**
+ * Send the 'len' bytes of 'data' (at most one batch) as DATA datagrams.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int sendDatagrams(udp_sender_t *s, const unsigned char *data, size_t len) {
+
+    size_t n = (len + s->payload - 1) / s->payload;	// datagrams
+    size_t i, next = 0, k, want, got;
+    size_t slice = paceSlice(s->sockfd, len + n * UDP_HDR_LEN);	// bytes per sendmmsg() while pacing
+    uint64_t start;
+    int nmsgs, r, j, off = 0;
+
+    for (i = 0; i < n; i++) {
+	putHeader(s->hdrs + i * UDP_HDR_LEN, UDP_DATA, s->seq + i);
+	s->iov[2 * i].iov_base = s->hdrs + i * UDP_HDR_LEN;
+	s->iov[2 * i].iov_len = UDP_HDR_LEN;
+	s->iov[2 * i + 1].iov_base = (void *) (data + i * s->payload);
+	s->iov[2 * i + 1].iov_len = (len - i * s->payload < s->payload) ? len - i * s->payload : s->payload;
+    }
+
+    while (next < n) {
+	// one message per train of 'segs' datagrams; the kernel cuts a train at every UDP_HDR_LEN + payload bytes
+	want = 0;
+	for (nmsgs = 0, i = next; i < n && nmsgs < UDP_BATCH && (nmsgs == 0 || want < slice); i += k, nmsgs++) {
+	    k = (n - i < (size_t) s->segs) ? n - i : (size_t) s->segs;
+	    memset(&s->msgs[nmsgs], 0, sizeof(struct mmsghdr));
+	    s->msgs[nmsgs].msg_hdr.msg_iov = s->iov + 2 * i;
+	    s->msgs[nmsgs].msg_hdr.msg_iovlen = 2 * k;
+	    want += k * UDP_HDR_LEN + ((i + k == n) ? len - i * s->payload : k * s->payload);
+	}
+
+	paceWait(s->sockfd, want);
+	start = statsStart();
+	r = sendmmsg(s->sockfd, s->msgs, nmsgs, 0);
+	if (r < 0) {
+	    statsIo(STATS_NET, start, want, r);
+	    if (errno == EINTR)
+		continue;
+	    if ((errno == EIO || errno == EINVAL) && s->segs > 1) {
+		// the device cannot segment after all, send every datagram on its own
+		off = 0;
+		setsockopt(s->sockfd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off));
+		s->segs = 1;
+		continue;
+	    }
+	    return -1;
+	}
+	for (j = 0, got = 0; j < r; j++) {
+	    got += s->msgs[j].msg_len;
+	    next += s->msgs[j].msg_hdr.msg_iovlen / 2;
+	}
+	statsIo(STATS_NET, start, want, got);
+    }
+
+    s->seq += n;
+    return 0;
+}
+
+off_t udpSend(nc_args_t *nc_args) {
+
+    udp_sender_t s;
+    struct stat fileStat;
+    unsigned char end[UDP_HDR_LEN];
+    unsigned char *data = NULL;
+    off_t total = 0, count, offset = nc_args->offset;
+    size_t want;
+    uint64_t start;
+    ssize_t n;
+    int filefd = -1, seg, i;
+
+    memset(&s, 0, sizeof(s));
+    // datagrams go to the first address of the host name: without a handshake there is nothing to race
+    if ( (s.sockfd = socket(nc_args->servAddrs[0].ss_family, SOCK_DGRAM, IPPROTO_UDP)) < 0 )
+	promptError((char *) "UDP socket creation failed");
+    tuneSocketBuffers(s.sockfd);
+    // connected, so datagrams need no address and an absent server shows up as ECONNREFUSED
+    if (connect(s.sockfd, (struct sockaddr *) &nc_args->servAddrs[0], resolveAddrLen(&nc_args->servAddrs[0])) < 0)
+	promptError((char *) "UDP socket could not be connected to server");
+    s.payload = (nc_args->servAddrs[0].ss_family == AF_INET6) ? UDP_PAYLOAD6 : UDP_PAYLOAD;
+    seg = UDP_HDR_LEN + s.payload;
+    s.segs = (setsockopt(s.sockfd, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg)) == 0) ? UDP_GSO_SEGS : 1;
+
+    if ( (s.hdrs = malloc(batchDatagrams(&s) * UDP_HDR_LEN)) == NULL
+	 || (s.iov = malloc(2 * batchDatagrams(&s) * sizeof(struct iovec))) == NULL )
+	goto FAIL;
+
+    if (nc_args->message_mode) {
+	// the message is sent from where it is, in as many datagrams as it takes
+	count = strlen(nc_args->message);
+	if (nc_args->n_bytes > 0 && nc_args->n_bytes < count)
+	    count = nc_args->n_bytes;
+	while (total < count) {
+	    want = (count - total < (off_t) (batchDatagrams(&s) * s.payload)) ? count - total : batchDatagrams(&s) * s.payload;
+	    if (sendDatagrams(&s, (unsigned char *) nc_args->message + total, want) < 0)
+		goto FAIL;
+	    total += want;
+	}
+    } else {
+	if ( (filefd = open(nc_args->clientFilename, O_RDONLY)) < 0 || fstat(filefd, &fileStat) < 0 )
+	    promptError((char *) "ERROR: Could not open client input file");
+	if (offset > fileStat.st_size)
+	    promptError((char *) "ERROR: Offset lies beyond the end of the client input file");
+	count = fileStat.st_size - offset;
+	if (nc_args->n_bytes > 0 && nc_args->n_bytes < count)
+	    count = nc_args->n_bytes;
+	if ( (data = malloc(batchDatagrams(&s) * s.payload)) == NULL )
+	    goto FAIL;
+
+	// one pread() fills a whole batch, the datagrams point into it
+	while (total < count) {
+	    want = (count - total < (off_t) (batchDatagrams(&s) * s.payload)) ? count - total : batchDatagrams(&s) * s.payload;
+	    start = statsStart();
+	    n = pread(filefd, data, want, offset + total);
+	    statsIo(STATS_DISK, start, want, n);
+	    if (n < 0) {
+		if (errno == EINTR)
+		    continue;
+		goto FAIL;
+	    }
+	    if (n == 0)				// file shrank underneath us
+		break;
+	    if (sendDatagrams(&s, data, n) < 0)
+		goto FAIL;
+	    total += n;
+	}
+    }
+
+    putHeader(end, UDP_END, s.seq);
+    for (i = 0; i < UDP_END_COPIES; i++) {
+	if (i > 0)
+	    usleep(UDP_END_GAP_MS * 1000);	// give a full receive buffer time to drain
+	if (send(s.sockfd, end, sizeof(end), 0) < 0) {
+	    // a server that got the first END may already be gone, the rest are only spares
+	    if (i > 0 && errno == ECONNREFUSED)
+		break;
+	    goto FAIL;
+	}
+    }
+    printf("Client says: %llu bytes sent in %llu datagrams%s\n", (unsigned long long) total,
+	   (unsigned long long) s.seq, (s.segs > 1) ? " (GSO)" : "");
+
+    if (filefd >= 0)
+	close(filefd);
+    close(s.sockfd);
+    free(data);
+    free(s.hdrs);
+    free(s.iov);
+    return total;
+
+    FAIL:
+    if (filefd >= 0)
+	close(filefd);
+    close(s.sockfd);
+    free(data);
+    free(s.hdrs);
+    free(s.iov);
+    return -1;
+}
+
+/**
+ * Return:
+ * 	non-zero if 'a' and 'b' are the same address and port
+ **/
+static int sameAddr(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *) a, *b6 = (const struct sockaddr_in6 *) b;
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *) a, *b4 = (const struct sockaddr_in *) b;
+
+    if (a->ss_family != b->ss_family)
+	return 0;
+    if (a->ss_family == AF_INET6)
+	return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(struct in6_addr)) == 0;
+    return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+}
+
+/**
+ * Return:
+ * 	hash of the address and port of 'addr' (FNV-1a)
+ **/
+static unsigned addrHash(const struct sockaddr_storage *addr) {
+
+    const unsigned char *p;
+    unsigned h = 2166136261u;
+    size_t len, i;
+
+    if (addr->ss_family == AF_INET6) {
+	p = (const unsigned char *) &((const struct sockaddr_in6 *) addr)->sin6_addr;
+	len = sizeof(struct in6_addr);
+	h ^= ((const struct sockaddr_in6 *) addr)->sin6_port;
+    } else {
+	p = (const unsigned char *) &((const struct sockaddr_in *) addr)->sin_addr;
+	len = sizeof(struct in_addr);
+	h ^= ((const struct sockaddr_in *) addr)->sin_port;
+    }
+    for (i = 0; i < len; i++)
+	h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+/**
+ * Return:
+ * 	milliseconds of the monotonic clock
+ **/
+static long long nowMs(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Find the counts of the sender 'addr', adding it if it is new; a new sender takes the slot of
+ * one that ended at least UDP_IDLE_MS ago, so a long-running server (-k) does not fill up. Until
+ * then the slot stays with its sender, whose remaining END copies and stragglers would otherwise
+ * come back as a new sender that never ends. '*active' counts the senders that have not ended.
+ *
+ * Return:
+ * 	the sender's entry, or NULL if the table is full
+ **/
+static udp_peer_t *findPeer(udp_peer_t *peers, const struct sockaddr_storage *addr, int *active) {
+
+    unsigned h = addrHash(addr);
+    udp_peer_t *p, *slot = NULL;
+    long long now = 0;
+    int i;
+
+    for (i = 0; i < UDP_MAX_PEERS; i++) {
+	p = &peers[(h + i) % UDP_MAX_PEERS];
+	if (!p->used) {
+	    if (slot == NULL)
+		slot = p;
+	    break;
+	}
+	if (sameAddr(&p->addr, addr))
+	    return p;
+	if (p->ended && slot == NULL) {
+	    if (now == 0)
+		now = nowMs();
+	    if (now - p->endedAt >= UDP_IDLE_MS)
+		slot = p;
+	}
+    }
+    if (slot == NULL)
+	return NULL;
+
+    memset(slot, 0, sizeof(udp_peer_t));
+    slot->used = 1;
+    slot->addr = *addr;
+    (*active)++;
+    return slot;
+}
+
+/**
+ * Print the loss and reorder counts of sender 'p'; 'sent' is the count from its END, and is
+ * only looked at once p->ended is set (an empty file ends with a count of 0).
+ **/
+static void reportPeer(const udp_peer_t *p, uint64_t sent) {
+
+    uint64_t expected = p->ended ? sent : p->next;	// without END, only a gap in the numbers shows a loss
+    char name[RESOLVE_ADDR_STRLEN];
+
+    printf("Server says: %s %s, %llu datagrams received, %llu lost, %llu reordered\n",
+	   resolveFormat(&p->addr, name, sizeof(name)), p->ended ? "ended" : "went quiet",
+	   (unsigned long long) p->received,
+	   (unsigned long long) ((expected > p->received) ? expected - p->received : 0),
+	   (unsigned long long) p->reordered);
+    fflush(stdout);				// a -k server may run on until it is killed
+}
+
+/**
+ * Append the payloads gathered in 'iov' to the output file.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int flushPayloads(int outfd, struct iovec *iov, int *iovcnt) {
+
+    int n = *iovcnt;
+
+    *iovcnt = 0;
+    return (n > 0 && writevFileAll(outfd, iov, n) < 0) ? -1 : 0;
+}
+
+off_t udpServe(nc_args_t *nc_args) {
+
+    udp_peer_t *peers;
+    unsigned char *bufs;
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec recvIov[UDP_BATCH];
+    struct sockaddr_storage names[UDP_BATCH];
+    char control[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+    struct iovec iov[UDP_IOV_MAX];
+    struct pollfd pfd;
+    struct cmsghdr *cmsg;
+    udp_peer_t *peer;
+    unsigned char *p;
+    off_t total = 0;
+    uint64_t seq, start;
+    size_t seg, off, len;
+    int sockfd, outfd, on = 1, size = UDP_RCVBUF, r, i, iovcnt = 0, heard = 0, active = 0;
+
+    if ( (sockfd = socket(nc_args->servAddrs[0].ss_family, SOCK_DGRAM, IPPROTO_UDP)) < 0 )
+	promptError((char *) "Server was unable set up a UDP socket");
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (resolveBind(sockfd, &nc_args->servAddrs[0]) < 0)	// IPv4 first, like the TCP server
+	promptError((char *) "Server encountered error in binding its UDP socket");
+
+    // bursts arrive faster than any disk: a deep queue (beyond rmem_max where allowed) rides them out
+    if (nc_args->sockBuf != TUNE_AUTO)
+	tuneSocketBuffers(sockfd);
+    else if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on));	// older kernels hand every datagram up alone
+
+    if ( (outfd = open(nc_args->serverFilename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 )
+	promptError((char *) "ERROR: Could not open output file at server");
+    peers = calloc(UDP_MAX_PEERS, sizeof(udp_peer_t));
+    bufs = malloc((size_t) UDP_BATCH * UDP_MAX_MSG);
+    if (peers == NULL || bufs == NULL)
+	promptError((char *) "ERROR: Server could not allocate its receive buffers");
+
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    while (1) {
+	// without -k, a quiet socket after the first datagram means the senders are gone
+	if ( (r = poll(&pfd, 1, (heard && !nc_args->persistent) ? UDP_IDLE_MS : -1)) < 0 ) {
+	    if (errno == EINTR)
+		continue;
+	    goto FAIL;
+	}
+	if (r == 0)
+	    break;
+
+	for (i = 0; i < UDP_BATCH; i++) {
+	    recvIov[i].iov_base = bufs + (size_t) i * UDP_MAX_MSG;
+	    recvIov[i].iov_len = UDP_MAX_MSG;
+	    memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+	    msgs[i].msg_hdr.msg_iov = &recvIov[i];
+	    msgs[i].msg_hdr.msg_iovlen = 1;
+	    msgs[i].msg_hdr.msg_name = &names[i];
+	    msgs[i].msg_hdr.msg_namelen = sizeof(names[i]);
+	    msgs[i].msg_hdr.msg_control = control[i];
+	    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+	}
+	start = statsStart();
+	r = recvmmsg(sockfd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+	if (r < 0) {
+	    statsIo(STATS_NET, start, (size_t) UDP_BATCH * UDP_MAX_MSG, r);
+	    if (errno == EINTR || errno == EAGAIN)
+		continue;
+	    goto FAIL;
+	}
+	for (i = 0, len = 0; i < r; i++)
+	    len += msgs[i].msg_len;
+	statsIo(STATS_NET, start, (size_t) UDP_BATCH * UDP_MAX_MSG, len);
+
+	for (i = 0; i < r; i++) {
+	    // a GRO-merged message is a train of datagrams of the size given in its cmsg, the last one shorter
+	    seg = msgs[i].msg_len;
+	    for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+		    seg = *(int *) CMSG_DATA(cmsg);
+	    if (seg == 0)
+		continue;
+
+	    for (off = 0; off < msgs[i].msg_len; off += seg) {
+		p = (unsigned char *) recvIov[i].iov_base + off;
+		len = (msgs[i].msg_len - off < seg) ? msgs[i].msg_len - off : seg;
+		if (len < UDP_HDR_LEN || p[0] != UDP_MAGIC0 || p[1] != UDP_MAGIC1)
+		    continue;			// not one of ours
+		seq = get64(p + 4);
+		peer = findPeer(peers, &names[i], &active);	// NULL: more senders than the table holds, only not counted
+		heard = 1;
+
+		if (p[2] == UDP_END) {
+		    if (peer != NULL && !peer->ended) {
+			peer->ended = 1;
+			peer->endedAt = nowMs();
+			active--;
+			reportPeer(peer, seq);
+		    }
+		    continue;
+		}
+		if (p[2] != UDP_DATA)
+		    continue;
+
+		if (peer != NULL) {
+		    peer->received++;
+		    if (seq < peer->next)
+			peer->reordered++;
+		    else
+			peer->next = seq + 1;
+		}
+		if (len > UDP_HDR_LEN) {
+		    iov[iovcnt].iov_base = p + UDP_HDR_LEN;
+		    iov[iovcnt].iov_len = len - UDP_HDR_LEN;
+		    total += len - UDP_HDR_LEN;
+		    if (++iovcnt == UDP_IOV_MAX && flushPayloads(outfd, iov, &iovcnt) < 0)
+			goto FAIL;
+		}
+	    }
+	}
+	// one gathered write for the whole batch
+	if (flushPayloads(outfd, iov, &iovcnt) < 0)
+	    goto FAIL;
+
+	if (!nc_args->persistent && heard && active == 0)
+	    break;
+    }
+
+    // senders whose END never arrived
+    for (i = 0; i < UDP_MAX_PEERS; i++)
+	if (peers[i].used && !peers[i].ended)
+	    reportPeer(&peers[i], 0);
+
+    close(outfd);
+    close(sockfd);
+    free(peers);
+    free(bufs);
+    return total;
+
+    FAIL:
+    close(outfd);
+    close(sockfd);
+    free(peers);
+    free(bufs);
+    return -1;
+}
@@ -0,0 +1,50 @@
+/*
+ * header file for the UDP datagram mode (-U)
+ */
+
+#ifndef UDP_H_
+#define UDP_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "nc_args_t.h"
+
+#define UDP_HDR_LEN 12				// magic (2) | type (1) | reserved (1) | sequence number (8)
+#define UDP_PAYLOAD 1460			// data bytes per datagram: with the headers it fills a 1500-byte MTU
+#define UDP_PAYLOAD6 1440			// the same over IPv6, whose header is 20 bytes longer
+#define UDP_BATCH 64				// messages per sendmmsg()/recvmmsg() call
+#define UDP_GSO_SEGS 44				// datagrams the kernel cuts one GSO message into (under 64K)
+#define UDP_MAX_MSG 65536			// receive buffer of one message, room for a GRO-merged one
+#define UDP_IOV_MAX 1024			// payloads gathered into one writev() of the output file
+#define UDP_MAX_PEERS 1024			// senders the server keeps loss and reorder counts for
+#define UDP_IDLE_MS 2000			// server gives up on a sender whose END never came, or frees an ended one, after this long
+#define UDP_END_COPIES 3			// END datagrams sent, since any one of them can be lost
+#define UDP_END_GAP_MS 20			// spacing of the END copies, so one burst of loss does not take all of them
+#define UDP_RCVBUF (32 * 1024 * 1024)		// receive buffer the server asks for unless -w sets one
+
+#define UDP_MAGIC0 'N'
+#define UDP_MAGIC1 'U'
+#define UDP_DATA 1				// payload for the output file
+#define UDP_END 2				// sender is done; sequence number is the count of DATA datagrams sent
+
+/**
+ * Send the message or the file range given by 'nc_args' to the server as numbered datagrams,
+ * batched with sendmmsg() and, where the kernel has it, cut into datagrams by UDP GSO.
+ *
+ * Return:
+ * 	number of payload bytes sent, or -1 on error
+ **/
+off_t udpSend(nc_args_t *nc_args);
+
+/**
+ * Receive datagrams on the server's port and append their payloads to the output file, one
+ * gathered write per batch. Loss and reordering are counted per sender and reported when it
+ * ends. Without -k the server returns once every sender it heard from has ended or gone quiet.
+ *
+ * Return:
+ * 	number of payload bytes written, or -1 on error
+ **/
+off_t udpServe(nc_args_t *nc_args);
+
+#endif
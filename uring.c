@@ -0,0 +1,497 @@
+/*
+ * The io_uring transport backend (-u) for the plain file paths of client and server.
+ *
+ * The regular paths issue one blocking syscall per chunk and never have the disk and the
+ * network busy at the same time. Here a small ring of URING_NBUF buffers is registered with
+ * the kernel once, and the client keeps reads of the next chunks of the file in flight while
+ * an earlier chunk is being written to the socket; the server keeps the next socket read in
+ * flight while earlier chunks are written to the output file at their offsets. Everything
+ * queued in one round goes to the kernel in a single io_uring_enter(), which also waits for
+ * the next completion.
+ *
+ * The ring is driven with the raw syscalls so that no extra library is needed. When the
+ * kernel has no io_uring (or it is disabled) the functions fail before touching any data and
+ * the caller falls back to the sendfile()/splice() paths.
+ *
+ * username: abdpatel@indiana.edu
+ *
+ * References: 1. man 7 io_uring, man 2 io_uring_setup, man 2 io_uring_enter
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "stats.h"			// telemetry for -v
+#include "pace.h"			// -P send pacing
+
+#define URING_ENTRIES (2 * URING_NBUF)		// submission queue size, never more than this in flight
+
+// what a completion belongs to; stored in user_data next to the buffer index
+#define OP_FILE_READ 1
+#define OP_SOCK_WRITE 2
+#define OP_SOCK_READ 3
+#define OP_FILE_WRITE 4
+#define OP_CANCEL 5				// cancellation of a request still in flight, see uringDrain()
+
+#define BUF_FREE 0
+#define BUF_BUSY 1				// an operation on the buffer is in flight
+#define BUF_READY 2				// client: filled from the file, waiting for its turn on the socket
+
+/**
+ * One io_uring instance with its mapped rings and registered buffers
+ **/
+typedef struct uring {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+    unsigned toSubmit;				// entries queued since the last io_uring_enter()
+    int fixed;					// 1 if the buffers are registered, READ_FIXED/WRITE_FIXED usable
+    char *block;				// URING_NBUF * URING_BUF_LEN bytes of buffer space
+} uring_t;
+
+/**
+ * State of one buffer of the ring
+ **/
+typedef struct uring_buf {
+    int state;					// BUF_FREE, BUF_BUSY or BUF_READY
+    unsigned long seq;				// position of the chunk in the stream
+    off_t off;					// file offset of the chunk
+    size_t len;					// bytes in the chunk
+    size_t done;				// bytes already read / written, for short transfers
+} uring_buf_t;
+
+/**
+ * Release everything held by 'r'.
+ **/
+static void uringTeardown(uring_t *r) {
+    if (r->sqes != NULL && r->sqes != MAP_FAILED)
+	munmap(r->sqes, r->sqesSize);
+    if (r->cqRing != NULL && r->cqRing != MAP_FAILED && r->cqRing != r->sqRing)
+	munmap(r->cqRing, r->cqRingSize);
+    if (r->sqRing != NULL && r->sqRing != MAP_FAILED)
+	munmap(r->sqRing, r->sqRingSize);
+    if (r->fd >= 0)
+	close(r->fd);
+    free(r->block);
+}
+
+/**
+ * Create the ring, map its queues and register the buffers.
+ *
+ * Return:
+ * 	0 on success, -1 on error with errno set
+ **/
+static int uringSetup(uring_t *r) {
+
+    struct io_uring_params p;
+    struct iovec iov[URING_NBUF];
+    int i, savedErrno;
+
+    memset(r, 0, sizeof(uring_t));
+    memset(&p, 0, sizeof(p));
+    r->fd = -1;
+
+    if ( (r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0 )
+	return -1;
+
+    r->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (r->cqRingSize > r->sqRingSize)
+	    r->sqRingSize = r->cqRingSize;
+	r->cqRingSize = r->sqRingSize;
+    }
+
+    r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sqRing == MAP_FAILED)
+	goto FAIL;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	r->cqRing = r->sqRing;
+    else if ( (r->cqRing = mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED )
+	goto FAIL;
+
+    r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    if ( (r->sqes = mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES)) == MAP_FAILED )
+	goto FAIL;
+
+    r->sqHead = (unsigned *) ((char *) r->sqRing + p.sq_off.head);
+    r->sqTail = (unsigned *) ((char *) r->sqRing + p.sq_off.tail);
+    r->sqMask = (unsigned *) ((char *) r->sqRing + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *) ((char *) r->sqRing + p.sq_off.array);
+    r->cqHead = (unsigned *) ((char *) r->cqRing + p.cq_off.head);
+    r->cqTail = (unsigned *) ((char *) r->cqRing + p.cq_off.tail);
+    r->cqMask = (unsigned *) ((char *) r->cqRing + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cqRing + p.cq_off.cqes);
+
+    if ( (r->block = aligned_alloc(4096, URING_NBUF * URING_BUF_LEN)) == NULL )
+	goto FAIL;
+
+    // registered buffers spare the kernel from mapping user pages on every request
+    for (i = 0; i < URING_NBUF; i++) {
+	iov[i].iov_base = r->block + i * URING_BUF_LEN;
+	iov[i].iov_len = URING_BUF_LEN;
+    }
+    r->fixed = (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, URING_NBUF) == 0);	// RLIMIT_MEMLOCK may refuse
+
+    return 0;
+
+    FAIL:
+    savedErrno = errno;
+    uringTeardown(r);
+    errno = savedErrno;
+    return -1;
+}
+
+/**
+ * Queue a read or write of 'len' bytes between buffer 'buf' (at 'skip' bytes in) and 'fd'.
+ * Nothing reaches the kernel before the next uringEnter().
+ **/
+static void uringQueue(uring_t *r, int write, int fd, int buf, size_t skip, size_t len, off_t off, int op) {
+
+    unsigned tail = *r->sqTail;			// only this thread moves the tail
+    unsigned index = tail & *r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    if (r->fixed) {
+	sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	sqe->buf_index = buf;
+    } else
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) (r->block + buf * URING_BUF_LEN + skip);
+    sqe->len = len;
+    sqe->off = off;				// ignored for sockets
+    sqe->user_data = ((uint64_t) op << 32) | (unsigned) buf;
+
+    r->sqArray[index] = index;
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+    r->toSubmit++;
+}
+
+/**
+ * Submit everything queued and wait for at least one completion.
+ *
+ * Return:
+ * 	0 on success, -1 on error
+ **/
+static int uringEnter(uring_t *r) {
+
+    int n;
+
+    do
+	n = syscall(__NR_io_uring_enter, r->fd, r->toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    while (n < 0 && errno == EINTR);
+    if (n < 0)
+	return -1;
+
+    r->toSubmit -= n;
+    return 0;
+}
+
+/**
+ * Take the next completion off the completion queue.
+ *
+ * Return:
+ * 	1 with '*op', '*buf' and '*res' set, 0 if the queue is empty
+ **/
+static int uringReap(uring_t *r, int *op, int *buf, int *res) {
+
+    unsigned head = *r->cqHead;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE))
+	return 0;
+
+    cqe = &r->cqes[head & *r->cqMask];
+    *op = (int) (cqe->user_data >> 32);
+    *buf = (int) (cqe->user_data & 0xffffffff);
+    *res = cqe->res;
+
+    __atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Queue the cancellation of request 'op' on buffer 'buf', if it is still in flight.
+ **/
+static void uringCancel(uring_t *r, int op, int buf) {
+
+    unsigned tail = *r->sqTail;
+    unsigned index = tail & *r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = ((uint64_t) op << 32) | (unsigned) buf;	// user_data of the request, as uringQueue() set it
+    sqe->user_data = (uint64_t) OP_CANCEL << 32;
+
+    r->sqArray[index] = index;
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+    r->toSubmit++;
+}
+
+/**
+ * Cancel the 'inFlight' requests still running on 'r' and reap every one of them, so that
+ * nothing the kernel does afterwards touches the buffers or the files. A busy buffer of 'bufs'
+ * has one request on it, of type 'opA' or 'opB'; the cancel that finds nothing gets ENOENT.
+ *
+ * Return:
+ * 	0 once nothing is in flight, -1 if the ring failed with requests still running
+ **/
+static int uringDrain(uring_t *r, const uring_buf_t *bufs, int inFlight, int opA, int opB) {
+
+    int cancels = 0, i, op, buf, res, n;
+
+    // what a failed uringEnter() left queued goes first, which also makes room for the cancels
+    while (r->toSubmit > 0) {
+	if ( (n = syscall(__NR_io_uring_enter, r->fd, r->toSubmit, 0, 0, NULL, 0)) < 0 && errno != EINTR )
+	    return -1;
+	if (n > 0)
+	    r->toSubmit -= n;
+    }
+
+    for (i = 0; i < URING_NBUF; i++)
+	if (bufs[i].state == BUF_BUSY) {
+	    uringCancel(r, opA, i);
+	    uringCancel(r, opB, i);
+	    cancels += 2;
+	}
+
+    while (inFlight > 0 || cancels > 0) {
+	if (uringEnter(r) < 0)
+	    return -1;
+	while (uringReap(r, &op, &buf, &res)) {
+	    if (op == OP_CANCEL)
+		cancels--;
+	    else
+		inFlight--;
+	}
+    }
+    return 0;
+}
+
+/**
+ * Translate a failed request into errno. Failures that mean io_uring cannot be used keep their
+ * errno only while no payload has moved, so the caller never falls back halfway.
+ *
+ * Return:
+ * 	-1, for use in return statements
+ **/
+static int uringFail(int res, size_t moved) {
+    errno = -res;
+    if (moved > 0 && (errno == EINVAL || errno == ENOSYS || errno == EPERM || errno == EOPNOTSUPP))
+	errno = EIO;
+    return -1;
+}
+
+/**
+ * Send 'count' bytes of file 'filefd' starting at 'offset' to socket 'sockfd' through io_uring.
+ *
+ * Return:
+ * 	number of bytes sent, or -1 on error
+ **/
+ssize_t uringSend(int sockfd, int filefd, off_t offset, size_t count) {
+
+    uring_t r;
+    uring_buf_t bufs[URING_NBUF];
+    off_t nextOff = offset, endOff = offset + count;
+    unsigned long nextReadSeq = 0, nextWriteSeq = 0;
+    int inFlight = 0, writing = 0;		// requests in flight; 1 while a socket write is in flight
+    int i, op, res;
+    size_t sent = 0;
+
+    if (uringSetup(&r) < 0)
+	return -1;
+    memset(bufs, 0, sizeof(bufs));
+
+    while (1) {
+	// keep every free buffer busy reading the next chunk of the file
+	for (i = 0; i < URING_NBUF && nextOff < endOff; i++) {
+	    if (bufs[i].state != BUF_FREE)
+		continue;
+	    bufs[i].state = BUF_BUSY;
+	    bufs[i].seq = nextReadSeq++;
+	    bufs[i].off = nextOff;
+	    bufs[i].len = (endOff - nextOff < URING_BUF_LEN) ? endOff - nextOff : URING_BUF_LEN;
+	    bufs[i].done = 0;
+	    nextOff += bufs[i].len;
+	    uringQueue(&r, 0, filefd, i, 0, bufs[i].len, bufs[i].off, OP_FILE_READ);
+	    inFlight++;
+	}
+
+	// the socket is a stream, so chunks go out strictly in order, one write at a time
+	for (i = 0; i < URING_NBUF && !writing; i++) {
+	    if (bufs[i].state != BUF_READY || bufs[i].seq != nextWriteSeq)
+		continue;
+	    if (bufs[i].len == 0) {		// chunk past a premature end of file
+		bufs[i].state = BUF_FREE;
+		nextWriteSeq++;
+		i = -1;				// the next chunk in order may be ready as well
+		continue;
+	    }
+	    bufs[i].state = BUF_BUSY;
+	    bufs[i].done = 0;
+	    paceWait(sockfd, bufs[i].len);	// the file reads already queued go on meanwhile
+	    uringQueue(&r, 1, sockfd, i, 0, bufs[i].len, 0, OP_SOCK_WRITE);
+	    inFlight++;
+	    writing = 1;
+	}
+
+	if (inFlight == 0)
+	    break;
+	if (uringEnter(&r) < 0)
+	    goto FAIL;
+
+	while (uringReap(&r, &op, &i, &res)) {
+	    inFlight--;
+	    if (res < 0) {
+		uringFail(res, sent);
+		goto FAIL;
+	    }
+
+	    // completions report no blocking time of their own; the waiting happens in uringEnter()
+	    statsIo((op == OP_FILE_READ) ? STATS_DISK : STATS_NET, 0, bufs[i].len - bufs[i].done, res);
+	    if (op == OP_FILE_READ) {
+		bufs[i].done += res;
+		if (res == 0) {			// file is shorter than expected; stop reading further
+		    bufs[i].len = bufs[i].done;
+		    if (endOff > bufs[i].off + (off_t) bufs[i].len)
+			endOff = nextOff = bufs[i].off + bufs[i].len;
+		}
+		if (bufs[i].done < bufs[i].len) {	// short read, fetch the rest of the chunk
+		    uringQueue(&r, 0, filefd, i, bufs[i].done, bufs[i].len - bufs[i].done, bufs[i].off + bufs[i].done, OP_FILE_READ);
+		    inFlight++;
+		} else
+		    bufs[i].state = BUF_READY;
+	    } else {				// OP_SOCK_WRITE
+		bufs[i].done += res;
+		sent += res;
+		if (bufs[i].done < bufs[i].len) {	// short write, send the rest before anything else
+		    uringQueue(&r, 1, sockfd, i, bufs[i].done, bufs[i].len - bufs[i].done, 0, OP_SOCK_WRITE);
+		    inFlight++;
+		} else {
+		    bufs[i].state = BUF_FREE;
+		    nextWriteSeq++;
+		    writing = 0;
+		}
+	    }
+	}
+    }
+
+    uringTeardown(&r);
+    return sent;
+
+    FAIL:
+    res = errno;
+    if (uringDrain(&r, bufs, inFlight, OP_FILE_READ, OP_SOCK_WRITE) < 0)
+	r.block = NULL;				// leaked rather than freed under a request that may still fill it
+    uringTeardown(&r);
+    errno = res;
+    return -1;
+}
+
+/**
+ * Receive from socket 'sockfd' into file 'outfd' at 'offset' through io_uring.
+ *
+ * Return:
+ * 	number of bytes received, or -1 on error
+ **/
+ssize_t uringReceive(int outfd, int sockfd, off_t offset, size_t count) {
+
+    uring_t r;
+    uring_buf_t bufs[URING_NBUF];
+    size_t left = (count == 0) ? (size_t) -1 : count;	// 0 means read until EOF
+    size_t received = 0;
+    off_t nextOff = offset;
+    int inFlight = 0, reading = 0, eof = 0;	// 'reading' is 1 while a socket read is in flight
+    int i, op, res;
+
+    if (uringSetup(&r) < 0)
+	return -1;
+    memset(bufs, 0, sizeof(bufs));
+
+    while (1) {
+	// one socket read at a time keeps the byte order; file writes of earlier chunks overlap with it
+	for (i = 0; i < URING_NBUF && !reading && !eof && left > 0; i++) {
+	    if (bufs[i].state != BUF_FREE)
+		continue;
+	    bufs[i].state = BUF_BUSY;
+	    bufs[i].len = (left < URING_BUF_LEN) ? left : URING_BUF_LEN;
+	    bufs[i].done = 0;
+	    uringQueue(&r, 0, sockfd, i, 0, bufs[i].len, 0, OP_SOCK_READ);
+	    inFlight++;
+	    reading = 1;
+	}
+
+	if (inFlight == 0)
+	    break;
+	if (uringEnter(&r) < 0)
+	    goto FAIL;
+
+	while (uringReap(&r, &op, &i, &res)) {
+	    inFlight--;
+	    if (res < 0) {
+		uringFail(res, received);
+		goto FAIL;
+	    }
+
+	    statsIo((op == OP_SOCK_READ) ? STATS_NET : STATS_DISK, 0, bufs[i].len - bufs[i].done, res);
+	    if (op == OP_SOCK_READ) {
+		reading = 0;
+		if (res == 0) {			// client closed the connection
+		    eof = 1;
+		    bufs[i].state = BUF_FREE;
+		    continue;
+		}
+		received += res;
+		left -= res;
+		bufs[i].off = nextOff;
+		bufs[i].len = res;
+		bufs[i].done = 0;
+		nextOff += res;
+		uringQueue(&r, 1, outfd, i, 0, res, bufs[i].off, OP_FILE_WRITE);
+		inFlight++;
+	    } else {				// OP_FILE_WRITE
+		bufs[i].done += res;
+		if (res == 0) {
+		    errno = ENOSPC;
+		    goto FAIL;
+		}
+		if (bufs[i].done < bufs[i].len) {
+		    uringQueue(&r, 1, outfd, i, bufs[i].done, bufs[i].len - bufs[i].done, bufs[i].off + bufs[i].done, OP_FILE_WRITE);
+		    inFlight++;
+		} else
+		    bufs[i].state = BUF_FREE;
+	    }
+	}
+    }
+
+    uringTeardown(&r);
+    return received;
+
+    FAIL:
+    res = errno;
+    if (uringDrain(&r, bufs, inFlight, OP_SOCK_READ, OP_FILE_WRITE) < 0)
+	r.block = NULL;
+    uringTeardown(&r);
+    errno = res;
+    return -1;
+}
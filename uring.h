@@ -0,0 +1,32 @@
+/*
+ * header file for the io_uring transport backend (-u)
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <sys/types.h>
+
+#define URING_NBUF 8				// registered buffers, i.e. I/O requests kept in flight
+#define URING_BUF_LEN (128 * 1024)		// size of each registered buffer
+
+/**
+ * Send 'count' bytes of file 'filefd' starting at 'offset' to socket 'sockfd' through io_uring,
+ * keeping several file reads in flight while earlier chunks are written to the socket.
+ *
+ * Return:
+ * 	number of bytes sent, or -1 on error; errno is ENOSYS/EINVAL/EPERM/EOPNOTSUPP when io_uring
+ * 	is not usable on this kernel and nothing has been sent yet, so the caller can fall back
+ **/
+ssize_t uringSend(int sockfd, int filefd, off_t offset, size_t count);
+
+/**
+ * Receive from socket 'sockfd' into file 'outfd' at 'offset' through io_uring, overlapping the
+ * next socket read with the file writes of earlier chunks. Reads until EOF when 'count' is 0.
+ *
+ * Return:
+ * 	number of bytes received, or -1 on error; errno as for uringSend() when the caller may fall back
+ **/
+ssize_t uringReceive(int outfd, int sockfd, off_t offset, size_t count);
+
+#endif